@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <ftw.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmark of lib_tar on synthetic archives.
+ *
+ * The archive is generated first: a tree of directories of a given depth and fan-out, the files spread evenly over
+ * the directories, with sizes drawn from a fixed, exponential or bimodal distribution, and a given fraction of
+ * symlinks to files. Then check_archive, exists, list, find and read_file are timed with the scanning functions,
+ * with the index (built from the archive or loaded from a sidecar), in mmap mode and with a block cache, with a warm
+ * page cache and with a cold one (the archive is evicted before each operation), and optionally on a gzip-compressed
+ * copy of the archive. Batches of reads are also timed with an asynchronous context, all of a batch in flight at once,
+ * the whole archive is extracted, with a single thread and with one per online processor, and manifests of its
+ * contents are written with SHA-256 and XXH64 digests.
+ *
+ * For each operation the benchmark reports the throughput, the median and 99th percentile latencies, and the number
+ * of read and write system calls per operation, taken from /proc/self/io.
+ */
+
+typedef struct bench_options {
+    size_t nb_members;      // number of files and symlinks in the archive
+    size_t mean_size;       // mean size of the files
+    char distribution;      // 'f'ixed, 'e'xponential or 'b'imodal sizes
+    int depth;              // depth of the directory tree
+    int fanout;             // number of subdirectories of each directory
+    double link_density;    // fraction of the members that are symlinks
+    size_t nb_ops;          // number of operations timed with the index
+    size_t nb_scan_ops;     // number of operations timed with the scanning functions, which cost a whole scan each
+    const char *archive;    // path of the generated archive
+    int keep;               // keep the archive after the benchmark
+    int cold;               // also time the operations with a cold page cache
+    int gzip;               // also time the operations on a gzip-compressed copy of the archive
+} bench_options_t;
+
+/* a reservoir of paths, so that the queries are drawn uniformly from the whole archive without keeping every path */
+typedef struct bench_sample {
+    char **paths;
+    size_t nb_paths;
+    size_t capacity;
+    size_t seen;
+} bench_sample_t;
+
+typedef struct bench_ctx {
+    int tar_fd;
+    tar_index_t *index;
+    char sidecar[PATH_MAX];
+    char extract_dir[PATH_MAX];
+    char **entries;
+    size_t nb_entries;
+    uint8_t *buffer;
+    size_t buffer_len;
+    tar_async_t *async;
+    bench_sample_t *async_paths;    // paths of the reads of a batch, drawn at random
+    uint8_t *async_buffer;          // BENCH_ASYNC_BATCH buffers of buffer_len bytes
+    size_t async_done;              // reads of the batch whose callback was run
+    FILE *null_out;                 // discards the manifests
+} bench_ctx_t;
+
+typedef int (*bench_op_t)(bench_ctx_t *ctx, char *path);
+
+static long long syscalls_overhead;//system calls issued by syscalls() itself
+
+#define BENCH_MAX_ENTRIES 4096
+#define BENCH_BUFFER_LEN (64 * 1024)
+#define BENCH_ASYNC_BATCH 64
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, the archive is the same from one run to the other */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_double(void) {
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t draw_size(const bench_options_t *options) {
+    switch (options->distribution){
+        case 'e':
+            return (size_t) (-log(1.0 - rng_double()) * options->mean_size);
+        case 'b'://mostly small files and a few large ones, with the requested mean
+            return rng_double() < 0.95 ? options->mean_size / 10 : options->mean_size * 181 / 10;
+        default:
+            return options->mean_size;
+    }
+}
+
+static void sample_add(bench_sample_t *sample, const char *path) {
+    sample->seen++;
+    if (sample->nb_paths < sample->capacity){
+        sample->paths[sample->nb_paths++] = strdup(path);
+        return;
+    }
+    size_t i = rng_next() % sample->seen;
+    if (i < sample->capacity){
+        free(sample->paths[i]);
+        sample->paths[i] = strdup(path);
+    }
+}
+
+/* returns size bytes of content, the same for every file */
+static const uint8_t *file_content(size_t size) {
+    static uint8_t *data;
+    static size_t capacity;
+    if (size > capacity){
+        free(data);
+        capacity = size > 2 * capacity ? size : 2 * capacity;
+        data = malloc(capacity);
+        memset(data, 'x', capacity);
+    }
+    return data;
+}
+
+/* writes a directory, its members and its subdirectories, depth first so that members follow their directory */
+static void generate_dir(tar_writer_t *out, const bench_options_t *options, const char *path, int depth, size_t *remaining,
+                         size_t per_dir, bench_sample_t *files, bench_sample_t *dirs, bench_sample_t *links) {
+
+    tar_member_info_t info = {0644, 1000, 1000, 1600000000, "bench", "bench"};
+    if (path[0]){
+        info.mode = 0755;
+        tar_writer_add_dir(out, path, &info);
+        info.mode = 0644;
+        sample_add(dirs, path);
+    }
+
+    char name[sizeof(((tar_header_t *) 0)->name) + 1];
+    for (size_t i = 0; i < per_dir && *remaining; i++, (*remaining)--){
+        snprintf(name, sizeof(name), "%sf%zu.dat", path, i);
+        if (files->seen && rng_double() < options->link_density){
+            char target[sizeof(name) + 3 * depth];//a symlink target is relative to the directory of the link
+            size_t len = 0;
+            for (int j = 0; j < depth; j++) len += snprintf(target + len, sizeof(target) - len, "../");
+            snprintf(target + len, sizeof(target) - len, "%s", files->paths[rng_next() % files->nb_paths]);
+            snprintf(name, sizeof(name), "%sl%zu", path, i);
+            tar_writer_add_symlink(out, name, target, &info);
+            sample_add(links, name);
+        } else {
+            size_t size = draw_size(options);
+            tar_writer_add_file(out, name, file_content(size), size, &info);
+            sample_add(files, name);
+        }
+    }
+
+    if (depth < options->depth){
+        for (int i = 0; i < options->fanout; i++){
+            snprintf(name, sizeof(name), "%sd%d/", path, i);
+            generate_dir(out, options, name, depth + 1, remaining, per_dir, files, dirs, links);
+        }
+    }
+}
+
+static int generate(const bench_options_t *options, bench_sample_t *files, bench_sample_t *dirs, bench_sample_t *links) {
+
+    int fd = open(options->archive, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1){
+        perror("open(archive)");
+        return -1;
+    }
+    tar_writer_t *out = tar_writer_open(fd, 0);
+    if (out == NULL){
+        close(fd);
+        return -1;
+    }
+
+    size_t nb_dirs = 1;
+    size_t level = 1;
+    for (int d = 0; d < options->depth; d++){
+        level *= options->fanout;
+        nb_dirs += level;
+    }
+    size_t per_dir = (options->nb_members + nb_dirs - 1) / nb_dirs;
+    size_t remaining = options->nb_members;
+
+    generate_dir(out, options, "", 0, &remaining, per_dir, files, dirs, links);
+
+    int ret = tar_writer_close(out);
+    fsync(fd);//written pages cannot be evicted for the cold cache runs
+    close(fd);
+    return ret;
+}
+
+/* number of read and write system calls issued by the process so far */
+static long long syscalls(void) {
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io == NULL) return 0;
+    char line[128];
+    long long total = 0, value;
+    while (fgets(line, sizeof(line), io) != NULL){
+        if (sscanf(line, "syscr: %lld", &value) == 1 || sscanf(line, "syscw: %lld", &value) == 1) total += value;
+    }
+    fclose(io);
+    return total;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *op, const char *mode, int cold, bench_ctx_t *ctx, bench_op_t fn,
+                bench_sample_t *sample, size_t nb_ops) {
+
+    if (!sample->nb_paths || !nb_ops) return;
+
+    double *latencies = malloc(nb_ops * sizeof(double));
+    double total = 0;
+    long long calls = 0;
+
+    for (size_t i = 0; i < nb_ops; i++){
+        char *path = sample->paths[rng_next() % sample->nb_paths];
+        if (cold) posix_fadvise(ctx->tar_fd, 0, 0, POSIX_FADV_DONTNEED);
+        long long calls_before = syscalls();
+        double start = now();
+        fn(ctx, path);
+        latencies[i] = now() - start;
+        calls += syscalls() - calls_before - syscalls_overhead;
+        total += latencies[i];
+    }
+
+    qsort(latencies, nb_ops, sizeof(double), compare_doubles);
+    printf("%-16s %-6s %-5s %12.1f %12.1f %12.1f %10.1f\n", op, mode, cold ? "cold" : "warm", nb_ops / total,
+           latencies[nb_ops / 2] * 1e6, latencies[nb_ops * 99 / 100] * 1e6, (double) calls / nb_ops);
+    fflush(stdout);
+    free(latencies);
+}
+
+static int op_check(bench_ctx_t *ctx, char *path) {
+    return check_archive(ctx->tar_fd);
+}
+
+static int op_check_parallel(bench_ctx_t *ctx, char *path) {
+    return check_archive_parallel(ctx->tar_fd, 0, NULL);
+}
+
+static int op_exists(bench_ctx_t *ctx, char *path) {
+    return exists(ctx->tar_fd, path);
+}
+
+static int op_list(bench_ctx_t *ctx, char *path) {
+    size_t len = ctx->nb_entries;
+    return list(ctx->tar_fd, path, ctx->entries, &len);
+}
+
+static int op_read_file(bench_ctx_t *ctx, char *path) {
+    size_t len = ctx->buffer_len;
+    return read_file(ctx->tar_fd, path, 0, ctx->buffer, &len);
+}
+
+static int count_found(const tar_entry_t *entry, void *arg) {
+    (*(size_t *) arg)++;
+    return 0;
+}
+
+/* finds every member under a directory */
+static int op_find(bench_ctx_t *ctx, char *path) {
+    char pattern[PATH_MAX];
+    size_t nb_found = 0;
+    snprintf(pattern, sizeof(pattern), "%s*", path);
+    return tar_find(ctx->tar_fd, pattern, 0, count_found, &nb_found) < 0;
+}
+
+static int op_gzip_open(bench_ctx_t *ctx, char *path) {
+    tar_close_gzip(ctx->tar_fd);
+    return tar_open_gzip(ctx->tar_fd, 0);
+}
+
+static int op_index_build(bench_ctx_t *ctx, char *path) {
+    tar_index_free(tar_index_build(ctx->tar_fd));
+    return 0;
+}
+
+static int op_index_load(bench_ctx_t *ctx, char *path) {
+    tar_index_t *index = tar_index_load(ctx->tar_fd, ctx->sidecar);
+    int ret = index != NULL && tar_index_exists(index, path);//a cold start answers a first query
+    tar_index_free(index);
+    return ret;
+}
+
+static int op_index_exists(bench_ctx_t *ctx, char *path) {
+    return tar_index_exists(ctx->index, path);
+}
+
+static int op_index_list(bench_ctx_t *ctx, char *path) {
+    size_t len = ctx->nb_entries;
+    return tar_index_list(ctx->index, path, ctx->entries, &len);
+}
+
+static int op_index_find(bench_ctx_t *ctx, char *path) {
+    char pattern[PATH_MAX];
+    size_t nb_found = 0;
+    snprintf(pattern, sizeof(pattern), "%s*", path);
+    return tar_index_find(ctx->index, pattern, 0, count_found, &nb_found) < 0;
+}
+
+static int op_index_read_file(bench_ctx_t *ctx, char *path) {
+    size_t len = ctx->buffer_len;
+    return tar_index_read_file(ctx->index, path, 0, ctx->buffer, &len);
+}
+
+static void count_async(ssize_t ret, size_t len, void *arg) {
+    (*(size_t *) arg)++;
+}
+
+/* reads a batch of files with an asynchronous context, all of them in flight at the same time */
+static int op_async_read_file(bench_ctx_t *ctx, char *path) {
+    ctx->async_done = 0;
+    for (size_t i = 0; i < BENCH_ASYNC_BATCH; i++){
+        char *batch_path = i ? ctx->async_paths->paths[rng_next() % ctx->async_paths->nb_paths] : path;
+        tar_async_read_file(ctx->async, batch_path, 0, ctx->async_buffer + i * ctx->buffer_len, ctx->buffer_len,
+                            count_async, &ctx->async_done);
+    }
+    while (ctx->async_done < BENCH_ASYNC_BATCH) tar_async_poll(ctx->async, 1);
+    return 0;
+}
+
+static int op_extract(bench_ctx_t *ctx, char *path) {
+    return tar_extract(ctx->tar_fd, ctx->extract_dir, &(tar_extract_options_t) {.nb_threads = 1});
+}
+
+static int op_extract_parallel(bench_ctx_t *ctx, char *path) {
+    return tar_extract(ctx->tar_fd, ctx->extract_dir, NULL);
+}
+
+static int op_manifest(bench_ctx_t *ctx, char *path) {
+    return tar_manifest(ctx->tar_fd, TAR_DIGEST_SHA256, 0, ctx->null_out);
+}
+
+static int op_manifest_xxh64(bench_ctx_t *ctx, char *path) {
+    return tar_manifest(ctx->tar_fd, TAR_DIGEST_XXH64, 0, ctx->null_out);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* writes a gzip-compressed copy of the archive, returns -1 if it could not be written */
+static int compress_archive(const char *archive, const char *path) {
+    FILE *in = fopen(archive, "rb");
+    gzFile out = gzopen(path, "wb1");//fast compression, the benchmark times the reads
+    if (in == NULL || out == NULL){
+        if (in != NULL) fclose(in);
+        if (out != NULL) gzclose(out);
+        return -1;
+    }
+    char buffer[64 * 1024];
+    size_t n;
+    int ret = 0;
+    while (ret == 0 && (n = fread(buffer, 1, sizeof(buffer), in)) > 0){
+        if (gzwrite(out, buffer, n) != (int) n) ret = -1;
+    }
+    fclose(in);
+    if (gzclose(out) != Z_OK) ret = -1;
+    return ret;
+}
+
+/* runs every operation with the scanning functions */
+static void run_scans(const char *mode, int cold, bench_ctx_t *ctx, const bench_options_t *options,
+                      bench_sample_t *files, bench_sample_t *dirs) {
+
+    bench_sample_t archive = {.paths = (char *[]) {""}, .nb_paths = 1};
+    size_t nb_checks = options->nb_scan_ops < 10 ? options->nb_scan_ops : 10;
+
+    run("check_archive", mode, cold, ctx, op_check, &archive, nb_checks);
+    run("check_parallel", mode, cold, ctx, op_check_parallel, &archive, nb_checks);
+    run("exists", mode, cold, ctx, op_exists, files, options->nb_scan_ops);
+    run("list", mode, cold, ctx, op_list, dirs, options->nb_scan_ops);
+    run("find", mode, cold, ctx, op_find, dirs, options->nb_scan_ops);
+    run("read_file", mode, cold, ctx, op_read_file, files, options->nb_scan_ops);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n members] [-s mean_size] [-D f|e|b] [-d depth] [-f fanout] [-l link_density]\n"
+                    "          [-q index_ops] [-Q scan_ops] [-o archive] [-k] [-c] [-z]\n", name);
+}
+
+int main(int argc, char **argv) {
+
+    bench_options_t options = {
+        .nb_members = 10000,
+        .mean_size = 4096,
+        .distribution = 'e',
+        .depth = 3,
+        .fanout = 4,
+        .link_density = 0.05,
+        .nb_ops = 10000,
+        .nb_scan_ops = 50,
+        .archive = "bench.tar",
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:D:d:f:l:q:Q:o:kczh")) != -1){
+        switch (opt){
+            case 'n': options.nb_members = strtoull(optarg, NULL, 10); break;
+            case 's': options.mean_size = strtoull(optarg, NULL, 10); break;
+            case 'D': options.distribution = optarg[0]; break;
+            case 'd': options.depth = atoi(optarg); break;
+            case 'f': options.fanout = atoi(optarg); break;
+            case 'l': options.link_density = atof(optarg); break;
+            case 'q': options.nb_ops = strtoull(optarg, NULL, 10); break;
+            case 'Q': options.nb_scan_ops = strtoull(optarg, NULL, 10); break;
+            case 'o': options.archive = optarg; break;
+            case 'k': options.keep = 1; break;
+            case 'c': options.cold = 1; break;
+            case 'z': options.gzip = 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    int dir_len = snprintf(NULL, 0, "d%d/", options.fanout);
+    if (options.depth * dir_len + 24 > (int) sizeof(((tar_header_t *) 0)->name)){
+        fprintf(stderr, "depth %d does not fit in the name of a ustar header\n", options.depth);
+        return -1;
+    }
+
+    bench_sample_t files = {.capacity = 1024}, dirs = {.capacity = 1024}, links = {.capacity = 1024};
+    files.paths = malloc(files.capacity * sizeof(char *));
+    dirs.paths = malloc(dirs.capacity * sizeof(char *));
+    links.paths = malloc(links.capacity * sizeof(char *));
+
+    syscalls_overhead = -syscalls();
+    syscalls_overhead += syscalls();
+
+    double start = now();
+    if (generate(&options, &files, &dirs, &links) < 0) return -1;
+    struct stat st;
+    stat(options.archive, &st);
+    printf("generated %s: %zu files, %zu directories, %zu symlinks, %lld bytes in %.2f s\n\n", options.archive,
+           files.seen, dirs.seen, links.seen, (long long) st.st_size, now() - start);
+
+    bench_ctx_t ctx = {.nb_entries = BENCH_MAX_ENTRIES, .buffer_len = BENCH_BUFFER_LEN};
+    ctx.tar_fd = open(options.archive, O_RDONLY);
+    if (ctx.tar_fd == -1){
+        perror("open(archive)");
+        return -1;
+    }
+    snprintf(ctx.sidecar, sizeof(ctx.sidecar), "%s.idx", options.archive);
+    snprintf(ctx.extract_dir, sizeof(ctx.extract_dir), "%s.d", options.archive);
+    ctx.entries = malloc(BENCH_MAX_ENTRIES * sizeof(char *));
+    for (size_t i = 0; i < BENCH_MAX_ENTRIES; i++) ctx.entries[i] = malloc(256);
+    ctx.buffer = malloc(BENCH_BUFFER_LEN);
+    ctx.async_buffer = malloc(BENCH_ASYNC_BATCH * BENCH_BUFFER_LEN);
+    ctx.null_out = fopen("/dev/null", "w");
+
+    char gzip_path[PATH_MAX];
+    int gzip_fd = -1;
+    snprintf(gzip_path, sizeof(gzip_path), "%s.gz", options.archive);
+    if (options.gzip && compress_archive(options.archive, gzip_path) == 0) gzip_fd = open(gzip_path, O_RDONLY);
+
+    tar_index_t *index = tar_index_build(ctx.tar_fd);
+    if (index != NULL){
+        printf("index: %zu bytes, %.1f bytes per member\n\n", tar_index_memory(index),
+               (double) tar_index_memory(index) / (files.seen + dirs.seen + links.seen));
+        tar_index_free(index);
+    }
+
+    printf("%-16s %-6s %-5s %12s %12s %12s %10s\n", "operation", "mode", "cache", "ops/s", "p50 (us)", "p99 (us)", "syscalls");
+
+    for (int cold = 0; cold <= options.cold; cold++){
+        run_scans("scan", cold, &ctx, &options, &files, &dirs);
+
+        bench_sample_t archive = {.paths = (char *[]) {""}, .nb_paths = 1};
+        run("index_build", "index", cold, &ctx, op_index_build, &archive, 3);
+        ctx.index = tar_index_build(ctx.tar_fd);
+        if (tar_index_save(ctx.index, ctx.sidecar) == 0){
+            run("index_load", "index", cold, &ctx, op_index_load, &files, 3);
+            unlink(ctx.sidecar);
+        }
+        run("exists", "index", cold, &ctx, op_index_exists, &files, options.nb_ops);
+        run("exists_link", "index", cold, &ctx, op_index_exists, &links, options.nb_ops);
+        run("list", "index", cold, &ctx, op_index_list, &dirs, options.nb_ops);
+        run("find", "index", cold, &ctx, op_index_find, &dirs, options.nb_ops);
+        run("read_file", "index", cold, &ctx, op_index_read_file, &files, options.nb_ops);
+        run("read_file_link", "index", cold, &ctx, op_index_read_file, &links, options.nb_ops);
+        tar_index_free(ctx.index);
+
+        tar_handle_t *handle = tar_handle_open(ctx.tar_fd);
+        tar_handle_exists(handle, "");//builds the index before the timed batches
+        ctx.async = tar_async_open(handle, 0, 0);
+        tar_handle_release(handle);
+        if (ctx.async != NULL){
+            ctx.async_paths = &files;
+            run("read_async_x64", "index", cold, &ctx, op_async_read_file, &files, options.nb_ops / BENCH_ASYNC_BATCH);
+            tar_async_close(ctx.async);
+        }
+
+        run("extract", "scan", cold, &ctx, op_extract, &archive, 3);
+        run("extract_parallel", "scan", cold, &ctx, op_extract_parallel, &archive, 3);
+        nftw(ctx.extract_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        run("manifest", "scan", cold, &ctx, op_manifest, &archive, 3);
+        run("manifest_xxh64", "scan", cold, &ctx, op_manifest_xxh64, &archive, 3);
+
+        if (tar_open_mmap(ctx.tar_fd) == 0){
+            run_scans("mmap", cold, &ctx, &options, &files, &dirs);
+            tar_close_mmap(ctx.tar_fd);
+        }
+
+        if (tar_open_cache(ctx.tar_fd, 0) == 0){
+            run_scans("cache", cold, &ctx, &options, &files, &dirs);
+            tar_close_cache(ctx.tar_fd);
+        }
+
+        if (gzip_fd >= 0){
+            int tar_fd = ctx.tar_fd;
+            ctx.tar_fd = gzip_fd;
+            run("gzip_open", "gzip", cold, &ctx, op_gzip_open, &archive, 3);
+            run_scans("gzip", cold, &ctx, &options, &files, &dirs);
+            ctx.tar_fd = tar_fd;
+        }
+    }
+
+    if (gzip_fd >= 0){
+        tar_close_gzip(gzip_fd);
+        close(gzip_fd);
+        unlink(gzip_path);
+    }
+    fclose(ctx.null_out);
+    close(ctx.tar_fd);
+    if (!options.keep) unlink(options.archive);
+    return 0;
+}
@@ -1,379 +1,5443 @@
+#define _GNU_SOURCE
+
 #include "lib_tar.h"
 
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+/*
+ * Statistics and logging
+ *
+ * The counters are global and updated with relaxed atomic additions, only when counting is enabled, so a disabled
+ * counter costs a single load of stats_enabled. The timed functions read CLOCK_MONOTONIC at their start and end
+ * under the same condition. With TAR_NO_STATS, every counter compiles to nothing.
+ *
+ * Diagnostics go through the logger instead of stdio. A message is only formatted when its level is enabled,
+ * so the traces of the hot paths cost a comparison when the logger does not want them.
+ */
+
+typedef struct stats_counters {
+    _Atomic uint64_t headers;
+    _Atomic uint64_t preads;
+    _Atomic uint64_t bytes_read;
+    _Atomic uint64_t index_hits;
+    _Atomic uint64_t index_misses;
+    _Atomic uint64_t link_hops;
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t calls[TAR_STATS_FUNCTIONS];
+    _Atomic uint64_t nanoseconds[TAR_STATS_FUNCTIONS];
+} stats_counters_t;
+
+#ifdef TAR_STATS
+static atomic_int stats_enabled = 1;
+#else
+static atomic_int stats_enabled;
+#endif
+static stats_counters_t counters;
+
+#ifdef TAR_NO_STATS
+#define STATS_ADD(counter, n) ((void) 0)
+#else
+#define STATS_ADD(counter, n) do { \
+        if (atomic_load_explicit(&stats_enabled, memory_order_relaxed)) \
+            atomic_fetch_add_explicit(&counters.counter, (n), memory_order_relaxed); \
+    } while (0)
+#endif
+
+/* returns the time at the start of a timed function, zero when counting is disabled */
+static uint64_t stats_start(void) {
+#ifndef TAR_NO_STATS
+    if (atomic_load_explicit(&stats_enabled, memory_order_relaxed)){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec + 1;//never zero
+    }
+#endif
+    return 0;
+}
+
+/* adds the time since start to a timed function */
+static void stats_stop(int function, uint64_t start) {
+    if (!start) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    atomic_fetch_add_explicit(&counters.calls[function], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters.nanoseconds[function],
+                              (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec + 1 - start, memory_order_relaxed);
+}
+
+/**
+ * Starts or stops counting.
+ *
+ * Counting is off by default, unless the library is compiled with TAR_STATS defined,
+ * and compiled out entirely when it is compiled with TAR_NO_STATS defined.
+ *
+ * @param enabled Non-zero to start counting, zero to stop.
+ */
+void tar_stats_enable(int enabled) {
+    atomic_store(&stats_enabled, enabled != 0);
+}
+
+/**
+ * Reads the counters.
+ *
+ * @param stats An out argument, set to the current value of the counters.
+ */
+void tar_stats_get(tar_stats_t *stats) {
+    stats->headers = atomic_load_explicit(&counters.headers, memory_order_relaxed);
+    stats->preads = atomic_load_explicit(&counters.preads, memory_order_relaxed);
+    stats->bytes_read = atomic_load_explicit(&counters.bytes_read, memory_order_relaxed);
+    stats->index_hits = atomic_load_explicit(&counters.index_hits, memory_order_relaxed);
+    stats->index_misses = atomic_load_explicit(&counters.index_misses, memory_order_relaxed);
+    stats->link_hops = atomic_load_explicit(&counters.link_hops, memory_order_relaxed);
+    stats->cache_hits = atomic_load_explicit(&counters.cache_hits, memory_order_relaxed);
+    stats->cache_misses = atomic_load_explicit(&counters.cache_misses, memory_order_relaxed);
+    for (int i = 0; i < TAR_STATS_FUNCTIONS; i++){
+        stats->calls[i] = atomic_load_explicit(&counters.calls[i], memory_order_relaxed);
+        stats->nanoseconds[i] = atomic_load_explicit(&counters.nanoseconds[i], memory_order_relaxed);
+    }
+}
+
+/**
+ * Sets every counter to zero.
+ */
+void tar_stats_reset(void) {
+    atomic_store(&counters.headers, 0);
+    atomic_store(&counters.preads, 0);
+    atomic_store(&counters.bytes_read, 0);
+    atomic_store(&counters.index_hits, 0);
+    atomic_store(&counters.index_misses, 0);
+    atomic_store(&counters.link_hops, 0);
+    atomic_store(&counters.cache_hits, 0);
+    atomic_store(&counters.cache_misses, 0);
+    for (int i = 0; i < TAR_STATS_FUNCTIONS; i++){
+        atomic_store(&counters.calls[i], 0);
+        atomic_store(&counters.nanoseconds[i], 0);
+    }
+}
+
+static tar_logger_t log_function = tar_log_stderr;
+static int log_max_level = TAR_LOG_WARNING;
+static void *log_arg;
+
+/**
+ * Replaces the logger of the library.
+ *
+ * The library does not write to stdout or stderr by itself. By default its errors and warnings are given to
+ * tar_log_stderr(). This function must not be called while other threads are using the library.
+ *
+ * @param logger The new logger, NULL to discard every diagnostic.
+ * @param max_level The most verbose level given to the logger, the messages of the levels above are not even formatted.
+ * @param arg Passed to logger.
+ */
+void tar_set_logger(tar_logger_t logger, int max_level, void *arg) {
+    log_function = logger;
+    log_max_level = max_level;
+    log_arg = arg;
+}
+
+/**
+ * The default logger, writes each message on a line of stderr.
+ */
+void tar_log_stderr(int level, const char *message, void *arg) {
+    fprintf(stderr, "lib_tar: %s\n", message);
+}
+
+/* formats a diagnostic for the logger, followed by the description of errnum when it is not zero */
+static void tar_log(int level, int errnum, const char *format, ...) {
+    if (log_function == NULL || level > log_max_level) return;
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (errnum && len >= 0 && (size_t) len < sizeof(message)){
+        snprintf(message + len, sizeof(message) - len, ": %s", strerror(errnum));
+    }
+    log_function(level, message, log_arg);
+}
+
+/*
+ * Archive modes
+ *
+ * tar_open_mmap() maps an archive and registers the mapping under its file descriptor, in a table indexed by fd,
+ * and tar_open_gzip() registers the checkpoints of a compressed archive the same way in a second table, and
+ * tar_open_cache() a block cache in a third one.
+ * Every function of this file reads the archive through the header iterator and tar_pread(), which use the mapping
+ * or the checkpoints when there are some, so the header walk becomes pointer arithmetic over the mapping instead of
+ * one pread per header, and a compressed archive is queried like a plain one.
+ *
+ * Lookups do not take any lock: a table is published with an atomic pointer, and when it grows the old table is
+ * kept, so that a thread still reading it never reads freed memory. Changes are serialized by fd_tables_lock.
+ */
+
+typedef struct tar_mapping {
+    const uint8_t *base;
+    size_t size;
+} tar_mapping_t;
+
+typedef struct fd_table {
+    int size;
+    struct fd_table *previous;  // tables replaced by this one
+    _Atomic(void *) slots[];    // slots[fd] is NULL when fd is not in the mode of the table
+} fd_table_t;
+
+static _Atomic(fd_table_t *) mappings;      // tar_mapping_t of the archives in mmap mode
+static _Atomic(fd_table_t *) gzip_indexes;  // tar_gzip_t of the compressed archives
+static _Atomic(fd_table_t *) caches;        // tar_cache_t of the archives with a block cache
+static _Atomic(fd_table_t *) checks;        // check_state_t of the archives validated by check_archive()
+static pthread_mutex_t fd_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const tar_header_t zero_header;//returned for blocks past the end of the archive
+
+static void *fd_table_get(_Atomic(fd_table_t *) *tables, int tar_fd) {
+    fd_table_t *table = atomic_load_explicit(tables, memory_order_acquire);
+    if (table == NULL || tar_fd < 0 || tar_fd >= table->size) return NULL;
+    return atomic_load_explicit(&table->slots[tar_fd], memory_order_acquire);
+}
+
+/* stores value under tar_fd, growing the table so that it can be indexed by tar_fd, fd_tables_lock must be held */
+static int fd_table_set(_Atomic(fd_table_t *) *tables, int tar_fd, void *value) {
+
+    fd_table_t *table = atomic_load(tables);
+    if (table == NULL || tar_fd >= table->size){
+        int size = table ? table->size : 16;
+        while (size <= tar_fd) size *= 2;
+        fd_table_t *new_table = calloc(1, sizeof(fd_table_t) + size * sizeof(void *));
+        if (new_table == NULL) return -1;
+        new_table->size = size;
+        new_table->previous = table;
+        for (int fd = 0; table != NULL && fd < table->size; fd++){
+            atomic_init(&new_table->slots[fd], atomic_load(&table->slots[fd]));
+        }
+        atomic_store_explicit(tables, new_table, memory_order_release);
+        table = new_table;
+    }
+    atomic_store_explicit(&table->slots[tar_fd], value, memory_order_release);
+    return 0;
+}
+
+static tar_mapping_t *get_mapping(int tar_fd) {
+    return fd_table_get(&mappings, tar_fd);
+}
+
+/*
+ * Block kernels
+ *
+ * The checksum of a header and the test for a null block are the innermost loops of every scan.
+ * They come in a scalar version and, on x86, in SSE2 and AVX2 versions summing 16 or 32 bytes per instruction
+ * with psadbw; select_kernels() picks the best version supported by the processor when the library is loaded.
+ */
+
+#define CHKSUM_OFFSET offsetof(tar_header_t, chksum)
+#define CHKSUM_LEN sizeof(((tar_header_t *) 0)->chksum)
+
+/* sum of the bytes of a header, the checksum field counted as spaces, from the sum of all its bytes */
+static uint32_t fix_checksum(const uint8_t *block, uint32_t sum) {
+    for (size_t i = CHKSUM_OFFSET; i < CHKSUM_OFFSET + CHKSUM_LEN; i++){
+        sum += ' ' - block[i];
+    }
+    return sum;
+}
+
+static uint32_t header_checksum_scalar(const uint8_t *block) {
+    uint32_t sum = 0;
+    for (int i = 0; i < BLOCKSIZE; i++){
+        sum += block[i];
+    }
+    return fix_checksum(block, sum);
+}
+
+static int is_zero_block_scalar(const uint8_t *block) {
+    uint64_t acc = 0;
+    for (int i = 0; i < BLOCKSIZE; i += sizeof(uint64_t)){
+        uint64_t word;
+        memcpy(&word, block + i, sizeof(uint64_t));
+        acc |= word;
+    }
+    return !acc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static uint32_t header_checksum_sse2(const uint8_t *block) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (int i = 0; i < BLOCKSIZE; i += 16){
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (block + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));//two sums of 8 bytes
+    }
+    uint32_t sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+    return fix_checksum(block, sum);
+}
+
+__attribute__((target("sse2")))
+static int is_zero_block_sse2(const uint8_t *block) {
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < BLOCKSIZE; i += 16){
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (block + i)));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static uint32_t header_checksum_avx2(const uint8_t *block) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (int i = 0; i < BLOCKSIZE; i += 32){
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (block + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bytes, zero));//four sums of 8 bytes
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    uint32_t sum = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+    return fix_checksum(block, sum);
+}
+
+__attribute__((target("avx2")))
+static int is_zero_block_avx2(const uint8_t *block) {
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < BLOCKSIZE; i += 32){
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *) (block + i)));
+    }
+    return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+static uint32_t (*header_checksum)(const uint8_t *block) = header_checksum_scalar;
+static int (*is_zero_block)(const uint8_t *block) = is_zero_block_scalar;
+
+__attribute__((constructor))
+static void select_kernels(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        header_checksum = header_checksum_avx2;
+        is_zero_block = is_zero_block_avx2;
+    } else if (__builtin_cpu_supports("sse2")){
+        header_checksum = header_checksum_sse2;
+        is_zero_block = is_zero_block_sse2;
+    }
+#endif
+}
+
+/*
+ * Compressed archives
+ *
+ * tar_open_gzip() decompresses a gzip or zlib archive once and records a checkpoint at a deflate block boundary
+ * every span bytes of uncompressed data, as zran.c does: the offsets of the checkpoint in the compressed and in the
+ * uncompressed streams, the bits of the compressed byte it starts within, and the 32 KiB of uncompressed data that
+ * precede it, which inflate() needs as dictionary. A read then starts from the last checkpoint before its offset,
+ * so it decompresses at most span bytes that it does not return, whatever its offset in the archive.
+ * Archives made of several concatenated gzip members, as written by pigz or bgzip, are supported.
+ */
+
+#define TAR_GZIP_SPAN (1 << 20)
+#define GZIP_WINDOW 32768       // size of the deflate window
+#define GZIP_CHUNK (64 * 1024)  // size of the compressed reads
+
+typedef struct gzip_point {
+    off_t out;                  // offset of the checkpoint in the uncompressed archive
+    off_t in;                   // offset of the first compressed byte that is entirely after the checkpoint
+    int bits;                   // number of bits of the previous compressed byte that are after the checkpoint
+    uint8_t window[GZIP_WINDOW];// the uncompressed data that precedes the checkpoint
+} gzip_point_t;
+
+typedef struct tar_gzip {
+    size_t size;                // size of the uncompressed archive
+    size_t nb_points;
+    gzip_point_t *points;       // sorted by offset
+} tar_gzip_t;
+
+static tar_gzip_t *get_gzip(int tar_fd) {
+    return fd_table_get(&gzip_indexes, tar_fd);
+}
+
+static void gzip_free(tar_gzip_t *gzip) {
+    if (gzip == NULL) return;
+    free(gzip->points);
+    free(gzip);
+}
+
+/* records a checkpoint, the last left bytes of the circular window being its oldest bytes */
+static int gzip_add_point(tar_gzip_t *gzip, int bits, off_t in, off_t out, unsigned left, const uint8_t *window) {
+    if (!(gzip->nb_points & (gzip->nb_points - 1))){//grow the array when its size reaches a power of two
+        size_t capacity = gzip->nb_points ? 2 * gzip->nb_points : 1;
+        gzip_point_t *points = realloc(gzip->points, capacity * sizeof(gzip_point_t));
+        if (points == NULL) return -1;
+        gzip->points = points;
+    }
+    gzip_point_t *point = &gzip->points[gzip->nb_points++];
+    point->out = out;
+    point->in = in;
+    point->bits = bits;
+    if (left) memcpy(point->window, window + GZIP_WINDOW - left, left);
+    if (left < GZIP_WINDOW) memcpy(point->window + left, window, GZIP_WINDOW - left);
+    return 0;
+}
+
+/* fills the input of strm from offset in the compressed archive, returns the number of bytes read, -1 on error */
+static ssize_t gzip_fill(int tar_fd, z_stream *strm, uint8_t *input, off_t offset) {
+    ssize_t r = pread(tar_fd, input, GZIP_CHUNK, offset);
+    if (r < 0) tar_log(TAR_LOG_ERROR, errno, "pread error in tar_pread");
+    STATS_ADD(preads, 1);
+    STATS_ADD(bytes_read, r > 0 ? r : 0);
+    strm->next_in = input;
+    strm->avail_in = r > 0 ? r : 0;
+    return r;
+}
+
+/* decompresses the whole archive once to record its checkpoints, returns NULL if it is not a gzip or zlib stream */
+static tar_gzip_t *gzip_build(int tar_fd, size_t span) {
+
+    tar_gzip_t *gzip = calloc(1, sizeof(tar_gzip_t));
+    uint8_t *input = malloc(GZIP_CHUNK);
+    uint8_t *window = malloc(GZIP_WINDOW);
+    z_stream strm = {0};
+    if (gzip == NULL || input == NULL || window == NULL || inflateInit2(&strm, 47) != Z_OK){//47: gzip or zlib header
+        gzip_free(gzip);
+        free(input);
+        free(window);
+        return NULL;
+    }
+
+    off_t total_in = 0, total_out = 0, last = 0;
+    int ret = Z_OK;
+    while (1){
+        if (!strm.avail_in){
+            ssize_t r = gzip_fill(tar_fd, &strm, input, total_in);
+            if (r <= 0){
+                if (ret != Z_STREAM_END) ret = Z_DATA_ERROR;//truncated stream
+                break;
+            }
+        }
+        if (ret == Z_STREAM_END){//another gzip member follows, unless what follows is padding
+            if (strm.next_in[0] != 0x1f) break;
+            inflateReset(&strm);
+        }
+        if (!strm.avail_out){//the output goes round the window, which always holds the last 32 KiB
+            strm.next_out = window;
+            strm.avail_out = GZIP_WINDOW;
+        }
+
+        total_in += strm.avail_in;
+        total_out += strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK);//returns at the end of each deflate block
+        total_in -= strm.avail_in;
+        total_out -= strm.avail_out;
+        if (ret != Z_OK && ret != Z_STREAM_END){
+            ret = Z_DATA_ERROR;
+            break;
+        }
+
+        //at the end of a block that is not the last one of its member
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > (off_t) span)){
+            if (gzip_add_point(gzip, strm.data_type & 7, total_in, total_out, strm.avail_out, window) < 0){
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            last = total_out;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    if (ret != Z_STREAM_END || gzip->nb_points == 0){
+        gzip_free(gzip);
+        return NULL;
+    }
+    gzip->size = total_out;
+    return gzip;
+}
+
+/*
+ * skips the trailer of the member that strm just finished, and prepares strm for the header of the next one,
+ * raw being 1 while strm inflates the raw deflate data of the member of a checkpoint
+ */
+static int gzip_next_member(int tar_fd, z_stream *strm, uint8_t *input, off_t *in, int *raw) {
+    size_t trailer = *raw ? 8 : 0;//CRC-32 and size of the member, which inflate consumes itself for a gzip stream
+    *raw = 0;
+    while (trailer){
+        if (!strm->avail_in){
+            ssize_t r = gzip_fill(tar_fd, strm, input, *in);
+            if (r <= 0) return Z_DATA_ERROR;
+            *in += r;
+        }
+        size_t n = trailer < strm->avail_in ? trailer : strm->avail_in;
+        strm->next_in += n;
+        strm->avail_in -= n;
+        trailer -= n;
+    }
+    return inflateReset2(strm, 31);
+}
+
+/* reads len bytes at offset in the uncompressed archive, decompressing from the last checkpoint before offset */
+static ssize_t gzip_pread(int tar_fd, const tar_gzip_t *gzip, uint8_t *dest, size_t len, off_t offset) {
+
+    if ((size_t) offset >= gzip->size) return 0;
+    if (len > gzip->size - offset) len = gzip->size - offset;
+    if (!len) return 0;
+
+    //binary search of the last checkpoint before offset, the first one is at the start of the archive
+    size_t low = 0, high = gzip->nb_points;
+    while (high - low > 1){
+        size_t middle = (low + high) / 2;
+        if (gzip->points[middle].out <= offset) low = middle;
+        else high = middle;
+    }
+    const gzip_point_t *point = &gzip->points[low];
+
+    z_stream strm = {0};
+    uint8_t *input = malloc(GZIP_CHUNK);
+    uint8_t *discard = malloc(GZIP_WINDOW);
+    if (input == NULL || discard == NULL || inflateInit2(&strm, -15) != Z_OK){//raw deflate from the checkpoint
+        free(input);
+        free(discard);
+        return -1;
+    }
+
+    off_t in = point->in;
+    int error = 0;
+    int raw = 1;
+    if (point->bits){//the checkpoint is inside a byte, whose last bits are given to inflate first
+        uint8_t byte = 0;
+        if (pread(tar_fd, &byte, 1, in - 1) != 1) error = 1;
+        STATS_ADD(preads, 1);
+        STATS_ADD(bytes_read, 1);
+        inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+    inflateSetDictionary(&strm, point->window, GZIP_WINDOW);
+
+    //decompress into the discard buffer up to offset, then into dest
+    size_t skip = offset - point->out;
+    int filling = 0;
+    while (!error){
+        if (!strm.avail_out){
+            if (filling) break;
+            if (skip){
+                strm.next_out = discard;
+                strm.avail_out = skip < GZIP_WINDOW ? skip : GZIP_WINDOW;
+                skip -= strm.avail_out;
+            } else {
+                strm.next_out = dest;
+                strm.avail_out = len;
+                filling = 1;
+            }
+        }
+        if (!strm.avail_in){
+            ssize_t r = gzip_fill(tar_fd, &strm, input, in);
+            if (r <= 0){
+                error = 1;
+                break;
+            }
+            in += r;
+        }
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END && filling && !strm.avail_out) break;//the read ends with the member
+        if (ret == Z_STREAM_END) ret = gzip_next_member(tar_fd, &strm, input, &in, &raw);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) error = 1;
+    }
+
+    inflateEnd(&strm);
+    free(input);
+    free(discard);
+    return error ? -1 : (ssize_t) len;
+}
+
+/**
+ * Switches a compressed archive to gzip mode.
+ *
+ * The archive is decompressed once to record checkpoints, and every function called with this file descriptor then
+ * reads the uncompressed archive, each read decompressing from the last checkpoint before it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive compressed with gzip or zlib.
+ * @param span The distance between two checkpoints in the uncompressed archive, zero for the default of 1 MiB.
+ *             Each checkpoint takes 32 KiB of memory, and a read decompresses at most span bytes it does not return.
+ *
+ * @return zero if the checkpoints were recorded or the archive was already in gzip mode,
+ *         -1 if it is not compressed, is in mmap mode, or could not be read.
+ */
+int tar_open_gzip(int tar_fd, size_t span) {
+
+    if (tar_fd < 0) return -1;
+    if (get_gzip(tar_fd) != NULL) return 0;
+    if (get_mapping(tar_fd) != NULL) return -1;
+
+    //the checkpoints are recorded without the lock, which only protects the table
+    tar_gzip_t *gzip = gzip_build(tar_fd, span ? span : TAR_GZIP_SPAN);
+    if (gzip == NULL) return -1;
+
+    pthread_mutex_lock(&fd_tables_lock);
+    tar_gzip_t *current = get_gzip(tar_fd);
+    int ret = get_mapping(tar_fd) != NULL ? -1 : 0;
+    if (ret == 0 && current == NULL) ret = fd_table_set(&gzip_indexes, tar_fd, gzip);
+    pthread_mutex_unlock(&fd_tables_lock);
+    if (ret < 0 || current != NULL) gzip_free(gzip);//or another thread switched the archive first
+    return ret;
+}
+
+/**
+ * Leaves gzip mode and frees the checkpoints of the archive.
+ *
+ * No other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_gzip().
+ *
+ * @return zero if the archive left gzip mode,
+ *         -1 if it was not in gzip mode.
+ */
+int tar_close_gzip(int tar_fd) {
+
+    pthread_mutex_lock(&fd_tables_lock);
+    tar_gzip_t *gzip = get_gzip(tar_fd);
+    if (gzip == NULL){
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+    fd_table_set(&gzip_indexes, tar_fd, NULL);//the table is already large enough
+    pthread_mutex_unlock(&fd_tables_lock);
+
+    gzip_free(gzip);
+    return 0;
+}
+
+/* pread() on the file of the archive, decompressing in gzip mode */
+static ssize_t raw_pread(int tar_fd, void *dest, size_t len, off_t offset) {
+
+    tar_gzip_t *gzip = get_gzip(tar_fd);
+    if (gzip != NULL) return gzip_pread(tar_fd, gzip, dest, len, offset);
+
+    ssize_t r = pread(tar_fd, dest, len, offset);
+    if (r < 0) tar_log(TAR_LOG_ERROR, errno, "pread error in tar_pread");
+    STATS_ADD(preads, 1);
+    STATS_ADD(bytes_read, r > 0 ? r : 0);
+    return r;
+}
+
+/*
+ * Block cache
+ *
+ * tar_open_cache() registers a cache of the blocks of an archive under its file descriptor, in a third table. The
+ * cache sits under tar_pread(), so every read of the library goes through it: a read is split in blocks of
+ * TAR_CACHE_BLOCKSIZE bytes, keyed by block number, and only the missing blocks are read from the file (or
+ * decompressed in gzip mode, the cache then holding decompressed blocks).
+ *
+ * The blocks are spread over TAR_CACHE_SHARDS shards by block number, each with its own lock, hash table and LRU list,
+ * so concurrent readers rarely wait on each other. A block is copied out under the lock of its shard, so it cannot
+ * be evicted while it is read, and a missing block is read without holding any lock.
+ */
+
+#define TAR_CACHE_BLOCKSIZE (16 * 1024)
+#define TAR_CACHE_SHARDS 16
+#define TAR_CACHE_CAPACITY (64 << 20)   // default capacity, in bytes
+
+typedef struct cache_node {
+    int64_t block;              // block number, -1 while the node is unused
+    size_t len;                 // number of valid bytes, less than a block only at the end of the archive
+    struct cache_node *prev;    // LRU list, most recently used first
+    struct cache_node *next;
+    struct cache_node *chain;   // next node of the same hash bucket
+    uint8_t *data;
+} cache_node_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_node_t *nodes;
+    size_t nb_nodes;
+    size_t nb_used;
+    cache_node_t **buckets;
+    size_t nb_buckets;          // always a power of two
+    cache_node_t lru;           // sentinel of the LRU list, lru.next is the most recently used node
+    uint8_t *data;
+} cache_shard_t;
+
+typedef struct tar_cache {
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t evictions;
+    size_t nb_blocks;           // capacity of the cache, in blocks
+    cache_shard_t shards[TAR_CACHE_SHARDS];
+} tar_cache_t;
+
+static tar_cache_t *get_cache(int tar_fd) {
+    return fd_table_get(&caches, tar_fd);
+}
+
+static void cache_free(tar_cache_t *cache) {
+    if (cache == NULL) return;
+    for (int i = 0; i < TAR_CACHE_SHARDS; i++){
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->nodes);
+        free(shard->buckets);
+        free(shard->data);
+    }
+    free(cache);
+}
+
+static tar_cache_t *cache_new(size_t capacity) {
+
+    tar_cache_t *cache = calloc(1, sizeof(tar_cache_t));
+    if (cache == NULL) return NULL;
+    size_t nb_nodes = (capacity / TAR_CACHE_BLOCKSIZE + TAR_CACHE_SHARDS - 1) / TAR_CACHE_SHARDS;
+    if (nb_nodes == 0) nb_nodes = 1;
+    cache->nb_blocks = nb_nodes * TAR_CACHE_SHARDS;
+
+    for (int i = 0; i < TAR_CACHE_SHARDS; i++){
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->nb_buckets = 1;
+        while (shard->nb_buckets < 2 * nb_nodes) shard->nb_buckets *= 2;
+        shard->nodes = calloc(nb_nodes, sizeof(cache_node_t));
+        shard->buckets = calloc(shard->nb_buckets, sizeof(cache_node_t *));
+        shard->data = malloc(nb_nodes * TAR_CACHE_BLOCKSIZE);//the pages are only touched when blocks are stored
+        shard->nb_nodes = nb_nodes;
+        shard->lru.prev = shard->lru.next = &shard->lru;
+        if (shard->nodes == NULL || shard->buckets == NULL || shard->data == NULL){
+            for (int j = i + 1; j < TAR_CACHE_SHARDS; j++) pthread_mutex_init(&cache->shards[j].lock, NULL);
+            cache_free(cache);
+            return NULL;
+        }
+        for (size_t j = 0; j < nb_nodes; j++){
+            shard->nodes[j].block = -1;
+            shard->nodes[j].data = shard->data + j * TAR_CACHE_BLOCKSIZE;
+        }
+    }
+    return cache;
+}
+
+static cache_shard_t *cache_shard(tar_cache_t *cache, int64_t block) {
+    return &cache->shards[block % TAR_CACHE_SHARDS];
+}
+
+static cache_node_t **cache_bucket(cache_shard_t *shard, int64_t block) {
+    uint64_t hash = (uint64_t) (block / TAR_CACHE_SHARDS) * 0x9e3779b97f4a7c15ULL;
+    return &shard->buckets[(hash >> 32) & (shard->nb_buckets - 1)];
+}
+
+static void cache_unlink(cache_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+}
+
+static void cache_push_front(cache_shard_t *shard, cache_node_t *node) {
+    node->prev = &shard->lru;
+    node->next = shard->lru.next;
+    shard->lru.next->prev = node;
+    shard->lru.next = node;
+}
+
+/* copies up to len bytes of a block from position, returns the number of bytes copied or -1 if it is not cached */
+static ssize_t cache_copy(tar_cache_t *cache, int64_t block, uint8_t *dest, size_t position, size_t len) {
+    cache_shard_t *shard = cache_shard(cache, block);
+    pthread_mutex_lock(&shard->lock);
+    cache_node_t *node = *cache_bucket(shard, block);
+    while (node != NULL && node->block != block) node = node->chain;
+    ssize_t copied = -1;
+    if (node != NULL){
+        cache_unlink(node);
+        cache_push_front(shard, node);
+        copied = position < node->len ? (node->len - position < len ? node->len - position : len) : 0;
+        memcpy(dest, node->data + position, copied);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return copied;
+}
+
+/* stores a block read from the archive, evicting the least recently used block of its shard when it is full */
+static void cache_store(tar_cache_t *cache, int64_t block, const uint8_t *data, size_t len) {
+    cache_shard_t *shard = cache_shard(cache, block);
+    pthread_mutex_lock(&shard->lock);
+    cache_node_t **bucket = cache_bucket(shard, block);
+    cache_node_t *node = *bucket;
+    while (node != NULL && node->block != block) node = node->chain;
+    if (node != NULL){//another thread read it meanwhile
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    if (shard->nb_used < shard->nb_nodes){
+        node = &shard->nodes[shard->nb_used++];
+    } else {
+        node = shard->lru.prev;
+        cache_unlink(node);
+        cache_node_t **previous = cache_bucket(shard, node->block);
+        while (*previous != node) previous = &(*previous)->chain;
+        *previous = node->chain;
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    node->block = block;
+    node->len = len;
+    memcpy(node->data, data, len);
+    node->chain = *bucket;
+    *bucket = node;
+    cache_push_front(shard, node);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* tar_pread() through the cache, the missing blocks are read with raw_pread() */
+static ssize_t cache_pread(int tar_fd, tar_cache_t *cache, uint8_t *dest, size_t len, off_t offset) {
+
+    uint8_t *block_data = NULL;//allocated on the first miss
+    size_t done = 0;
+    while (done < len){
+        int64_t block = (offset + done) / TAR_CACHE_BLOCKSIZE;
+        size_t position = (offset + done) % TAR_CACHE_BLOCKSIZE;
+        size_t n = TAR_CACHE_BLOCKSIZE - position < len - done ? TAR_CACHE_BLOCKSIZE - position : len - done;
+
+        ssize_t copied = cache_copy(cache, block, dest + done, position, n);
+        if (copied >= 0){
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            STATS_ADD(cache_hits, 1);
+        } else {
+            atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+            STATS_ADD(cache_misses, 1);
+            if (block_data == NULL && (block_data = malloc(TAR_CACHE_BLOCKSIZE)) == NULL) break;
+            ssize_t r = raw_pread(tar_fd, block_data, TAR_CACHE_BLOCKSIZE, block * TAR_CACHE_BLOCKSIZE);
+            if (r < 0){
+                free(block_data);
+                return done ? (ssize_t) done : -1;
+            }
+            cache_store(cache, block, block_data, r);
+            copied = position < (size_t) r ? ((size_t) r - position < n ? (size_t) r - position : n) : 0;
+            memcpy(dest + done, block_data + position, copied);
+        }
+        done += copied;
+        if ((size_t) copied < n) break;//end of the archive
+    }
+
+    free(block_data);
+    return done;
+}
+
+/**
+ * Adds a block cache to an archive.
+ *
+ * The archive is then read by blocks kept in memory, the least recently used ones being evicted when the cache is
+ * full, so repeated reads of the same headers and files are served without system calls. In gzip mode the cache
+ * holds decompressed blocks, and must be removed before the archive leaves gzip mode. The archive must not be
+ * modified while it has a cache.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, not in mmap mode.
+ * @param capacity The size of the cache in bytes, zero for 64 MiB.
+ *
+ * @return zero if the archive has a cache or already had one,
+ *         -1 if it is in mmap mode or memory could not be allocated.
+ */
+int tar_open_cache(int tar_fd, size_t capacity) {
+
+    if (tar_fd < 0) return -1;
+    if (get_cache(tar_fd) != NULL) return 0;
+    if (get_mapping(tar_fd) != NULL) return -1;//the mapping is already in memory
+
+    tar_cache_t *cache = cache_new(capacity ? capacity : TAR_CACHE_CAPACITY);
+    if (cache == NULL) return -1;
+
+    pthread_mutex_lock(&fd_tables_lock);
+    tar_cache_t *current = get_cache(tar_fd);
+    int ret = get_mapping(tar_fd) != NULL ? -1 : 0;
+    if (ret == 0 && current == NULL) ret = fd_table_set(&caches, tar_fd, cache);
+    pthread_mutex_unlock(&fd_tables_lock);
+    if (ret < 0 || current != NULL) cache_free(cache);//or another thread added a cache first
+    return ret;
+}
+
+/**
+ * Removes the block cache of an archive and releases its memory.
+ *
+ * No other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_cache().
+ *
+ * @return zero if the cache was removed,
+ *         -1 if the archive had no cache.
+ */
+int tar_close_cache(int tar_fd) {
+
+    pthread_mutex_lock(&fd_tables_lock);
+    tar_cache_t *cache = get_cache(tar_fd);
+    if (cache == NULL){
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+    fd_table_set(&caches, tar_fd, NULL);//the table is already large enough
+    pthread_mutex_unlock(&fd_tables_lock);
+
+    cache_free(cache);
+    return 0;
+}
+
+/**
+ * Reads the statistics of the block cache of an archive.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_cache().
+ * @param stats An out argument, set to the statistics of the cache.
+ *
+ * @return zero if stats was set,
+ *         -1 if the archive has no cache.
+ */
+int tar_cache_stats(int tar_fd, tar_cache_stats_t *stats) {
+    tar_cache_t *cache = get_cache(tar_fd);
+    if (cache == NULL) return -1;
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->capacity = cache->nb_blocks * TAR_CACHE_BLOCKSIZE;
+    return 0;
+}
+
+/* pread() on the archive, copying from the mapping in mmap mode or from the cache when there is one */
+static ssize_t tar_pread(int tar_fd, void *dest, size_t len, off_t offset) {
+
+    tar_mapping_t *mapping = get_mapping(tar_fd);
+
+    if (mapping != NULL){
+        if (offset >= mapping->size) return 0;
+        if (len > mapping->size - offset) len = mapping->size - offset;
+        memcpy(dest, mapping->base + offset, len);
+        return len;
+    }
+
+    tar_cache_t *cache = get_cache(tar_fd);
+    if (cache != NULL) return cache_pread(tar_fd, cache, dest, len, offset);
+    return raw_pread(tar_fd, dest, len, offset);
+}
+
+/*
+ * Checks the magic value, the version and the checksum of a header, chksum being the value stored in the header.
+ * Returns zero if the header is valid, or the error code of check_archive().
+ */
+static int check_header(const tar_header_t *header, uint32_t chksum) {
+
+    //checking for version and magic
+    if (strcmp(header->magic, TMAGIC)) return -1;
+    if (header->version[0] != TVERSION[0] && header->version[1] != TVERSION[1]) return -2;//this is needed because strcmp adding "/0" or not is ambiguous
+
+    //checking for checksum: calculate it ourselves, counting the checksum bytes as spaces since the header cannot be modified in mmap mode
+    if (chksum != header_checksum((const uint8_t *) header)) return -3;
+    return 0;
+}
+
+static tar_iter_t *iter_open_at(int tar_fd, int raw, off_t offset);
+static off_t iter_offset(const tar_iter_t *iter);
+
+/*
+ * The end of the last validated archive of each file descriptor is remembered, so that tar_refresh() only verifies
+ * the headers appended since then. The file is identified by its device and inode, and its last verified header is
+ * kept to detect an archive rewritten in place.
+ */
+typedef struct check_state {
+    dev_t dev;
+    ino_t ino;
+    off_t end;                  // offset of the null blocks ending the archive, -1 if they were not reached
+    off_t last_header;          // offset of the last verified header, -1 if there is none
+    int nb_headers;             // number of headers verified before end
+    uint8_t last_block[BLOCKSIZE];
+} check_state_t;
+
+/* verifies the headers from state->end to the end of the archive and counts them, returns a check_header() error */
+static int check_from(int tar_fd, check_state_t *state) {
+
+    tar_iter_t *iter = iter_open_at(tar_fd, 1, state->end);//the extended headers are headers to verify too
+    if (iter == NULL) return -1;
+
+    int ret = 0;
+    int more;
+    tar_entry_t entry;
+
+    //the iterator stops at the two null blocks marking the end of the archive
+    while ((more = tar_iter_next(iter, &entry)) > 0){
+
+        //the header is read only once by the iterator, directly from the mapping in mmap mode
+        ret = check_header(entry.header, entry.chksum);
+        if (ret) break;
+
+        state->nb_headers++;//increment number of headers
+        state->last_header = entry.offset;
+    }
+    if (!ret && more < 0) ret = -1;//a valid header with a malformed size field, or a read error
+
+    state->end = more == 0 ? iter_offset(iter) : -1;
+    tar_iter_close(iter);
+    return ret;
+}
+
+/* remembers the end of an archive that was entirely verified */
+static void check_remember(int tar_fd, check_state_t *state) {
+    struct stat st;
+    if (state->end < 0 || fstat(tar_fd, &st) < 0) return;
+    state->dev = st.st_dev;
+    state->ino = st.st_ino;
+    memset(state->last_block, 0, BLOCKSIZE);
+    if (state->last_header >= 0 && tar_pread(tar_fd, state->last_block, BLOCKSIZE, state->last_header) < 0) return;
+
+    pthread_mutex_lock(&fd_tables_lock);
+    check_state_t *remembered = fd_table_get(&checks, tar_fd);
+    if (remembered == NULL && (remembered = malloc(sizeof(check_state_t))) != NULL
+        && fd_table_set(&checks, tar_fd, remembered) < 0){
+        free(remembered);
+        remembered = NULL;
+    }
+    if (remembered != NULL) *remembered = *state;
+    pthread_mutex_unlock(&fd_tables_lock);
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null,
+ *  - a version value of "00" and no null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value or a malformed size field,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd) {
+
+    uint64_t start = stats_start();
+    check_state_t state = {.end = 0, .last_header = -1, .nb_headers = 0};
+    int ret = check_from(tar_fd, &state);
+    if (!ret) check_remember(tar_fd, &state);
+    stats_stop(TAR_STATS_CHECK, start);
+    return ret ? ret : state.nb_headers;
+}
+
+static int is_dir_type(char typeflag) {
+    return typeflag == DIRTYPE;
+}
+
+static int is_file_type(char typeflag) {
+    return typeflag == REGTYPE || typeflag == AREGTYPE;
+}
+
+static int is_link_type(char typeflag) {
+    return typeflag == LNKTYPE || typeflag == SYMTYPE;
+}
+
+/* returns 1 if the archive contains an entry at path whose type is accepted by match, 0 otherwise */
+static int find_entry(int tar_fd, const char *path, int (*match)(char typeflag)) {
+
+    uint64_t start = stats_start();
+    tar_iter_t *iter = tar_iter_open(tar_fd);
+    if (iter == NULL) return 0;
+
+    int found = 0;
+    char typeflag = 0;
+    tar_entry_t entry;
+    while (tar_iter_next(iter, &entry) > 0){
+        if (strcmp(entry.name, path)) continue;
+        found = 1;
+        typeflag = entry.typeflag;//the last occurrence wins, as in the index
+        if (match == NULL) break;
+    }
+
+    tar_iter_close(iter);
+    stats_stop(TAR_STATS_LOOKUP, start);
+    return found && (match == NULL || match(typeflag));
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    return find_entry(tar_fd, path, NULL);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    return find_entry(tar_fd, path, is_dir_type);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    return find_entry(tar_fd, path, is_file_type);
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    return find_entry(tar_fd, path, is_link_type);
+}
+
+
+/* list() without the statistics */
+static int list_scan(int tar_fd, char *path, char **entries, size_t *no_entries) {
+
+    tar_iter_t *iter = tar_iter_open(tar_fd);
+    if (iter == NULL){
+        *no_entries = 0;
+        return 0;
+    }
+
+    tar_entry_t entry;
+    while (tar_iter_next(iter, &entry) > 0){
+
+        if (strcmp(entry.name, path)) continue;//we need to check if it is either a directory or a symlink
+
+        if (entry.typeflag == DIRTYPE){//if directory, we can list its entries, which follow it in the archive
+            size_t index = 0;//indexes entries
+            const char *record = "/";//this record will help us avoid listing sub-entries, we are certain "/" cannot be the name of an entry
+            while (tar_iter_next(iter, &entry) > 0 && !strncmp(entry.name, path, strlen(path))){//compare beginning to check if it is an entry
+                if (strncmp(entry.name, record, strlen(record)) && index < *no_entries){//compare with previous record to make sure it is not a sub-entry
+                    strcpy(entries[index], entry.name);//if it is an entry but not a sub-entry, we copy it to entries
+                    record = entries[index++];//update record to the entry that was listed last
+                }
+            }
+            tar_iter_close(iter);
+            *no_entries = index;
+            return 1;
+        }
+
+        if (is_link_type(entry.typeflag)){//if link, an index resolves the whole chain with a single more scan
+            tar_iter_close(iter);
+            tar_index_t *index = tar_index_build(tar_fd);
+            int ret = index != NULL ? tar_index_list(index, path, entries, no_entries) : 0;
+            if (index == NULL) *no_entries = 0;
+            tar_index_free(index);
+            return ret;
+        }
+    }
+
+    tar_iter_close(iter);
+    *no_entries = 0;
+    return 0;
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does not recurse into the directories listed at the given path.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    uint64_t start = stats_start();
+    int ret = list_scan(tar_fd, path, entries, no_entries);
+    stats_stop(TAR_STATS_LIST, start);
+    return ret;
+}
+
+/* read_file() without the statistics */
+static ssize_t read_file_scan(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+
+    tar_log(TAR_LOG_DEBUG, 0, "read_file %s", path);
+
+    tar_iter_t *iter = tar_iter_open(tar_fd);
+    if (iter == NULL) return -1;
+
+    //a single pass finds the last occurrence of the entry, as in the index, which must be a file or a symlink
+    int found = 0;
+    tar_entry_t entry, last;
+    while (tar_iter_next(iter, &last) > 0){
+        if (!strcmp(last.name, path)){
+            entry = last;//only the type and the location are used, the name is overwritten by the next header
+            found = 1;
+        }
+    }
+
+    if (!found || !(is_file_type(entry.typeflag) || is_link_type(entry.typeflag))){
+        tar_iter_close(iter);
+        tar_log(TAR_LOG_DEBUG, 0, "path given to read_file is invalid: %s", path);
+        return -1;
+    }
+
+    if (is_link_type(entry.typeflag)){//if link, an index resolves the whole chain with a single more scan
+        tar_iter_close(iter);
+        tar_index_t *index = tar_index_build(tar_fd);
+        ssize_t ret = index != NULL ? tar_index_read_file(index, path, offset, dest, len) : -1;
+        tar_index_free(index);
+        if (ret == -1) tar_log(TAR_LOG_DEBUG, 0, "link given to read_file does not resolve to a file: %s", path);
+        return ret;
+    }
+    tar_iter_close(iter);
+
+    if (offset > entry.size){
+        tar_log(TAR_LOG_DEBUG, 0, "read_file error: the offset is outside of the file size");
+        return -2;
+    }
+
+    size_t bytes_to_read = entry.size - offset; //number of bytes we should read to get to the end of the file
+    if (bytes_to_read < *len) *len = bytes_to_read; //dest buffer size is long enough to read until the end of the file
+
+    ssize_t r = tar_pread(tar_fd, dest, *len, entry.data_offset + offset);
+    if (r < 0) return -1;
+    *len = r; //len is set to the number of bytes written to dest
+    return bytes_to_read - *len;
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ *
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    uint64_t start = stats_start();
+    ssize_t ret = read_file_scan(tar_fd, path, offset, dest, len);
+    stats_stop(TAR_STATS_READ, start);
+    return ret;
+}
+
+/**
+ * Switches an archive to mmap mode.
+ *
+ * The archive is mapped once, and every function called with this file descriptor then reads the headers and
+ * the content of the files from the mapping instead of issuing pread() calls.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return zero if the archive was mapped or was already in mmap mode,
+ *         -1 if it could not be mapped.
+ */
+int tar_open_mmap(int tar_fd) {
+
+    if (tar_fd < 0) return -1;
+
+    pthread_mutex_lock(&fd_tables_lock);
+    if (get_mapping(tar_fd) != NULL){
+        pthread_mutex_unlock(&fd_tables_lock);
+        return 0;
+    }
+    if (get_gzip(tar_fd) != NULL || get_cache(tar_fd) != NULL){//the compressed bytes, or bypassing the cache
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+
+    struct stat st;
+    tar_mapping_t *mapping = malloc(sizeof(tar_mapping_t));
+    if (mapping == NULL || fstat(tar_fd, &st) < 0){
+        if (mapping != NULL) tar_log(TAR_LOG_ERROR, errno, "fstat error in tar_open_mmap");
+        free(mapping);
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+    mapping->size = st.st_size;
+    mapping->base = NULL;
+    if (mapping->size > 0){//an empty file cannot be mapped, but every read simply falls past its end
+        void *base = mmap(NULL, mapping->size, PROT_READ, MAP_SHARED, tar_fd, 0);
+        if (base == MAP_FAILED){
+            tar_log(TAR_LOG_ERROR, errno, "mmap error in tar_open_mmap");
+            free(mapping);
+            pthread_mutex_unlock(&fd_tables_lock);
+            return -1;
+        }
+        mapping->base = base;
+    }
+
+    if (fd_table_set(&mappings, tar_fd, mapping) < 0){
+        if (mapping->size > 0) munmap((void *) mapping->base, mapping->size);
+        free(mapping);
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&fd_tables_lock);
+    return 0;
+}
+
+/**
+ * Leaves mmap mode and unmaps the archive.
+ *
+ * Pointers returned by tar_file_view() for this archive are no longer valid afterwards,
+ * and no other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_mmap().
+ *
+ * @return zero if the archive was unmapped,
+ *         -1 if it was not in mmap mode.
+ */
+int tar_close_mmap(int tar_fd) {
+
+    pthread_mutex_lock(&fd_tables_lock);
+    tar_mapping_t *mapping = get_mapping(tar_fd);
+    if (mapping == NULL){
+        pthread_mutex_unlock(&fd_tables_lock);
+        return -1;
+    }
+    fd_table_set(&mappings, tar_fd, NULL);//the table is already large enough
+    pthread_mutex_unlock(&fd_tables_lock);
+
+    if (mapping->size > 0) munmap((void *) mapping->base, mapping->size);
+    free(mapping);
+    return 0;
+}
+
+static int index_locate_file(const tar_index_t *index, const char *path, off_t *data_offset, size_t *size);
+
+/*
+ * Finds the file at path with a scan of the archive, resolving links with an index,
+ * and sets data_offset and size to the location of its content. Returns zero if it was found, -1 otherwise.
+ */
+static int locate_file(int tar_fd, const char *path, off_t *data_offset, size_t *size) {
+
+    tar_iter_t *iter = tar_iter_open(tar_fd);//in mmap mode the iterator walks the mapping without copying
+    if (iter == NULL) return -1;
+
+    int found = 0;
+    tar_entry_t entry, last;
+    while (tar_iter_next(iter, &last) > 0){
+        if (!strcmp(last.name, path)){
+            entry = last;//the last occurrence wins, as in the index
+            found = 1;
+        }
+    }
+
+    int ret = -1;
+    if (found && is_link_type(entry.typeflag)){
+        tar_iter_close(iter);
+        tar_index_t *index = tar_index_build(tar_fd);
+        ret = index != NULL ? index_locate_file(index, path, data_offset, size) : -1;
+        tar_index_free(index);
+        return ret;
+    }
+    if (found && is_file_type(entry.typeflag)){
+        *data_offset = entry.data_offset;
+        *size = entry.size;
+        ret = 0;
+    }
+
+    tar_iter_close(iter);
+    return ret;
+}
+
+/**
+ * Gives direct access to the content of a file of an archive in mmap mode, without copying it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, in mmap mode.
+ * @param path A path to an entry in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param ptr An out argument, set to the first byte of the content of the file inside the mapping.
+ *            It stays valid until tar_close_mmap() is called.
+ * @param len An out argument, set to the size of the file.
+ *
+ * @return zero if ptr and len were set,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive is not in mmap mode.
+ */
+int tar_file_view(int tar_fd, char *path, const uint8_t **ptr, size_t *len) {
+
+    tar_mapping_t *mapping = get_mapping(tar_fd);
+    if (mapping == NULL) return -2;
+
+    off_t data_offset;
+    size_t size;
+    if (locate_file(tar_fd, path, &data_offset, &size) < 0) return -1;
+    if (data_offset + size > mapping->size) return -1;//truncated archive
+
+    *ptr = mapping->base + data_offset;
+    *len = size;
+    return 0;
+}
+
+/*
+ * Header iterator
+ *
+ * The iterator reads the archive through a read-ahead buffer of up to TAR_ITER_BUFSIZE bytes, so that a scan of small
+ * members issues one pread() per megabyte of archive instead of one per header, and only refills it when the next
+ * header falls outside. The size of a refill adapts to the gap between the headers: after a member larger than
+ * TAR_ITER_MAX_GAP, only the next header is read, since the content of the following members would likely be
+ * skipped too, and the window doubles back to TAR_ITER_BUFSIZE while the headers keep landing in the buffer.
+ * In mmap mode it does not use any buffer and returns pointers into the mapping.
+ *
+ * The full path of each member is reconstructed once, when its header is read: the ustar prefix is joined to the name,
+ * and the PAX extended headers (x and g) and GNU long names (L and K) preceding a member are consumed and override its
+ * path, link target, size and modification time. The lookup functions then only compare entry names.
+ */
+
+#define TAR_ITER_BUFSIZE (1 << 20)
+#define TAR_ITER_MAX_EXTENSION TAR_ITER_BUFSIZE    // larger extended headers are reported as read errors
+#define TAR_ITER_MAX_GAP (64 << 10)    // gap between two headers above which a refill only reads one block
+
+/* attributes of the next member taken from the extended headers preceding it */
+typedef struct iter_overrides {
+    const char *path;
+    const char *linkpath;
+    int64_t size;               // -1 when not overridden
+    int64_t mtime;
+    int has_mtime;
+} iter_overrides_t;
+
+/* content of an extended header, kept until it is replaced by the next one of the same kind */
+typedef struct iter_extension {
+    char *data;
+    size_t len;
+    size_t capacity;
+} iter_extension_t;
+
+struct tar_iter {
+    int tar_fd;
+    tar_mapping_t *mapping;     // NULL when the archive is not in mmap mode
+    uint8_t *buffer;            // read-ahead buffer, unused in mmap mode
+    off_t buffer_offset;        // offset in the archive of the first byte of the buffer
+    size_t buffer_len;          // number of valid bytes in the buffer
+    size_t window;              // number of bytes read by the next refill of the buffer
+    size_t hits;                // number of blocks read from the buffer since its last refill
+    off_t last;                 // offset of the last block read
+    off_t next;                 // offset of the next header
+    int done;                   // 1 once the end of the archive was reached, -1 after a read error
+    int raw;                    // 1 to return the extended headers as entries instead of applying them
+    char name[sizeof(((tar_header_t *) 0)->prefix) + 1 + sizeof(((tar_header_t *) 0)->name) + 1];
+    char linkname[sizeof(((tar_header_t *) 0)->linkname) + 1];
+    iter_extension_t pax;       // last x header
+    iter_extension_t global;    // last g header, applies to every following member
+    iter_extension_t long_name; // last L header
+    iter_extension_t long_link; // last K header
+};
+
+/* returns the block at offset from the mapping or the read-ahead buffer, or a null block past the end of the archive */
+static const tar_header_t *iter_block(tar_iter_t *iter, off_t offset) {
+
+    if (iter->mapping != NULL){
+        if (offset + BLOCKSIZE > iter->mapping->size) return &zero_header;
+        return (const tar_header_t *) (iter->mapping->base + offset);
+    }
+
+    off_t gap = offset - iter->last;
+    iter->last = offset;
+    if (offset < iter->buffer_offset || offset + BLOCKSIZE > iter->buffer_offset + iter->buffer_len){
+
+        //a large member is usually followed by other ones, whose content would be read for nothing
+        if (gap < 0 || gap > TAR_ITER_MAX_GAP) iter->window = BLOCKSIZE;
+        else if (iter->hits) iter->window = iter->window < TAR_ITER_BUFSIZE / 2 ? iter->window * 2 : TAR_ITER_BUFSIZE;
+        else if (iter->window < 2 * (size_t) gap) iter->window = 2 * gap;//at least the next header
+        if (iter->window < BLOCKSIZE) iter->window = BLOCKSIZE;
+
+        ssize_t r = tar_pread(iter->tar_fd, iter->buffer, iter->window, offset);
+        if (r < 0){
+            iter->done = -1;
+            r = 0;
+        }
+        iter->buffer_offset = offset;
+        iter->buffer_len = r;
+        iter->hits = 0;
+        if (r < BLOCKSIZE) return &zero_header;
+    } else {
+        iter->hits++;
+    }
+    return (const tar_header_t *) (iter->buffer + (offset - iter->buffer_offset));
+}
+
+/* copies a field of at most len bytes, not necessarily null-terminated, to dest which holds len + 1 bytes */
+static void copy_field(char *dest, const char *field, size_t len) {
+    memcpy(dest, field, len);
+    dest[len] = '\0';
+}
+
+/*
+ * parses the octal digits of a field of at most len bytes, after optional leading spaces, returns -1 if they are not
+ * followed by a space, a null byte or the end of the field. Eight digits are converted at a time: the bytes of a word
+ * are all digits when their high five bits are those of '0', and their low three bits are then merged pairwise.
+ */
+static int parse_octal(const uint8_t *bytes, size_t len, int64_t *value) {
+    size_t i = 0;
+    while (i < len && bytes[i] == ' ') i++;
+    uint64_t result = 0;
+    while (i + 8 <= len){
+        uint64_t chunk;
+        memcpy(&chunk, bytes + i, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        chunk = __builtin_bswap64(chunk);//the first digit must be the lowest byte
+#endif
+        uint64_t invalid = (chunk & 0xf8f8f8f8f8f8f8f8) ^ 0x3030303030303030;
+        size_t nb_digits = invalid ? __builtin_ctzll(invalid) / 8 : 8;
+        if (nb_digits == 0) break;
+
+        //the digits are moved to the highest bytes so that the lowest ones count as leading zeros
+        uint64_t digits = (chunk & 0x0707070707070707) << (64 - 8 * nb_digits);
+        digits = (digits & 0x0007000700070007) << 3 | (digits >> 8 & 0x0007000700070007);
+        digits = (digits & 0x0000003f0000003f) << 6 | (digits >> 16 & 0x0000003f0000003f);
+        digits = (digits & 0xfff) << 12 | (digits >> 32 & 0xfff);
+        result = result << 3 * nb_digits | digits;
+        i += nb_digits;
+        if (nb_digits < 8) break;
+    }
+    for (; i < len && bytes[i] >= '0' && bytes[i] <= '7'; i++) result = result << 3 | (bytes[i] - '0');
+    *value = (int64_t) result;
+    return i == len || bytes[i] == ' ' || bytes[i] == '\0' ? 0 : -1;
+}
+
+/*
+ * parses a numeric field of len bytes, in octal or, when the high bit of its first byte is set, in base-256,
+ * returns -1 if it is malformed
+ */
+static int parse_number(const char *field, size_t len, int64_t *value) {
+    const uint8_t *bytes = (const uint8_t *) field;
+    if (bytes[0] & 0x80){//big-endian two's complement, without the marker bit
+        uint64_t result = bytes[0] & 0x40 ? ~(uint64_t) 0x7f | bytes[0] : bytes[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) result = result << 8 | bytes[i];
+        *value = (int64_t) result;
+        return 0;
+    }
+    return parse_octal(bytes, len, value);
+}
+
+/**
+ * Parses a numeric field of a header, without reading past its end even when it is not terminated.
+ *
+ * @param field The field, in octal or in base-256.
+ * @param len The size of the field.
+ *
+ * @return the value of the field, or of its digits preceding the first invalid byte if it is malformed.
+ */
+int64_t tar_parse_number(const char *field, size_t len) {
+    int64_t value;
+    parse_number(field, len, &value);
+    return value;
+}
+
+/**
+ * Decodes the type and the numeric fields of a header.
+ *
+ * The name, the link target and the offsets of entry are left unchanged,
+ * since they depend on the extended headers preceding the header and on its position in the archive.
+ *
+ * @param header The header to decode.
+ * @param entry An out argument, its typeflag, size, mode, uid, gid, mtime, chksum and header are set.
+ *
+ * @return zero if every field is well-formed,
+ *         otherwise the TAR_FIELD_* flags of the malformed fields, which are set to the value of their valid digits.
+ */
+int tar_decode_header(const tar_header_t *header, tar_entry_t *entry) {
+    int64_t size, mode, uid, gid, mtime, chksum;
+    int malformed = 0;
+    malformed |= parse_number(header->mode, sizeof(header->mode), &mode) ? TAR_FIELD_MODE : 0;
+    malformed |= parse_number(header->uid, sizeof(header->uid), &uid) ? TAR_FIELD_UID : 0;
+    malformed |= parse_number(header->gid, sizeof(header->gid), &gid) ? TAR_FIELD_GID : 0;
+    malformed |= parse_number(header->size, sizeof(header->size), &size) || size < 0 ? TAR_FIELD_SIZE : 0;
+    malformed |= parse_number(header->mtime, sizeof(header->mtime), &mtime) ? TAR_FIELD_MTIME : 0;
+    malformed |= parse_number(header->chksum, sizeof(header->chksum), &chksum) ? TAR_FIELD_CHKSUM : 0;
+
+    entry->typeflag = header->typeflag;
+    entry->size = size < 0 ? 0 : size;
+    entry->mode = mode;
+    entry->uid = uid;
+    entry->gid = gid;
+    entry->mtime = mtime;
+    entry->chksum = chksum;
+    entry->header = header;
+    return malformed;
+}
+
+static int is_extension_type(char typeflag) {
+    return typeflag == XHDTYPE || typeflag == XGLTYPE || typeflag == GNUTYPE_LONGNAME || typeflag == GNUTYPE_LONGLINK;
+}
+
+/* copies the content of size bytes at offset to an extension buffer, null-terminated, returns -1 if it failed */
+static int iter_read_extension(tar_iter_t *iter, off_t offset, size_t size, iter_extension_t *extension) {
+    if (size > TAR_ITER_MAX_EXTENSION) return -1;
+    if (size + 1 > extension->capacity){
+        char *data = realloc(extension->data, size + 1);
+        if (data == NULL) return -1;
+        extension->data = data;
+        extension->capacity = size + 1;
+    }
+    for (size_t copied = 0; copied < size; copied += BLOCKSIZE){
+        const tar_header_t *block = iter_block(iter, offset + copied);
+        memcpy(extension->data + copied, block, size - copied < BLOCKSIZE ? size - copied : BLOCKSIZE);
+    }
+    extension->data[size] = '\0';
+    extension->len = size;
+    return iter->done < 0 ? -1 : 0;
+}
+
+/*
+ * applies the records "<length> <key>=<value>\n" of a PAX extended header to overrides,
+ * the values are null-terminated in place so that overrides can point to them
+ */
+static void pax_apply(iter_extension_t *extension, iter_overrides_t *overrides) {
+    size_t position = 0;
+    while (position < extension->len){
+        char *record = extension->data + position;
+        char *end;
+        unsigned long len = strtoul(record, &end, 10);
+        if (*end != ' ' || len <= (size_t) (end - record) || len > extension->len - position) return;//malformed
+        char *key = end + 1;
+        char *value = memchr(key, '=', record + len - key);
+        if (value == NULL) return;
+        record[len - 1] = '\0';//replaces the newline
+        *value++ = '\0';
+        if (!strcmp(key, "path")) overrides->path = *value ? value : NULL;
+        else if (!strcmp(key, "linkpath")) overrides->linkpath = *value ? value : NULL;
+        else if (!strcmp(key, "size")) overrides->size = *value ? strtoll(value, NULL, 10) : -1;
+        else if (!strcmp(key, "mtime")){//fractions of a second are dropped
+            overrides->mtime = strtoll(value, NULL, 10);
+            overrides->has_mtime = *value != '\0';
+        }
+        value[-1] = '=';//the record can be parsed again, for the members following a global header
+        position += len;
+    }
+}
+
+/* starts a scan at the header at offset, which returns the extended headers as entries in raw mode */
+static tar_iter_t *iter_open_at(int tar_fd, int raw, off_t offset) {
+
+    tar_iter_t *iter = calloc(1, sizeof(tar_iter_t));
+    if (iter == NULL) return NULL;
+    iter->tar_fd = tar_fd;
+    iter->raw = raw;
+    iter->next = offset;
+    iter->last = offset;
+    iter->window = TAR_ITER_MAX_GAP;//doubled by the following refills if the members are small
+    iter->mapping = get_mapping(tar_fd);
+
+    if (iter->mapping == NULL){
+        iter->buffer = malloc(TAR_ITER_BUFSIZE);
+        if (iter->buffer == NULL){
+            free(iter);
+            return NULL;
+        }
+    }
+    return iter;
+}
+
+static tar_iter_t *iter_open(int tar_fd, int raw) {
+    return iter_open_at(tar_fd, raw, 0);
+}
+
+/* returns the offset of the next header, which is the end of the archive once the scan is over */
+static off_t iter_offset(const tar_iter_t *iter) {
+    return iter->next;
+}
+
+/**
+ * Starts a scan of the headers of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return a pointer to the new iterator, to be released with tar_iter_close(),
+ *         NULL if memory could not be allocated.
+ */
+tar_iter_t *tar_iter_open(int tar_fd) {
+    return iter_open(tar_fd, 0);
+}
+
+/**
+ * Reads the next header of the archive.
+ *
+ * Every numeric field is parsed once, and the content of the entry is skipped without being read,
+ * unless it fits in the read-ahead buffer of the iterator. The PAX extended headers and GNU long names preceding
+ * a member are applied to it and are not returned as entries.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param entry An out argument, set to the decoded header. Its pointers stay valid until the next call.
+ *
+ * @return 1 if entry was set,
+ *         zero if the end of the archive was reached,
+ *         -1 if the archive could not be read.
+ */
+int tar_iter_next(tar_iter_t *iter, tar_entry_t *entry) {
+
+    if (iter->done) return iter->done > 0 ? 0 : -1;
+
+    iter_overrides_t overrides = {.size = -1};
+    const tar_header_t *header;
+    while (1){
+        header = iter_block(iter, iter->next);
+
+        //two null blocks mark the end of the archive
+        if (is_zero_block((const uint8_t *) header)){
+            const tar_header_t *header2 = iter_block(iter, iter->next + BLOCKSIZE);
+            if (is_zero_block((const uint8_t *) header2)){
+                if (!iter->done) iter->done = 1;
+                return iter->done > 0 ? 0 : -1;
+            }
+            header = iter_block(iter, iter->next);//reading the second block may have refilled the buffer
+        }
+        if (iter->done < 0) return -1;
+
+        //every header is decoded once, the extended headers only need their size
+        if (tar_decode_header(header, entry) & TAR_FIELD_SIZE){
+            tar_log(TAR_LOG_WARNING, 0, "malformed size field in the header at offset %lld", (long long) iter->next);
+            iter->done = -1;
+            if (!iter->raw) return -1;
+            entry->size = 0;//in raw mode the header is still returned, so that check_header() reports its errors first
+        }
+        STATS_ADD(headers, 1);
+        if (iter->raw || !is_extension_type(header->typeflag)) break;
+
+        //an extended header only describes the member following it, reading it may refill the buffer under header
+        char typeflag = header->typeflag;
+        iter_extension_t *extension = typeflag == XHDTYPE ? &iter->pax :
+                                      typeflag == XGLTYPE ? &iter->global :
+                                      typeflag == GNUTYPE_LONGNAME ? &iter->long_name : &iter->long_link;
+        if (iter_read_extension(iter, iter->next + BLOCKSIZE, entry->size, extension) < 0){
+            iter->done = -1;
+            return -1;
+        }
+        if (typeflag == XHDTYPE) pax_apply(extension, &overrides);
+        else if (typeflag == GNUTYPE_LONGNAME) overrides.path = extension->data;
+        else if (typeflag == GNUTYPE_LONGLINK) overrides.linkpath = extension->data;
+        iter->next += BLOCKSIZE + (entry->size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+    }
+    if (iter->global.len){//the records of the member take precedence over the global ones
+        iter_overrides_t global = {.size = -1};
+        pax_apply(&iter->global, &global);
+        if (overrides.path == NULL) overrides.path = global.path;
+        if (overrides.linkpath == NULL) overrides.linkpath = global.linkpath;
+        if (overrides.size < 0) overrides.size = global.size;
+        if (!overrides.has_mtime){
+            overrides.mtime = global.mtime;
+            overrides.has_mtime = global.has_mtime;
+        }
+    }
+
+    //the prefix field of a ustar header holds the directories of a name that does not fit in the name field
+    if (overrides.path != NULL){
+        entry->name = overrides.path;
+    } else if (header->prefix[0] && !memcmp(header->magic, TMAGIC, TMAGLEN)){
+        size_t len = strnlen(header->prefix, sizeof(header->prefix));
+        memcpy(iter->name, header->prefix, len);
+        iter->name[len] = '/';
+        copy_field(iter->name + len + 1, header->name, strnlen(header->name, sizeof(header->name)));
+        entry->name = iter->name;
+    } else {
+        copy_field(iter->name, header->name, sizeof(header->name));
+        entry->name = iter->name;
+    }
+    if (overrides.linkpath != NULL){
+        entry->linkname = overrides.linkpath;
+    } else {
+        copy_field(iter->linkname, header->linkname, sizeof(header->linkname));
+        entry->linkname = iter->linkname;
+    }
+    if (overrides.size >= 0) entry->size = overrides.size;
+    if (overrides.has_mtime) entry->mtime = overrides.mtime;
+    entry->offset = iter->next;
+    entry->data_offset = iter->next + BLOCKSIZE;
+    entry->header = header;
+
+    //the content is padded to a whole number of blocks
+    iter->next = entry->data_offset + (entry->size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+    return 1;
+}
+
+/**
+ * Releases an iterator returned by tar_iter_open().
+ *
+ * @param iter The iterator to release, may be NULL.
+ */
+void tar_iter_close(tar_iter_t *iter) {
+    if (iter == NULL) return;
+    free(iter->buffer);
+    free(iter->pax.data);
+    free(iter->global.data);
+    free(iter->long_name.data);
+    free(iter->long_link.data);
+    free(iter);
+}
+
+/*
+ * Parallel validation
+ *
+ * check_archive_parallel() reads the headers once, with the iterator, and hands copies of them to a pool of threads
+ * by batches of CHECK_BATCH_HEADERS, so that the headers are verified while the next ones are read and no header is
+ * read twice. At most CHECK_BATCHES batches are in flight, the reading waits for one of them to be verified when they
+ * are all full. The first invalid header, in archive order, decides the result, so the return codes are the ones of
+ * check_archive().
+ */
+
+#define CHECK_BATCH_HEADERS 256
+#define CHECK_BATCHES 16
+
+typedef struct check_batch {
+    tar_header_t headers[CHECK_BATCH_HEADERS];
+    size_t first;               // index in the archive of the first header of the batch
+    size_t nb_headers;
+    int busy;                   // 1 from the time the batch is filled until it is verified
+} check_batch_t;
+
+typedef struct check_pipeline {
+    check_batch_t *batches;     // CHECK_BATCHES batches, filled in turn
+    pthread_mutex_t lock;       // protects the fields below and the busy fields of the batches
+    pthread_cond_t cond;        // signaled when a batch is filled or verified, or when the reading is over
+    size_t nb_filled;           // number of batches filled since the start
+    size_t nb_taken;            // number of batches taken by a thread since the start
+    int over;                   // 1 once every header was read
+    _Atomic size_t first_error; // lowest index of an invalid header found so far, shared by all the threads
+} check_pipeline_t;
+
+typedef struct check_worker {
+    pthread_t thread;
+    int started;                // 1 if the thread could be started
+    check_pipeline_t *pipeline;
+    size_t error_index;         // index of the first invalid header found by this thread, SIZE_MAX if none
+    int error;                  // its error code
+    tar_check_stats_t stats;
+} check_worker_t;
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void check_batch_verify(check_worker_t *worker, const check_batch_t *batch) {
+    for (size_t i = 0; i < batch->nb_headers; i++){
+        size_t index = batch->first + i;
+        if (index > atomic_load(&worker->pipeline->first_error)) break;//an earlier header is already invalid
+
+        const tar_header_t *header = &batch->headers[i];
+        worker->stats.headers++;
+        STATS_ADD(headers, 1);
+        worker->stats.bytes += BLOCKSIZE;
+
+        int ret = check_header(header, TAR_INT(header->chksum));
+        if (ret){
+            if (index < worker->error_index){
+                worker->error_index = index;
+                worker->error = ret;
+            }
+            size_t expected = atomic_load(&worker->pipeline->first_error);
+            while (index < expected && !atomic_compare_exchange_weak(&worker->pipeline->first_error, &expected, index));
+            break;
+        }
+    }
+}
+
+/* verifies the next filled batch, called with the lock held, returns 0 if there was none */
+static int check_take(check_worker_t *worker) {
+    check_pipeline_t *pipeline = worker->pipeline;
+    if (pipeline->nb_taken == pipeline->nb_filled) return 0;
+    check_batch_t *batch = &pipeline->batches[pipeline->nb_taken++ % CHECK_BATCHES];
+    pthread_mutex_unlock(&pipeline->lock);
+    check_batch_verify(worker, batch);
+    pthread_mutex_lock(&pipeline->lock);
+    batch->busy = 0;
+    pthread_cond_broadcast(&pipeline->cond);
+    return 1;
+}
+
+static void *check_worker_run(void *arg) {
+
+    check_worker_t *worker = arg;
+    check_pipeline_t *pipeline = worker->pipeline;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (1){
+        if (check_take(worker)) continue;
+        if (pipeline->over) break;
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    worker->stats.seconds += elapsed_seconds(&start);
+    return NULL;
+}
+
+/* returns the next batch to fill, once it was verified, verifying the others in this thread when no thread runs */
+static check_batch_t *check_next_batch(check_pipeline_t *pipeline, check_worker_t *inline_worker) {
+    check_batch_t *batch = &pipeline->batches[pipeline->nb_filled % CHECK_BATCHES];
+    pthread_mutex_lock(&pipeline->lock);
+    while (batch->busy){
+        if (inline_worker == NULL || !check_take(inline_worker)) pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    batch->nb_headers = 0;
+    return batch;
+}
+
+/* hands a filled batch to the threads */
+static void check_push_batch(check_pipeline_t *pipeline, check_batch_t *batch, size_t first) {
+    pthread_mutex_lock(&pipeline->lock);
+    batch->first = first;
+    batch->busy = 1;
+    pipeline->nb_filled++;
+    pthread_cond_signal(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/**
+ * Same as check_archive(), but the headers are verified by several threads.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nb_threads The number of threads verifying the headers, zero or less to use one per online processor.
+ * @param stats An array of nb_threads statistics, one per thread, may be NULL.
+ *              When nb_threads is zero or less, it must hold one statistics per online processor.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nb_threads, tar_check_stats_t *stats) {
+
+    uint64_t start = stats_start();
+    if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads <= 0) nb_threads = 1;
+
+    check_pipeline_t pipeline = {.batches = calloc(CHECK_BATCHES, sizeof(check_batch_t))};
+    check_worker_t *workers = calloc(nb_threads, sizeof(check_worker_t));//nb_threads is not bounded by the stack
+    tar_iter_t *iter = iter_open(tar_fd, 1);
+    if (pipeline.batches == NULL || workers == NULL || iter == NULL){
+        free(pipeline.batches);
+        free(workers);
+        tar_iter_close(iter);
+        return -1;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+    atomic_init(&pipeline.first_error, SIZE_MAX);
+
+    int nb_started = 0;
+    for (int t = 0; t < nb_threads; t++){
+        workers[t].pipeline = &pipeline;
+        workers[t].error_index = SIZE_MAX;
+        workers[t].started = !pthread_create(&workers[t].thread, NULL, check_worker_run, &workers[t]);
+        nb_started += workers[t].started;
+    }
+    check_worker_t *inline_worker = nb_started ? NULL : &workers[0];//without threads, this one verifies the batches
+
+    //the headers are copied from the iterator buffer, or from the mapping in mmap mode
+    check_state_t state = {.last_header = -1};
+    check_batch_t *batch = NULL;
+    size_t nb_headers = 0;
+    tar_entry_t entry;
+    int more = 1;
+    while (atomic_load(&pipeline.first_error) == SIZE_MAX && (more = tar_iter_next(iter, &entry)) > 0){
+        if (batch == NULL) batch = check_next_batch(&pipeline, inline_worker);
+        memcpy(&batch->headers[batch->nb_headers++], entry.header, BLOCKSIZE);
+        state.last_header = entry.offset;
+        if (++nb_headers % CHECK_BATCH_HEADERS == 0){
+            check_push_batch(&pipeline, batch, nb_headers - CHECK_BATCH_HEADERS);
+            batch = NULL;
+        }
+    }
+    if (batch != NULL) check_push_batch(&pipeline, batch, nb_headers - batch->nb_headers);
+    state.end = more == 0 ? iter_offset(iter) : -1;
+    state.nb_headers = nb_headers;
+    tar_iter_close(iter);
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.over = 1;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.lock);
+    if (inline_worker != NULL) check_worker_run(inline_worker);
+
+    int ret = more < 0 ? -1 : (int) nb_headers;//the reading stopped on a malformed size field or a read error
+    size_t error_index = SIZE_MAX;
+    for (int t = 0; t < nb_threads; t++){
+        if (workers[t].started) pthread_join(workers[t].thread, NULL);
+        if (stats != NULL) stats[t] = workers[t].stats;
+        if (workers[t].error_index < error_index){//the first error in archive order wins
+            error_index = workers[t].error_index;
+            ret = workers[t].error;
+        }
+    }
+
+    if (ret >= 0) check_remember(tar_fd, &state);
+    pthread_cond_destroy(&pipeline.cond);
+    pthread_mutex_destroy(&pipeline.lock);
+    free(pipeline.batches);
+    free(workers);
+    stats_stop(TAR_STATS_CHECK, start);
+    return ret;
+}
+
+/*
+ * In-memory index
+ *
+ * The index is meant to hold tens of millions of members, so an entry is a row of fixed-size columns, without any
+ * pointer: entries are numbered by 32-bit ids, each column is an array indexed by id, and the columns share a single
+ * allocation, released at once. An entry only stores the last component of its path, followed by its linkname, and
+ * the id of its parent directory; the components are interned in a single string table, and a whole path is rebuilt
+ * from the parents when it is needed. An open-addressing hash table maps the hash of a whole path to its entry,
+ * stored as id + 1 so that 0 marks an empty slot; a candidate is compared with the path from its last component to
+ * its first one, so a lookup never rebuilds a path.
+ *
+ * A path that appears several times in the archive has a single entry, updated by each occurrence, and a directory
+ * that only appears in the paths of its children gets an implicit entry, with a negative offset, that can be listed
+ * but is not reported by the lookup functions. Once every header has been read, the entries are renumbered level by
+ * level, the children of each directory sorted by name: the children of a directory are then consecutive ids, found
+ * by a binary search of the parents column, so listing a directory does not depend on the order of the members in the
+ * archive. Paths of PATH_MAX bytes or more are not indexed.
+ */
+
+#define INDEX_NONE UINT32_MAX       // id of no entry
+#define INDEX_COLUMNS 7
+#define INDEX_ROW_SIZE (3 * sizeof(int64_t) + 2 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(char))
+
+/* sizes of the elements of the columns, in the order they are stored in their allocation */
+static const size_t index_column_sizes[INDEX_COLUMNS] = {
+    sizeof(int64_t), sizeof(uint64_t), sizeof(int64_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint16_t),
+    sizeof(char),
+};
+
+struct tar_index {
+    int tar_fd;
+
+    //columns, indexed by entry id, offsets being the start of their allocation
+    int64_t *offsets;       // offset of the header of the entry in the archive, negative for an implicit directory
+    uint64_t *sizes;        // size of the content of the entry
+    int64_t *mtimes;        // modification time of the entry, in seconds since the epoch
+    uint32_t *parents;      // id + 1 of the parent directory of the entry, 0 at the root of the archive
+    uint32_t *names;        // offset in the string table of the last component of the path, followed by the linkname
+    uint16_t *modes;        // permission bits of the entry
+    char *typeflags;
+    size_t nb_entries;
+    size_t entries_capacity;
+
+    char *strings;
+    size_t strings_len;
+    size_t strings_capacity;
+    uint32_t *interned;     // hash table of the strings, offset + 1, only while entries are added
+    size_t nb_interned_slots;   // always a power of two
+    size_t nb_interned;
+
+    uint32_t *slots;
+    size_t nb_slots;        // always a power of two
+
+    size_t nb_links;
+    _Atomic uint64_t *resolved; // hash table of the links resolved once, NULL when the index has no link
+    size_t nb_resolved_slots;   // always a power of two
+    off_t end;          // offset of the null blocks ending the archive, -1 until tar_refresh() computes it
+
+    void *file;         // mapping of the sidecar the arrays point into, NULL when they are allocated
+    size_t file_size;
+};
+
+#define INDEX_BASENAME(index, id) ((index)->strings + (index)->names[id])
+#define INDEX_LINKNAME(index, id) (INDEX_BASENAME(index, id) + strlen(INDEX_BASENAME(index, id)) + 1)
+#define INDEX_IMPLICIT(index, id) ((index)->offsets[id] < 0)
+
+/* 64-bit FNV-1a hash of len bytes, continuing from hash */
+static uint64_t hash_bytes(const void *bytes, size_t len, uint64_t hash) {
+    for (size_t i = 0; i < len; i++){
+        hash ^= ((const uint8_t *) bytes)[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* 64-bit FNV-1a hash of a path of len bytes, which continues the hash of the path of its parent directory */
+static uint64_t index_hash(const char *path, size_t len) {
+    return hash_bytes(path, len, 0xcbf29ce484222325ULL);
+}
+
+/* sets the start of each column in a block of capacity rows */
+static void index_layout(void *block, size_t capacity, void *columns[INDEX_COLUMNS]) {
+    uint8_t *column = block;
+    for (int i = 0; i < INDEX_COLUMNS; i++){
+        columns[i] = column;
+        column += capacity * index_column_sizes[i];
+    }
+}
+
+/* returns the columns of the index, in the order of index_column_sizes */
+static void index_get_columns(const tar_index_t *index, void *columns[INDEX_COLUMNS]) {
+    columns[0] = index->offsets;
+    columns[1] = index->sizes;
+    columns[2] = index->mtimes;
+    columns[3] = index->parents;
+    columns[4] = index->names;
+    columns[5] = index->modes;
+    columns[6] = index->typeflags;
+}
+
+/* points the columns of the index to a block of capacity rows */
+static void index_set_columns(tar_index_t *index, void *block, size_t capacity) {
+    void *columns[INDEX_COLUMNS];
+    index_layout(block, capacity, columns);
+    index->offsets = columns[0];
+    index->sizes = columns[1];
+    index->mtimes = columns[2];
+    index->parents = columns[3];
+    index->names = columns[4];
+    index->modes = columns[5];
+    index->typeflags = columns[6];
+    index->entries_capacity = capacity;
+}
+
+/* copies the rows of the index to a new block of capacity rows, and releases the previous one unless it is mapped */
+static int index_move_columns(tar_index_t *index, size_t capacity) {
+    void *block = malloc(capacity * INDEX_ROW_SIZE);
+    if (block == NULL) return -1;
+    void *from[INDEX_COLUMNS], *to[INDEX_COLUMNS];
+    index_get_columns(index, from);
+    index_layout(block, capacity, to);
+    for (int i = 0; index->nb_entries && i < INDEX_COLUMNS; i++){
+        memcpy(to[i], from[i], index->nb_entries * index_column_sizes[i]);
+    }
+    if (index->file == NULL) free(index->offsets);
+    index_set_columns(index, block, capacity);
+    return 0;
+}
+
+/* length of a last component and its linkname in the string table, null bytes included */
+static size_t index_record_len(const char *record) {
+    size_t len = strlen(record) + 1;
+    return len + strlen(record + len) + 1;
+}
+
+/* hash of a last component of name_len bytes followed by a linkname of link_len bytes */
+static uint64_t index_record_hash(const char *name, size_t name_len, const char *linkname, size_t link_len) {
+    return hash_bytes(linkname, link_len, hash_bytes("", 1, index_hash(name, name_len)));
+}
+
+/* inserts the string at offset in the hash table of the strings */
+static void index_intern_insert(tar_index_t *index, uint32_t offset) {
+    const char *name = index->strings + offset;
+    size_t name_len = strlen(name);
+    size_t mask = index->nb_interned_slots - 1;
+    size_t i = index_record_hash(name, name_len, name + name_len + 1, strlen(name + name_len + 1)) & mask;
+    while (index->interned[i]) i = (i + 1) & mask;//the strings are all different
+    index->interned[i] = offset + 1;
+}
+
+/* rebuilds the hash table of the strings from the string table, with room for at least one more string */
+static int index_intern_grow(tar_index_t *index) {
+    size_t nb_strings = 0;
+    for (size_t offset = 0; offset < index->strings_len; nb_strings++){
+        offset += index_record_len(index->strings + offset);
+    }
+    size_t nb_slots = 1024;
+    while (2 * (nb_strings + 1) > nb_slots) nb_slots *= 2;//keep the load factor under 1/2
+    uint32_t *interned = calloc(nb_slots, sizeof(uint32_t));
+    if (interned == NULL) return -1;
+    free(index->interned);
+    index->interned = interned;
+    index->nb_interned_slots = nb_slots;
+    index->nb_interned = nb_strings;
+    for (size_t offset = 0; offset < index->strings_len; offset += index_record_len(index->strings + offset)){
+        index_intern_insert(index, offset);
+    }
+    return 0;
+}
+
+/* returns the offset of a last component followed by a linkname in the string table, adding them if needed */
+static int64_t index_intern(tar_index_t *index, const char *name, size_t name_len, const char *linkname,
+                            size_t link_len) {
+    //the table is rebuilt from the string table when it is missing, after the index was built or loaded
+    size_t record_len = name_len + link_len + 2;
+    if ((index->interned == NULL || 2 * (index->nb_interned + 1) > index->nb_interned_slots)
+        && index_intern_grow(index) < 0) return -1;
+    size_t mask = index->nb_interned_slots - 1;
+    size_t i = index_record_hash(name, name_len, linkname, link_len) & mask;
+    for (; index->interned[i]; i = (i + 1) & mask){
+        const char *record = index->strings + index->interned[i] - 1;
+        if (!strncmp(record, name, name_len) && record[name_len] == '\0'
+            && !strncmp(record + name_len + 1, linkname, link_len) && record[name_len + 1 + link_len] == '\0'){
+            return index->interned[i] - 1;
+        }
+    }
+
+    if (index->strings_len + record_len > index->strings_capacity){
+        size_t capacity = index->strings_capacity ? index->strings_capacity * 2 : 4096;
+        while (capacity < index->strings_len + record_len) capacity *= 2;
+        if (capacity > UINT32_MAX) return -1;//offsets are stored on 32 bits
+        char *strings = realloc(index->strings, capacity);
+        if (strings == NULL) return -1;
+        index->strings = strings;
+        index->strings_capacity = capacity;
+    }
+    int64_t offset = index->strings_len;
+    memcpy(index->strings + offset, name, name_len);
+    index->strings[offset + name_len] = '\0';
+    memcpy(index->strings + offset + name_len + 1, linkname, link_len);
+    index->strings[offset + record_len - 1] = '\0';
+    index->strings_len += record_len;
+    index->interned[i] = offset + 1;
+    index->nb_interned++;
+    return offset;
+}
+
+/* returns 1 if the path of len bytes is the path of an entry, compared from its last component to its first one */
+static int index_name_is(const tar_index_t *index, uint32_t id, const char *path, size_t len) {
+    while (1){
+        const char *name = INDEX_BASENAME(index, id);
+        size_t n = strlen(name);
+        if (n > len || memcmp(path + len - n, name, n)) return 0;
+        len -= n;
+        if (!index->parents[id]) return len == 0;
+        id = index->parents[id] - 1;
+    }
+}
+
+/* writes the path of an entry to dest, which holds PATH_MAX bytes, and returns its length */
+static size_t index_name(const tar_index_t *index, uint32_t id, char *dest) {
+    size_t len = 0;
+    for (uint32_t i = id + 1; i; i = index->parents[i - 1]) len += strlen(INDEX_BASENAME(index, i - 1));
+    if (len >= PATH_MAX) len = 0;//only in a corrupted sidecar, longer paths are not indexed
+    dest[len] = '\0';
+    size_t end = len;
+    for (uint32_t i = id + 1; i && end; i = index->parents[i - 1]){
+        const char *name = INDEX_BASENAME(index, i - 1);
+        size_t n = strlen(name);
+        end -= n;
+        memcpy(dest + end, name, n);
+    }
+    return len;
+}
+
+/* returns the slot where the path of len bytes is stored, or the empty slot where it should be inserted */
+static uint32_t *index_slot(const tar_index_t *index, const char *path, size_t len) {
+    size_t mask = index->nb_slots - 1;
+    size_t i = index_hash(path, len) & mask;
+    while (index->slots[i] && !index_name_is(index, index->slots[i] - 1, path, len)){
+        i = (i + 1) & mask;//linear probing
+    }
+    return &index->slots[i];
+}
+
+/* doubles the hash table and reinserts every entry */
+static int index_grow_slots(tar_index_t *index) {
+    size_t nb_slots = index->nb_slots ? index->nb_slots * 2 : 1024;
+    uint32_t *slots = calloc(nb_slots, sizeof(uint32_t));
+    uint64_t *hashes = malloc((index->nb_entries ? index->nb_entries : 1) * sizeof(uint64_t));
+    if (slots == NULL || hashes == NULL){
+        free(slots);
+        free(hashes);
+        return -1;
+    }
+    //the hash of a path continues the hash of the path of its parent, which has a smaller id
+    for (size_t id = 0; id < index->nb_entries; id++){
+        const char *name = INDEX_BASENAME(index, id);
+        uint32_t parent = index->parents[id];
+        hashes[id] = hash_bytes(name, strlen(name), parent ? hashes[parent - 1] : index_hash("", 0));
+        size_t i = hashes[id] & (nb_slots - 1);
+        while (slots[i]) i = (i + 1) & (nb_slots - 1);//the paths are all different
+        slots[i] = id + 1;
+    }
+    free(hashes);
+    free(index->slots);
+    index->slots = slots;
+    index->nb_slots = nb_slots;
+    return 0;
+}
+
+/* length of the path of the parent directory of a path of len bytes, trailing "/" included, zero at the root */
+static size_t parent_len(const char *name, size_t len) {
+    if (len && name[len - 1] == '/') len--;//the name of a directory ends with a "/"
+    while (len && name[len - 1] != '/') len--;
+    return len;
+}
+
+static int64_t index_push(tar_index_t *index, const char *name, size_t name_len, const char *linkname, size_t link_len,
+                          char typeflag, size_t size, off_t offset);
+
+/* appends an entry for a path of len bytes that is not in the index yet, after its parent, and returns its id */
+static int64_t index_append(tar_index_t *index, const char *name, size_t len, size_t dir_len) {
+    int64_t parent = -1;
+    if (dir_len){
+        uint32_t slot = *index_slot(index, name, dir_len);
+        parent = slot ? (int64_t) slot - 1 : index_push(index, name, dir_len, "", 0, DIRTYPE, 0, -1);
+        if (parent < 0) return -1;
+    }
+    if (index->nb_entries == index->entries_capacity
+        && index_move_columns(index, index->entries_capacity ? index->entries_capacity * 2 : 256) < 0) return -1;
+    if (index->nb_entries >= UINT32_MAX - 1) return -1;//ids are stored on 32 bits
+    //keep the load factor of the hash table under 3/4
+    if (4 * (index->nb_entries + 1) > 3 * index->nb_slots && index_grow_slots(index) < 0) return -1;
+
+    int64_t id = index->nb_entries;
+    index->parents[id] = parent + 1;
+    *index_slot(index, name, len) = id + 1;
+    index->nb_entries++;
+    return id;
+}
+
+/* adds an entry to the index, or updates the entry at its path, and returns its id,
+ * name and linkname are fields of at most name_len and link_len bytes */
+static int64_t index_push(tar_index_t *index, const char *name, size_t name_len, const char *linkname, size_t link_len,
+                          char typeflag, size_t size, off_t offset) {
+    name_len = strnlen(name, name_len);
+    link_len = strnlen(linkname, link_len);
+    size_t dir_len = parent_len(name, name_len);
+    int64_t record = index_intern(index, name + dir_len, name_len - dir_len, linkname, link_len);
+    if (record < 0) return -1;
+
+    int64_t id = (int64_t) *index_slot(index, name, name_len) - 1;
+    if (id < 0 && (id = index_append(index, name, name_len, dir_len)) < 0) return -1;
+    index->offsets[id] = offset;
+    index->sizes[id] = size;
+    index->mtimes[id] = 0;
+    index->names[id] = record;
+    index->modes[id] = typeflag == DIRTYPE ? 0755 : 0644;//implicit directories keep these defaults
+    index->typeflags[id] = typeflag;
+    return id;
+}
+
+/* adds an entry returned by the header iterator */
+static int index_add(tar_index_t *index, const tar_entry_t *entry) {
+    size_t len = strlen(entry->name);
+    if (len >= PATH_MAX){
+        tar_log(TAR_LOG_WARNING, 0, "the member at offset %lld has a path too long to be indexed",
+                (long long) entry->offset);
+        return 0;
+    }
+    int64_t id = index_push(index, entry->name, len, entry->linkname, strlen(entry->linkname), entry->typeflag,
+                            entry->size, entry->offset);
+    if (id < 0) return -1;
+    index->modes[id] = entry->mode & 07777;
+    index->mtimes[id] = entry->mtime;
+    return 0;
+}
+
+/* returns the id of the entry stored at path, implicit directories included, or INDEX_NONE if there is none */
+static uint32_t index_find(const tar_index_t *index, const char *path) {
+    uint32_t slot = *index_slot(index, path, strlen(path));
+    return slot ? slot - 1 : INDEX_NONE;
+}
+
+/* returns the id of the entry stored at path, or INDEX_NONE if there is none */
+static uint32_t index_lookup(const tar_index_t *index, const char *path) {
+    uint32_t id = index_find(index, path);
+    if (id != INDEX_NONE && INDEX_IMPLICIT(index, id)) id = INDEX_NONE;
+    if (id != INDEX_NONE) STATS_ADD(index_hits, 1);
+    else STATS_ADD(index_misses, 1);
+    return id;
+}
+
+/* sets first and nb to the ids of the children of a directory, INDEX_NONE for the root of the archive */
+static void index_children(const tar_index_t *index, uint32_t dir, uint32_t *first, uint32_t *nb) {
+    //the entries are numbered level by level, so the parents column is sorted and the children follow their parent
+    uint32_t key = dir + 1;//0 for the root
+    size_t low = key, high = index->nb_entries;
+    while (low < high){
+        size_t middle = low + (high - low) / 2;
+        if (index->parents[middle] < key) low = middle + 1;
+        else high = middle;
+    }
+    *first = low;
+    high = index->nb_entries;
+    while (low < high){
+        size_t middle = low + (high - low) / 2;
+        if (index->parents[middle] <= key) low = middle + 1;
+        else high = middle;
+    }
+    *nb = low - *first;
+}
+
+/* strings comparison for qsort_r(), on the ids of entries of the same directory */
+static int index_compare_names(const void *a, const void *b, void *arg) {
+    const tar_index_t *index = arg;
+    return strcmp(INDEX_BASENAME(index, *(const uint32_t *) a), INDEX_BASENAME(index, *(const uint32_t *) b));
+}
+
+/* renumbers the entries level by level, the children of each directory sorted by name */
+static int index_build_tree(tar_index_t *index) {
+
+    size_t nb_entries = index->nb_entries;
+    uint32_t *groups = calloc(nb_entries + 2, sizeof(uint32_t));//end of the children of each parent, by id + 1
+    uint32_t *sorted = malloc((nb_entries ? nb_entries : 1) * sizeof(uint32_t));
+    uint32_t *order = malloc((nb_entries ? nb_entries : 1) * sizeof(uint32_t));
+    void *block = malloc((nb_entries ? nb_entries : 1) * INDEX_ROW_SIZE);
+    if (groups == NULL || sorted == NULL || order == NULL || block == NULL){
+        free(groups);
+        free(sorted);
+        free(order);
+        free(block);
+        return -1;
+    }
+
+    //group the ids by parent with a counting sort, then sort each group by name
+    for (size_t id = 0; id < nb_entries; id++) groups[index->parents[id] + 1]++;
+    for (size_t parent = 0; parent <= nb_entries; parent++) groups[parent + 1] += groups[parent];
+    for (size_t id = 0; id < nb_entries; id++) sorted[groups[index->parents[id]]++] = id;
+    for (size_t parent = 0; parent <= nb_entries; parent++){
+        uint32_t first = parent ? groups[parent - 1] : 0;
+        qsort_r(sorted + first, groups[parent] - first, sizeof(uint32_t), index_compare_names, index);
+    }
+
+    //the children of the root first, then the children of each entry in the new order
+    size_t nb_ordered = 0;
+    for (size_t i = 0; i <= nb_ordered; i++){
+        uint32_t parent = i ? order[i - 1] + 1 : 0;
+        uint32_t first = parent ? groups[parent - 1] : 0;
+        memcpy(order + nb_ordered, sorted + first, (groups[parent] - first) * sizeof(uint32_t));
+        nb_ordered += groups[parent] - first;
+    }
+    uint32_t *new_ids = sorted;//the groups are not needed any more
+    for (size_t i = 0; i < nb_entries; i++) new_ids[order[i]] = i;
+
+    //move the rows in the new order, the slots only depend on the paths and keep their positions
+    void *from[INDEX_COLUMNS], *to[INDEX_COLUMNS];
+    index_get_columns(index, from);
+    index_layout(block, nb_entries ? nb_entries : 1, to);
+    for (int c = 0; c < INDEX_COLUMNS; c++){
+        size_t size = index_column_sizes[c];
+        for (size_t i = 0; i < nb_entries; i++){
+            memcpy((uint8_t *) to[c] + i * size, (uint8_t *) from[c] + order[i] * size, size);
+        }
+    }
+    free(index->offsets);
+    index_set_columns(index, block, nb_entries ? nb_entries : 1);
+    index->nb_links = 0;
+    for (size_t id = 0; id < nb_entries; id++){
+        if (index->parents[id]) index->parents[id] = new_ids[index->parents[id] - 1] + 1;
+        if (is_link_type(index->typeflags[id])) index->nb_links++;
+    }
+    for (size_t i = 0; i < index->nb_slots; i++){
+        if (index->slots[i]) index->slots[i] = new_ids[index->slots[i] - 1] + 1;
+    }
+
+    free(groups);
+    free(sorted);
+    free(order);
+    return 0;
+}
+
+/*
+ * Link resolution
+ *
+ * The target of a symlink is relative to the directory of the link, the target of a hard link to the root of the
+ * archive. Targets are normalized ("." and empty components dropped, ".." removing the previous component) before
+ * being looked up, and a directory of the path that is itself a symlink is replaced by its target, as the kernel does.
+ * The entry a link resolves to is memoized in a hash table of the links of the index, sized for all of them, so that
+ * a chain is only walked once, and a resolution that takes more than TAR_MAX_LINK_HOPS links is considered a loop.
+ */
+
+#define TAR_MAX_LINK_HOPS 40
+#define LINK_UNRESOLVED UINT32_MAX  // memoized for the links that do not resolve to any entry
+
+/* allocates the empty hash table of the link resolutions, returns -1 if memory could not be allocated */
+static int index_alloc_resolved(tar_index_t *index) {
+    free(index->resolved);
+    index->resolved = NULL;
+    index->nb_resolved_slots = 0;
+    if (!index->nb_links) return 0;
+
+    size_t nb_slots = 16;
+    while (nb_slots < 2 * index->nb_links) nb_slots *= 2;//keep the load factor under 1/2
+    index->resolved = calloc(nb_slots, sizeof(uint64_t));
+    if (index->resolved == NULL) return -1;
+    index->nb_resolved_slots = nb_slots;
+    return 0;
+}
+
+/* returns id + 1 of the entry a link resolves to, LINK_UNRESOLVED if it is broken, 0 until it is resolved once */
+static uint32_t index_get_resolved(const tar_index_t *index, uint32_t link) {
+    size_t mask = index->nb_resolved_slots - 1;
+    //a slot holds the id + 1 of a link in its high half and its resolution in its low half
+    for (size_t i = (link * 0x9e3779b1U) & mask; ; i = (i + 1) & mask){
+        uint64_t slot = atomic_load_explicit(&index->resolved[i], memory_order_relaxed);
+        if (!slot) return 0;
+        if (slot >> 32 == (uint64_t) link + 1) return (uint32_t) slot;
+    }
+}
+
+/* memoizes the resolution of a link */
+static void index_set_resolved(const tar_index_t *index, uint32_t link, uint32_t resolved) {
+    size_t mask = index->nb_resolved_slots - 1;
+    uint64_t value = ((uint64_t) link + 1) << 32 | resolved;
+    for (size_t i = (link * 0x9e3779b1U) & mask; ; i = (i + 1) & mask){
+        uint64_t slot = 0;
+        if (atomic_compare_exchange_strong_explicit(&index->resolved[i], &slot, value, memory_order_relaxed,
+                                                    memory_order_relaxed)) return;
+        if (slot >> 32 == (uint64_t) link + 1) return;//memoized by another thread
+    }
+}
+
+/* appends path to the normalized path of len bytes in dest, and returns the new length, -1 if it leaves the root */
+static ssize_t normalize_path(char *dest, size_t len, const char *path) {
+    while (*path){
+        const char *end = strchrnul(path, '/');
+        size_t n = end - path;
+        if (n == 2 && path[0] == '.' && path[1] == '.'){
+            if (!len) return -1;
+            while (len && dest[len - 1] != '/') len--;
+            if (len) len--;//drop the "/" too
+        } else if (n && !(n == 1 && path[0] == '.')){
+            if (len + n + 2 > PATH_MAX) return -1;
+            if (len) dest[len++] = '/';
+            memcpy(dest + len, path, n);
+            len += n;
+        }
+        path = *end ? end + 1 : end;
+    }
+    dest[len] = '\0';
+    return len;
+}
+
+/* returns the entry at the normalized path of len bytes, as a file or a directory, with or without "./" */
+static uint32_t index_find_normalized(const tar_index_t *index, const char *path, size_t len) {
+    if (!len || len >= PATH_MAX) return INDEX_NONE;
+
+    char name[PATH_MAX + 3] = "./";
+    memcpy(name + 2, path, len);
+    name[len + 2] = '/';//directories end with a "/"
+    for (int prefix = 2; prefix >= 0; prefix -= 2){
+        for (size_t with_slash = 0; with_slash <= 1; with_slash++){
+            uint32_t slot = *index_slot(index, name + prefix, len + 2 - prefix + with_slash);
+            if (slot) return slot - 1;
+        }
+    }
+    return INDEX_NONE;
+}
+
+static uint32_t index_follow(const tar_index_t *index, uint32_t id, int *hops);
+
+/* returns the entry at the normalized path of len bytes, resolving the symlinks among its directories, not the entry */
+static uint32_t index_walk(const tar_index_t *index, char *path, size_t len, int *hops) {
+    while (1){
+        uint32_t id = index_find_normalized(index, path, len);
+        if (id != INDEX_NONE) return id;
+
+        //find the first directory of the path that is a symlink, every directory of an entry is in the index
+        size_t i;
+        for (i = 0; i < len; i++){
+            if (path[i] != '/') continue;
+            id = index_find_normalized(index, path, i);
+            if (id == INDEX_NONE) return INDEX_NONE;
+            if (is_link_type(index->typeflags[id])) break;
+        }
+        if (i == len) return INDEX_NONE;
+
+        id = index_follow(index, id, hops);
+        if (id == INDEX_NONE || index->typeflags[id] != DIRTYPE) return INDEX_NONE;
+
+        //replace the symlink by the name of the directory it resolves to
+        char name[PATH_MAX], resolved[PATH_MAX];
+        index_name(index, id, name);
+        ssize_t n = normalize_path(resolved, 0, name);
+        if (n < 0 || (n = normalize_path(resolved, n, path + i)) < 0) return INDEX_NONE;
+        memcpy(path, resolved, n + 1);
+        len = n;
+    }
+}
+
+/* writes the normalized path of the target of a link to dest, and returns its length, -1 if it leaves the archive */
+static ssize_t index_link_target(const tar_index_t *index, uint32_t id, char *dest) {
+    const char *linkname = INDEX_LINKNAME(index, id);
+
+    ssize_t len = 0;
+    if (index->typeflags[id] == SYMTYPE && linkname[0] != '/' && index->parents[id]){//relative to the directory
+        char dir[PATH_MAX];
+        index_name(index, index->parents[id] - 1, dir);
+        if ((len = normalize_path(dest, 0, dir)) < 0) return -1;
+    }
+    return normalize_path(dest, len, linkname);
+}
+
+/*
+ * returns the entry a link finally resolves to, or the entry itself if it is not a link, INDEX_NONE if the link is
+ * broken or loops, in which case hops is set past TAR_MAX_LINK_HOPS
+ */
+static uint32_t index_follow(const tar_index_t *index, uint32_t id, int *hops) {
+
+    uint32_t links[TAR_MAX_LINK_HOPS + 1];//the links of the chain, they all resolve to the same entry
+    int nb_links = 0;
+    char target[PATH_MAX];
+
+    while (id != INDEX_NONE && is_link_type(index->typeflags[id])){
+        uint32_t resolved = index_get_resolved(index, id);
+        if (resolved){
+            id = resolved == LINK_UNRESOLVED ? INDEX_NONE : resolved - 1;
+            break;
+        }
+        if (++*hops > TAR_MAX_LINK_HOPS){
+            id = INDEX_NONE;
+            break;
+        }
+        links[nb_links++] = id;
+        STATS_ADD(link_hops, 1);
+        ssize_t len = index_link_target(index, id, target);
+        id = len < 0 ? INDEX_NONE : index_walk(index, target, len, hops);
+    }
+
+    //a loop is not memoized, its links may still resolve from another starting point with more hops left
+    if (id == INDEX_NONE && *hops > TAR_MAX_LINK_HOPS) return INDEX_NONE;
+    //the result is the same whichever thread computes it, so concurrent stores are harmless
+    uint32_t resolved = id != INDEX_NONE ? id + 1 : LINK_UNRESOLVED;
+    for (int i = 0; i < nb_links; i++) index_set_resolved(index, links[i], resolved);
+    return id;
+}
+
+/* returns the entry a path resolves to, links followed, implicit directories included, INDEX_NONE if there is none */
+static uint32_t index_resolve(const tar_index_t *index, const char *path) {
+
+    int hops = 0;
+    uint32_t id = index_find(index, path);//the path is usually the name of an entry
+    if (id == INDEX_NONE){
+        char normalized[PATH_MAX];
+        ssize_t len = normalize_path(normalized, 0, path);
+        if (len < 0) return INDEX_NONE;
+        id = index_walk(index, normalized, len, &hops);
+    }
+    id = index_follow(index, id, &hops);
+    if (id != INDEX_NONE) STATS_ADD(index_hits, 1);
+    else STATS_ADD(index_misses, 1);
+    return id;
+}
+
+/* sets data_offset and size to the location of the content of the file a path resolves to, -1 if it is not a file */
+static int index_locate_file(const tar_index_t *index, const char *path, off_t *data_offset, size_t *size) {
+    uint32_t id = index_resolve(index, path);
+    if (id == INDEX_NONE || !is_file_type(index->typeflags[id])) return -1;
+    *data_offset = index->offsets[id] + BLOCKSIZE;
+    *size = index->sizes[id];
+    return 0;
+}
+
+/* tar_index_build() without the statistics */
+static tar_index_t *index_build(int tar_fd) {
+
+    tar_index_t *index = calloc(1, sizeof(tar_index_t));
+    if (index == NULL) return NULL;
+    index->tar_fd = tar_fd;
+    if (index_grow_slots(index) < 0){
+        tar_index_free(index);
+        return NULL;
+    }
+
+    tar_iter_t *iter = tar_iter_open(tar_fd);
+    if (iter == NULL){
+        tar_index_free(index);
+        return NULL;
+    }
+
+    int ret;
+    tar_entry_t entry;
+    while ((ret = tar_iter_next(iter, &entry)) > 0){
+        if (index_add(index, &entry) < 0) break;
+    }
+    index->end = iter_offset(iter);
+    tar_iter_close(iter);
+
+    if (ret != 0 || index_build_tree(index) < 0 || index_alloc_resolved(index) < 0){
+        tar_index_free(index);
+        return NULL;
+    }
+    //the string table does not grow any more
+    free(index->interned);
+    index->interned = NULL;
+    char *strings = realloc(index->strings, index->strings_len ? index->strings_len : 1);
+    if (strings != NULL){
+        index->strings = strings;
+        index->strings_capacity = index->strings_len;
+    }
+    return index;
+}
+
+/**
+ * Builds the index of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a pointer to the new index, to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_build(int tar_fd) {
+    uint64_t start = stats_start();
+    tar_index_t *ret = index_build(tar_fd);
+    stats_stop(TAR_STATS_INDEX_BUILD, start);
+    return ret;
+}
+
+/**
+ * Releases an index built by tar_index_build() or loaded by tar_index_load().
+ *
+ * @param index The index to release, may be NULL.
+ */
+void tar_index_free(tar_index_t *index) {
+    if (index == NULL) return;
+    if (index->file != NULL){
+        munmap(index->file, index->file_size);
+    } else {
+        free(index->offsets);//every column
+        free(index->strings);
+        free(index->slots);
+    }
+    free(index->interned);
+    free(index->resolved);
+    free(index);
+}
+
+/**
+ * Returns the memory used by an index.
+ *
+ * @param index The index.
+ *
+ * @return the number of bytes allocated for the index, or mapped from its sidecar.
+ */
+size_t tar_index_memory(const tar_index_t *index) {
+    size_t memory = sizeof(tar_index_t) + index->nb_resolved_slots * sizeof(uint64_t);
+    if (index->file != NULL) return memory + index->file_size;
+    return memory + index->entries_capacity * INDEX_ROW_SIZE + index->strings_capacity
+           + index->nb_slots * sizeof(uint32_t) + index->nb_interned_slots * sizeof(uint32_t);
+}
+
+/**
+ * Same as exists(), but answered from the index.
+ */
+int tar_index_exists(tar_index_t *index, char *path) {
+    return index_lookup(index, path) != INDEX_NONE;
+}
+
+/**
+ * Same as is_dir(), but answered from the index.
+ */
+int tar_index_is_dir(tar_index_t *index, char *path) {
+    uint32_t id = index_lookup(index, path);
+    return id != INDEX_NONE && index->typeflags[id] == DIRTYPE;
+}
+
+/**
+ * Same as is_file(), but answered from the index.
+ */
+int tar_index_is_file(tar_index_t *index, char *path) {
+    uint32_t id = index_lookup(index, path);
+    return id != INDEX_NONE && (index->typeflags[id] == REGTYPE || index->typeflags[id] == AREGTYPE);
+}
+
+/**
+ * Same as is_symlink(), but answered from the index.
+ */
+int tar_index_is_symlink(tar_index_t *index, char *path) {
+    uint32_t id = index_lookup(index, path);
+    return id != INDEX_NONE && (index->typeflags[id] == LNKTYPE || index->typeflags[id] == SYMTYPE);
+}
+
+/**
+ * Same as list(), but answered from the index, in time proportional to the number of entries listed.
+ * The entries are listed sorted by name, whatever their order in the archive.
+ * The links given as path or among its directories are resolved, whatever the length of the chain.
+ */
+int tar_index_list(tar_index_t *index, char *path, char **entries, size_t *no_entries) {
+    size_t cursor = 0;
+    return tar_index_list_from(index, path, &cursor, entries, no_entries);
+}
+
+/**
+ * Lists the entries at a given path in the archive, by pages.
+ *
+ * The entries are listed sorted by name, starting at the position given by cursor, so that a large directory
+ * can be listed by successive calls without listing its first entries again.
+ * Directories that have no header of their own but contain entries of the archive are listed too, and can be listed.
+ *
+ * @param index The index of the archive.
+ * @param path A path to a directory in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param cursor An in-out argument.
+ *               The caller set it to the position of the first entry to list, zero to start from the beginning.
+ *               The callee set it to the position of the first entry that was not listed.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         1 if the last entry of the directory was listed,
+ *         2 if entries remain to be listed from the new cursor.
+ */
+int tar_index_list_from(tar_index_t *index, char *path, size_t *cursor, char **entries, size_t *no_entries) {
+
+    uint32_t dir = index_resolve(index, path);
+    if (dir == INDEX_NONE || index->typeflags[dir] != DIRTYPE){
+        *no_entries = 0;
+        return 0;
+    }
+
+    uint32_t first, nb_children;
+    index_children(index, dir, &first, &nb_children);
+    size_t listed = 0;
+    while (*cursor < nb_children && listed < *no_entries){
+        index_name(index, first + *cursor, entries[listed++]);
+        (*cursor)++;
+    }
+
+    *no_entries = listed;
+    return *cursor < nb_children ? 2 : 1;
+}
+
+/**
+ * Same as read_file(), but the entry is located from the index, so only its content is read from the archive.
+ * The links given as path or among its directories are resolved, whatever the length of the chain.
+ */
+ssize_t tar_index_read_file(tar_index_t *index, char *path, size_t offset, uint8_t *dest, size_t *len) {
+
+    uint32_t id = index_resolve(index, path);
+    if (id == INDEX_NONE || !(index->typeflags[id] == REGTYPE || index->typeflags[id] == AREGTYPE)) return -1;
+    if (offset > index->sizes[id]) return -2;
+
+    size_t bytes_to_read = index->sizes[id] - offset;
+    if (bytes_to_read < *len) *len = bytes_to_read;
+
+    ssize_t r = tar_pread(index->tar_fd, dest, *len, index->offsets[id] + BLOCKSIZE + offset);
+    if (r < 0) return -1;
+    *len = r;
+    return bytes_to_read - *len;
+}
+
+/*
+ * Sidecar index
+ *
+ * tar_index_save() dumps the arrays of an index to a file, so that another process can map them back with
+ * tar_index_load() instead of reading every header of the archive. The file starts with an index_file_header_t,
+ * followed by the columns of the entries, laid out as in memory for exactly nb_entries rows, the string table and the
+ * hash table, each aligned on INDEX_FILE_ALIGN bytes. The loaded index uses them in place, once every row and every
+ * slot was checked to point inside the arrays. A sidecar is keyed by the size and modification time of the archive
+ * and a hash of its first and last headers, and it is rejected when any of them changed, or when it was written on a
+ * machine of another byte order.
+ */
+
+#define INDEX_FILE_MAGIC "TARIDX\0\2"
+#define INDEX_FILE_ALIGN 64
+#define INDEX_FILE_SECTIONS 3
+#define INDEX_FILE_BYTE_ORDER 0x01020304
+
+typedef struct index_file_header {
+    char magic[8];
+    uint32_t row_size;          // INDEX_ROW_SIZE of the writer
+    uint32_t byte_order;        // INDEX_FILE_BYTE_ORDER in the byte order of the writer, which is that of the columns
+    uint64_t archive_size;
+    int64_t archive_mtime;      // in nanoseconds
+    uint64_t headers_hash;      // hash of the first and last headers of the archive
+    int64_t last_header;        // offset of the last header of the archive
+    uint64_t nb_entries;
+    uint64_t nb_links;
+    uint64_t strings_len;
+    uint64_t nb_slots;
+} index_file_header_t;
+
+/* fills the fields of header that identify the archive, returns -1 if it could not be read */
+static int index_file_key(int tar_fd, off_t last_header, index_file_header_t *header) {
+
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0){
+        tar_log(TAR_LOG_ERROR, errno, "fstat error in tar_index_save");
+        return -1;
+    }
+    header->archive_size = st.st_size;
+    header->archive_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    header->last_header = last_header;
+
+    //the size and the time may not change when a member is rewritten in place, its header usually does
+    uint8_t blocks[2][BLOCKSIZE] = {{0}};
+    if (tar_pread(tar_fd, blocks[0], BLOCKSIZE, 0) < 0) return -1;
+    if (tar_pread(tar_fd, blocks[1], BLOCKSIZE, last_header) < 0) return -1;
+    header->headers_hash = hash_bytes(blocks, sizeof(blocks), 0xcbf29ce484222325ULL);
+    return 0;
+}
+
+/* sets the offsets of the sections of the file, and returns its total size */
+static size_t index_file_layout(const index_file_header_t *header, size_t offsets[INDEX_FILE_SECTIONS]) {
+    size_t sizes[INDEX_FILE_SECTIONS] = {
+        header->nb_entries * INDEX_ROW_SIZE,
+        header->strings_len,
+        header->nb_slots * sizeof(uint32_t),
+    };
+    size_t offset = sizeof(index_file_header_t);
+    for (int i = 0; i < INDEX_FILE_SECTIONS; i++){
+        offset = (offset + INDEX_FILE_ALIGN - 1) & ~(size_t) (INDEX_FILE_ALIGN - 1);
+        offsets[i] = offset;
+        offset += sizes[i];
+    }
+    return offset;
+}
+
+/**
+ * Saves an index to a sidecar file, that tar_index_load() maps back without reading the archive.
+ *
+ * The file is written under a temporary name then renamed, so that a process loading it concurrently
+ * sees either the previous sidecar or the new one.
+ *
+ * @param index The index of the archive.
+ * @param path The path of the sidecar file to write.
+ *
+ * @return zero if the sidecar was written,
+ *         -1 if the archive or the file could not be accessed.
+ */
+int tar_index_save(tar_index_t *index, const char *path) {
+
+    index_file_header_t header = {0};
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.row_size = INDEX_ROW_SIZE;
+    header.byte_order = INDEX_FILE_BYTE_ORDER;
+    header.nb_entries = index->nb_entries;
+    header.nb_links = index->nb_links;
+    header.strings_len = index->strings_len;
+    header.nb_slots = index->nb_slots;
+
+    off_t last_header = 0;
+    for (size_t id = 0; id < index->nb_entries; id++){
+        if (index->offsets[id] > last_header) last_header = index->offsets[id];
+    }
+    if (index_file_key(index->tar_fd, last_header, &header) < 0) return -1;
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) return -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        tar_log(TAR_LOG_ERROR, errno, "open error in tar_index_save");
+        return -1;
+    }
+
+    //the header, each column at its place in a block of nb_entries rows, the string table and the hash table
+    size_t offsets[INDEX_FILE_SECTIONS];
+    size_t file_size = index_file_layout(&header, offsets);
+    void *columns[INDEX_COLUMNS], *file_columns[INDEX_COLUMNS];
+    index_get_columns(index, columns);
+    index_layout((void *) offsets[0], header.nb_entries, file_columns);
+    struct iovec pieces[INDEX_COLUMNS + 3] = {{&header, sizeof(header)}};
+    off_t pieces_offsets[INDEX_COLUMNS + 3] = {0};
+    for (int i = 0; i < INDEX_COLUMNS; i++){
+        pieces[i + 1] = (struct iovec) {columns[i], header.nb_entries * index_column_sizes[i]};
+        pieces_offsets[i + 1] = (uintptr_t) file_columns[i];
+    }
+    pieces[INDEX_COLUMNS + 1] = (struct iovec) {index->strings, header.strings_len};
+    pieces_offsets[INDEX_COLUMNS + 1] = offsets[1];
+    pieces[INDEX_COLUMNS + 2] = (struct iovec) {index->slots, header.nb_slots * sizeof(uint32_t)};
+    pieces_offsets[INDEX_COLUMNS + 2] = offsets[2];
+
+    int ret = ftruncate(fd, file_size);//the gaps between the sections are left as holes
+    for (int i = 0; ret == 0 && i < INDEX_COLUMNS + 3; i++){
+        size_t written = 0;
+        while (ret == 0 && written < pieces[i].iov_len){
+            ssize_t w = pwrite(fd, (uint8_t *) pieces[i].iov_base + written, pieces[i].iov_len - written,
+                               pieces_offsets[i] + written);
+            if (w < 0) ret = -1;
+            else written += w;
+        }
+    }
+    if (ret < 0) tar_log(TAR_LOG_ERROR, errno, "write error in tar_index_save");
+    if (close(fd) < 0) ret = -1;
+
+    if (ret == 0 && rename(tmp_path, path) < 0){
+        tar_log(TAR_LOG_ERROR, errno, "rename error in tar_index_save");
+        ret = -1;
+    }
+    if (ret < 0) unlink(tmp_path);
+    return ret;
+}
+
+/*
+ * checks every row and slot of a mapped sidecar once, so that a corrupted one cannot make a lookup read out of its
+ * arrays or loop forever, returns -1 if it is malformed
+ */
+static int index_validate(const tar_index_t *index) {
+    size_t nb_links = 0;
+    for (size_t id = 0; id < index->nb_entries; id++){
+        //the parents come first and the children of a directory are consecutive, as numbered by index_build_tree()
+        uint32_t parent = index->parents[id];
+        if (parent > id || (id && parent < index->parents[id - 1])) return -1;
+        uint32_t name = index->names[id];
+        if (name >= index->strings_len) return -1;
+        size_t len = strnlen(index->strings + name, index->strings_len - name);
+        if (name + len + 1 >= index->strings_len) return -1;//the linkname follows the name
+        nb_links += is_link_type(index->typeflags[id]);
+    }
+    if (nb_links != index->nb_links) return -1;//the table of the resolved links would fill up
+
+    size_t nb_used = 0;
+    for (size_t i = 0; i < index->nb_slots; i++){
+        if (index->slots[i] > index->nb_entries) return -1;
+        nb_used += index->slots[i] != 0;
+    }
+    return nb_used <= index->nb_entries ? 0 : -1;//at least one empty slot ends every probe
+}
+
+/* tar_index_load() without the statistics */
+static tar_index_t *index_load(int tar_fd, const char *path) {
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;//no sidecar yet, the caller builds the index
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(index_file_header_t)){
+        close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        tar_log(TAR_LOG_ERROR, errno, "mmap error in tar_index_load");
+        return NULL;
+    }
+
+    //check that the sections fit in the file, then that the archive did not change since the sidecar was saved
+    const index_file_header_t *header = base;
+    index_file_header_t key;
+    size_t offsets[INDEX_FILE_SECTIONS];
+    const char *strings = NULL;
+    int valid = !memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic)) &&
+                header->row_size == INDEX_ROW_SIZE && header->byte_order == INDEX_FILE_BYTE_ORDER &&
+                header->nb_entries < UINT32_MAX - 1 && header->nb_links <= header->nb_entries &&
+                header->nb_slots > header->nb_entries && header->nb_slots <= 4 * (header->nb_entries + 1024) &&
+                !(header->nb_slots & (header->nb_slots - 1)) &&
+                header->strings_len > 0 && header->strings_len <= UINT32_MAX &&
+                index_file_layout(header, offsets) <= (size_t) st.st_size &&
+                (strings = (const char *) base + offsets[1])[header->strings_len - 1] == '\0' &&
+                index_file_key(tar_fd, header->last_header, &key) == 0 &&
+                key.archive_size == header->archive_size && key.archive_mtime == header->archive_mtime &&
+                key.headers_hash == header->headers_hash;
+
+    tar_index_t *index = valid ? calloc(1, sizeof(tar_index_t)) : NULL;
+    if (index == NULL){
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    index->tar_fd = tar_fd;
+    index->file = base;
+    index->file_size = st.st_size;
+    //the capacities are the sizes, the arrays are never grown once the index is built
+    index_set_columns(index, (uint8_t *) base + offsets[0], header->nb_entries);
+    index->nb_entries = header->nb_entries;
+    index->strings = (char *) strings;
+    index->strings_len = index->strings_capacity = header->strings_len;
+    index->slots = (uint32_t *) ((uint8_t *) base + offsets[2]);
+    index->nb_slots = header->nb_slots;
+    index->nb_links = header->nb_links;
+    index->end = -1;//not stored in the sidecar
+
+    if (index_validate(index) < 0 || index_alloc_resolved(index) < 0){
+        tar_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/**
+ * Loads an index saved by tar_index_save(), by mapping the sidecar file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the index was built from.
+ * @param path The path of the sidecar file.
+ *
+ * @return a pointer to the index, to be released with tar_index_free(),
+ *         NULL if the sidecar does not exist, is malformed, or was saved for another version of the archive.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *path) {
+    uint64_t start = stats_start();
+    tar_index_t *ret = index_load(tar_fd, path);
+    stats_stop(TAR_STATS_INDEX_LOAD, start);
+    return ret;
+}
+
+/*
+ * Shared handle
+ *
+ * A handle lets many threads serve the same archive. Its index is built by the first thread that needs it and
+ * published with a release store; every other thread finds it with an acquire load and reads it without any lock,
+ * since the index is never modified once published. The index functions keep their temporary strings on the stack
+ * and read into the caller's buffers, so concurrent calls share nothing but the immutable index.
+ */
+
+struct tar_handle {
+    int tar_fd;
+    atomic_int references;
+    _Atomic(tar_index_t *) index;
+    pthread_mutex_t build_lock;     // only taken while the index is not built yet
+};
+
+/* returns the index of the handle, building it on first use */
+static tar_index_t *handle_index(tar_handle_t *handle) {
+
+    tar_index_t *index = atomic_load_explicit(&handle->index, memory_order_acquire);
+    if (index != NULL) return index;
+
+    //slow path, a single thread builds the index while the others wait for it
+    pthread_mutex_lock(&handle->build_lock);
+    index = atomic_load_explicit(&handle->index, memory_order_acquire);
+    if (index == NULL){
+        index = tar_index_build(handle->tar_fd);
+        atomic_store_explicit(&handle->index, index, memory_order_release);
+    }
+    pthread_mutex_unlock(&handle->build_lock);
+    return index;
+}
+
+/**
+ * Opens a shared handle on an archive, with a reference count of one.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until the last reference to the handle is released, the handle does not close it.
+ *
+ * @return a pointer to the new handle,
+ *         NULL if memory could not be allocated.
+ */
+tar_handle_t *tar_handle_open(int tar_fd) {
+
+    tar_handle_t *handle = malloc(sizeof(tar_handle_t));
+    if (handle == NULL) return NULL;
+    handle->tar_fd = tar_fd;
+    atomic_init(&handle->references, 1);
+    atomic_init(&handle->index, NULL);
+    pthread_mutex_init(&handle->build_lock, NULL);
+    return handle;
+}
+
+/**
+ * Adds a reference to a handle, for instance before giving it to another thread.
+ *
+ * @param handle The handle.
+ *
+ * @return the handle.
+ */
+tar_handle_t *tar_handle_retain(tar_handle_t *handle) {
+    atomic_fetch_add_explicit(&handle->references, 1, memory_order_relaxed);
+    return handle;
+}
+
+/**
+ * Releases a reference to a handle, and frees it with its index when it was the last one.
+ *
+ * @param handle The handle, may be NULL.
+ */
+void tar_handle_release(tar_handle_t *handle) {
+    if (handle == NULL) return;
+    if (atomic_fetch_sub_explicit(&handle->references, 1, memory_order_acq_rel) != 1) return;
+    tar_index_free(atomic_load_explicit(&handle->index, memory_order_acquire));
+    pthread_mutex_destroy(&handle->build_lock);
+    free(handle);
+}
+
+/**
+ * Same as exists(), thread-safe.
+ */
+int tar_handle_exists(tar_handle_t *handle, char *path) {
+    tar_index_t *index = handle_index(handle);
+    return index != NULL && tar_index_exists(index, path);
+}
+
+/**
+ * Same as is_dir(), thread-safe.
+ */
+int tar_handle_is_dir(tar_handle_t *handle, char *path) {
+    tar_index_t *index = handle_index(handle);
+    return index != NULL && tar_index_is_dir(index, path);
+}
+
+/**
+ * Same as is_file(), thread-safe.
+ */
+int tar_handle_is_file(tar_handle_t *handle, char *path) {
+    tar_index_t *index = handle_index(handle);
+    return index != NULL && tar_index_is_file(index, path);
+}
+
+/**
+ * Same as is_symlink(), thread-safe.
+ */
+int tar_handle_is_symlink(tar_handle_t *handle, char *path) {
+    tar_index_t *index = handle_index(handle);
+    return index != NULL && tar_index_is_symlink(index, path);
+}
+
+/**
+ * Same as tar_index_list(), thread-safe.
+ */
+int tar_handle_list(tar_handle_t *handle, char *path, char **entries, size_t *no_entries) {
+    tar_index_t *index = handle_index(handle);
+    if (index == NULL){
+        *no_entries = 0;
+        return 0;
+    }
+    return tar_index_list(index, path, entries, no_entries);
+}
+
+/**
+ * Same as tar_index_read_file(), thread-safe.
+ */
+ssize_t tar_handle_read_file(tar_handle_t *handle, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    tar_index_t *index = handle_index(handle);
+    if (index == NULL) return -1;
+    return tar_index_read_file(index, path, offset, dest, len);
+}
+
+/*
+ * Batch reads
+ *
+ * The paths are resolved with an index, then the reads are sorted by offset in the archive and grouped in preadv()
+ * calls: the contents of two members separated by less than READ_MANY_MAX_GAP bytes are read by the same call,
+ * the bytes in between (headers, padding, unrequested members) being read into a discarded buffer. The batch does not
+ * go through the io_uring ring of the asynchronous reads: sorted and grouped, it already costs about one preadv() per
+ * group of neighbouring members, and the ring only saves system calls on reads submitted one by one.
+ */
+
+#define READ_MANY_MAX_GAP (64 * 1024)
+
+typedef struct read_request {
+    size_t path;        // position of the path in the arguments
+    off_t offset;       // offset in the archive of the first byte to read
+    size_t len;         // number of bytes to read
+} read_request_t;
+
+static int compare_requests(const void *a, const void *b) {
+    off_t x = ((const read_request_t *) a)->offset, y = ((const read_request_t *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+/* reads the requests one by one, when they could not be read by a single preadv() */
+static void read_requests(tar_index_t *index, const read_request_t *requests, size_t nb_requests,
+                          struct iovec *iovecs, ssize_t *results) {
+    for (size_t i = 0; i < nb_requests; i++){
+        const read_request_t *request = &requests[i];
+        ssize_t r = tar_pread(index->tar_fd, iovecs[request->path].iov_base, request->len, request->offset);
+        if (r < 0) r = 0;
+        iovecs[request->path].iov_len = r;
+        if (results != NULL) results[request->path] += request->len - r;//bytes that could not be read are left to read
+    }
+}
+
+/**
+ * Reads several files of an archive, located with an index, with as few system calls as possible.
+ *
+ * The reads are sorted by offset in the archive, and the contents of members that are close to each other
+ * are read by a single preadv() call.
+ *
+ * @param index The index of the archive.
+ * @param paths The paths of the files to read. Links are resolved.
+ * @param n The number of paths.
+ * @param iovecs An array of n in-out arguments.
+ *               The caller set iov_base to a destination buffer and iov_len to its size.
+ *               The callee set iov_len to the number of bytes written to the buffer, from the start of the file.
+ * @param results An array of n values set to what read_file() would return for each path with a zero offset,
+ *                may be NULL.
+ *
+ * @return the number of paths that are files of the archive.
+ */
+size_t tar_index_read_many(tar_index_t *index, char **paths, size_t n, struct iovec *iovecs, ssize_t *results) {
+
+    read_request_t *requests = malloc((n ? n : 1) * sizeof(read_request_t));
+    uint8_t *discard = malloc(READ_MANY_MAX_GAP);
+    if (requests == NULL || discard == NULL){
+        free(requests);
+        free(discard);
+        for (size_t i = 0; i < n; i++){
+            iovecs[i].iov_len = 0;
+            if (results != NULL) results[i] = -1;
+        }
+        return 0;
+    }
+
+    //resolve every path from the index
+    size_t nb_requests = 0;
+    for (size_t i = 0; i < n; i++){
+        uint32_t id = index_resolve(index, paths[i]);
+        if (id == INDEX_NONE || !is_file_type(index->typeflags[id])){
+            iovecs[i].iov_len = 0;
+            if (results != NULL) results[i] = -1;
+            continue;
+        }
+        size_t len = index->sizes[id] < iovecs[i].iov_len ? index->sizes[id] : iovecs[i].iov_len;
+        if (results != NULL) results[i] = index->sizes[id] - len;
+        iovecs[i].iov_len = len;
+        requests[nb_requests++] = (read_request_t) {i, index->offsets[id] + BLOCKSIZE, len};
+    }
+    qsort(requests, nb_requests, sizeof(read_request_t), compare_requests);
+
+    //in mmap mode the reads are copies from the mapping, in gzip mode decompressions, and a cache serves them by block
+    if (get_mapping(index->tar_fd) != NULL || get_gzip(index->tar_fd) != NULL || get_cache(index->tar_fd) != NULL){
+        read_requests(index, requests, nb_requests, iovecs, results);
+        free(requests);
+        free(discard);
+        return nb_requests;
+    }
+
+    size_t first = 0;
+    while (first < nb_requests){
+
+        //group the following requests while they are close enough and do not overlap
+        struct iovec vectors[IOV_MAX];
+        int nb_vectors = 0;
+        off_t start = requests[first].offset;
+        off_t end = start;
+        size_t last = first;
+        while (last < nb_requests && nb_vectors + 2 <= IOV_MAX){
+            const read_request_t *request = &requests[last];
+            if (last > first && (request->offset < end || request->offset - end > READ_MANY_MAX_GAP)) break;
+            if (request->offset > end) vectors[nb_vectors++] = (struct iovec) {discard, request->offset - end};
+            if (request->len) vectors[nb_vectors++] = (struct iovec) {iovecs[request->path].iov_base, request->len};
+            end = request->offset + request->len;
+            last++;
+        }
+
+        ssize_t r = nb_vectors ? preadv(index->tar_fd, vectors, nb_vectors, start) : 0;
+        if (r < 0) tar_log(TAR_LOG_ERROR, errno, "preadv error in tar_index_read_many");
+        STATS_ADD(preads, 1);
+        STATS_ADD(bytes_read, r > 0 ? r : 0);
+        if (r != end - start) read_requests(index, requests + first, last - first, iovecs, results);//truncated archive
+        first = last;
+    }
+
+    free(requests);
+    free(discard);
+    return nb_requests;
+}
+
+/**
+ * Same as tar_index_read_many(), but the paths are resolved by a single scan of the archive.
+ */
+size_t tar_read_many(int tar_fd, char **paths, size_t n, struct iovec *iovecs, ssize_t *results) {
+
+    tar_index_t *index = tar_index_build(tar_fd);
+    if (index == NULL){
+        for (size_t i = 0; i < n; i++){
+            iovecs[i].iov_len = 0;
+            if (results != NULL) results[i] = -1;
+        }
+        return 0;
+    }
+
+    size_t ret = tar_index_read_many(index, paths, n, iovecs, results);
+    tar_index_free(index);
+    return ret;
+}
+
+/*
+ * File cursors
+ *
+ * A cursor keeps the location of the content of a member, so that reading it in chunks costs one pread() per chunk
+ * instead of a scan of the archive per chunk. With TAR_FILE_READAHEAD, the cursor asks the kernel to prefetch the
+ * next TAR_FILE_READAHEAD_LEN bytes every time the reads consume half of the previous prefetch.
+ */
+
+#define TAR_FILE_READAHEAD_LEN (4 << 20)
+
+struct tar_file {
+    int tar_fd;
+    int flags;
+    off_t data_offset;      // offset of the content in the archive
+    size_t size;
+    size_t position;        // position of tar_file_read() in the file
+    size_t readahead_end;   // end of the last prefetched range, relative to the start of the file
+};
+
+static tar_file_t *file_open(int tar_fd, off_t data_offset, size_t size, int flags) {
+
+    tar_file_t *file = malloc(sizeof(tar_file_t));
+    if (file == NULL) return NULL;
+    file->tar_fd = tar_fd;
+    file->flags = flags;
+    file->data_offset = data_offset;
+    file->size = size;
+    file->position = 0;
+    file->readahead_end = 0;
+
+    if (flags & TAR_FILE_SEQUENTIAL) posix_fadvise(tar_fd, data_offset, size, POSIX_FADV_SEQUENTIAL);
+    return file;
+}
+
+/* prefetches the content that follows position, when the reads get close to the end of the previous prefetch */
+static void file_readahead(tar_file_t *file, size_t position) {
+    if (!(file->flags & TAR_FILE_READAHEAD)) return;
+    if (get_mapping(file->tar_fd) != NULL || get_gzip(file->tar_fd) != NULL) return;//nothing to prefetch from the file
+    if (position + TAR_FILE_READAHEAD_LEN / 2 < file->readahead_end || file->readahead_end >= file->size) return;
+
+    size_t start = position > file->readahead_end ? position : file->readahead_end;
+    size_t len = TAR_FILE_READAHEAD_LEN;
+    if (len > file->size - start) len = file->size - start;
+    readahead(file->tar_fd, file->data_offset + start, len);
+    file->readahead_end = start + len;
+}
+
+/**
+ * Opens a file of an archive for reading, locating it with a single scan.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to a file in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param flags Zero, or a combination of TAR_FILE_SEQUENTIAL and TAR_FILE_READAHEAD.
+ *
+ * @return a pointer to the new cursor, at the start of the file, to be released with tar_file_close(),
+ *         NULL if no entry at the given path exists in the archive, the entry is not a file,
+ *         or memory could not be allocated.
+ */
+tar_file_t *tar_file_open(int tar_fd, char *path, int flags) {
+
+    off_t data_offset;
+    size_t size;
+    if (locate_file(tar_fd, path, &data_offset, &size) < 0) return NULL;
+    return file_open(tar_fd, data_offset, size, flags);
+}
+
+/**
+ * Same as tar_file_open(), but the file is located with an index.
+ */
+tar_file_t *tar_index_file_open(tar_index_t *index, char *path, int flags) {
+
+    off_t data_offset;
+    size_t size;
+    if (index_locate_file(index, path, &data_offset, &size) < 0) return NULL;
+    return file_open(index->tar_fd, data_offset, size, flags);
+}
+
+/**
+ * Returns the size of a file opened with tar_file_open().
+ */
+size_t tar_file_size(tar_file_t *file) {
+    return file->size;
+}
+
+/**
+ * Reads from a given offset of a file, without moving the cursor.
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ * @param offset An offset in the file.
+ *
+ * @return the number of bytes written to dest, zero at the end of the file,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_file_pread(tar_file_t *file, uint8_t *dest, size_t len, size_t offset) {
+
+    if (offset >= file->size) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+
+    file_readahead(file, offset);
+    return tar_pread(file->tar_fd, dest, len, file->data_offset + offset);
+}
+
+/**
+ * Reads from the position of the cursor, and moves it past the bytes read.
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes written to dest, zero at the end of the file,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_file_read(tar_file_t *file, uint8_t *dest, size_t len) {
+    ssize_t r = tar_file_pread(file, dest, len, file->position);
+    if (r > 0) file->position += r;
+    return r;
+}
+
+/**
+ * Moves the cursor, like lseek().
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param offset The new position, relative to whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @return the new position from the start of the file,
+ *         -1 if whence is invalid or the new position would be negative.
+ */
+off_t tar_file_seek(tar_file_t *file, off_t offset, int whence) {
+
+    off_t base;
+    switch (whence){
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = file->position; break;
+        case SEEK_END: base = file->size; break;
+        default: return -1;
+    }
+    if (base + offset < 0) return -1;
+
+    file->position = base + offset;
+    return file->position;
+}
+
+/**
+ * Releases a cursor returned by tar_file_open().
+ *
+ * @param file The cursor, may be NULL.
+ */
+void tar_file_close(tar_file_t *file) {
+    free(file);
+}
+
+/*
+ * Writer
+ *
+ * A writer appends members to an archive through an aligned buffer of TAR_WRITER_BUFSIZE bytes, so that small members
+ * cost one pwrite() per megabyte of archive. The content of a large member bypasses the buffer: a buffer given by the
+ * caller is written directly, and a file given by descriptor is copied by the kernel with copy_file_range(), without
+ * going through user space. A name or link target that does not fit in a ustar header is stored in a PAX extended
+ * header preceding the member.
+ */
+
+#define TAR_WRITER_BUFSIZE (1 << 20)
+#define TAR_WRITER_ALIGN 4096
+#define TAR_WRITER_COPY_MIN (64 * 1024)   // smaller files are read into the buffer, a copy would cost a flush
+
+struct tar_writer {
+    int tar_fd;
+    uint8_t *buffer;
+    size_t buffer_len;      // number of bytes waiting in the buffer
+    off_t offset;           // offset in the archive of the first byte of the buffer
+    int64_t mtime;          // modification time of the members added without tar_member_info_t
+    int error;              // 1 once a write failed, the archive is then left as it is
+};
+
+/* writes the buffer to the archive */
+static int writer_flush(tar_writer_t *writer) {
+    size_t written = 0;
+    while (!writer->error && written < writer->buffer_len){
+        ssize_t w = pwrite(writer->tar_fd, writer->buffer + written, writer->buffer_len - written,
+                           writer->offset + written);
+        if (w < 0){
+            tar_log(TAR_LOG_ERROR, errno, "pwrite error in tar_writer");
+            writer->error = 1;
+        } else {
+            written += w;
+        }
+    }
+    writer->offset += written;
+    writer->buffer_len = 0;
+    return writer->error ? -1 : 0;
+}
+
+/* appends len bytes to the archive, writing them directly when they would fill the buffer more than once */
+static int writer_write(tar_writer_t *writer, const void *data, size_t len) {
+
+    if (data != NULL && len >= TAR_WRITER_BUFSIZE && writer_flush(writer) == 0){
+        writer->buffer_len = len;//the caller's data takes the place of the buffer for a single flush
+        uint8_t *buffer = writer->buffer;
+        writer->buffer = (uint8_t *) data;
+        writer_flush(writer);
+        writer->buffer = buffer;
+        return writer->error ? -1 : 0;
+    }
+
+    while (!writer->error && len){
+        size_t n = TAR_WRITER_BUFSIZE - writer->buffer_len;
+        if (n > len) n = len;
+        if (data != NULL) memcpy(writer->buffer + writer->buffer_len, data, n);
+        else memset(writer->buffer + writer->buffer_len, 0, n);//NULL data writes zeros
+        writer->buffer_len += n;
+        if (data != NULL) data = (const uint8_t *) data + n;
+        len -= n;
+        if (writer->buffer_len == TAR_WRITER_BUFSIZE) writer_flush(writer);
+    }
+    return writer->error ? -1 : 0;
+}
+
+/* pads the content of a member of size bytes to a whole number of blocks */
+static int writer_pad(tar_writer_t *writer, size_t size) {
+    return writer_write(writer, NULL, (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE);
+}
+
+/* writes value in a numeric field of len bytes, in octal, or in base-256 when it does not fit in len - 1 digits */
+static void write_number(char *field, size_t len, int64_t value) {
+    if (value >= 0 && (len - 1) * 3 >= 64 - __builtin_clzll(value | 1)){
+        field[len - 1] = '\0';
+        for (size_t i = len - 1; i > 0; i--, value >>= 3) field[i - 1] = '0' + (value & 7);
+        return;
+    }
+    //base-256: the first byte has its high bit set, the value is stored big-endian in two's complement
+    uint64_t bits = value;
+    for (size_t i = len; i > 0; i--){
+        field[i - 1] = bits & 0xff;
+        bits = (uint64_t) ((int64_t) bits >> 8);
+    }
+    field[0] = (char) (value < 0 ? 0xff : 0x80);
+}
+
+/* fills a header, returns -1 if the name cannot be stored in the name and prefix fields or the link name is too long */
+static int writer_header(const tar_writer_t *writer, tar_header_t *header, const char *name, char typeflag,
+                         size_t size, const char *linkname, const tar_member_info_t *info) {
+
+    memset(header, 0, sizeof(tar_header_t));
+
+    //a name longer than the name field is split at a "/", the directories going to the prefix field
+    size_t len = strlen(name);
+    if (len > sizeof(header->name)){
+        size_t split = len - 1;
+        while (split > 0 && (name[split] != '/' || len - split - 1 > sizeof(header->name))) split--;
+        if (name[split] != '/' || split > sizeof(header->prefix) || split == len - 1) return -1;
+        memcpy(header->prefix, name, split);
+        name += split + 1;
+        len -= split + 1;
+    }
+    memcpy(header->name, name, len);
+    if (linkname != NULL){
+        if (strlen(linkname) > sizeof(header->linkname)) return -1;
+        memcpy(header->linkname, linkname, strlen(linkname));
+    }
+
+    uint32_t mode = typeflag == DIRTYPE ? 0755 : typeflag == SYMTYPE ? 0777 : 0644;
+    write_number(header->mode, sizeof(header->mode), info != NULL ? info->mode & 07777 : mode);
+    write_number(header->uid, sizeof(header->uid), info != NULL ? info->uid : 0);
+    write_number(header->gid, sizeof(header->gid), info != NULL ? info->gid : 0);
+    write_number(header->size, sizeof(header->size), size);
+    write_number(header->mtime, sizeof(header->mtime), info != NULL ? info->mtime : writer->mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+    if (info != NULL && info->uname != NULL){
+        memcpy(header->uname, info->uname, strnlen(info->uname, sizeof(header->uname) - 1));
+    }
+    if (info != NULL && info->gname != NULL){
+        memcpy(header->gname, info->gname, strnlen(info->gname, sizeof(header->gname) - 1));
+    }
+
+    //the checksum is computed with the field filled with spaces, and stored as 6 digits, a null byte and a space
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    write_number(header->chksum, sizeof(header->chksum) - 1, header_checksum((const uint8_t *) header));
+    return 0;
+}
+
+/* writes a PAX record "<length> <key>=<value>\n" to dest, the length counting its own digits, returns its length */
+static size_t pax_record(char *dest, const char *key, const char *value) {
+    size_t len = strlen(key) + strlen(value) + 3;//the space, the equal sign and the newline
+    size_t total = len + 1;
+    for (size_t limit = 10; total >= limit; limit *= 10) total++;
+    return sprintf(dest, "%zu %s=%s\n", total, key, value);
+}
+
+/* writes the header of a member, preceded by a PAX extended header when its name or link target does not fit */
+static int writer_add_header(tar_writer_t *writer, const char *name, char typeflag, size_t size, const char *linkname,
+                             const tar_member_info_t *info) {
+    if (writer->error) return -1;
+    tar_header_t header;
+    if (writer_header(writer, &header, name, typeflag, size, linkname, info) == 0){
+        return writer_write(writer, &header, sizeof(tar_header_t));
+    }
+
+    char *records = malloc(strlen(name) + (linkname != NULL ? strlen(linkname) : 0) + 64);
+    if (records == NULL) return -1;
+    size_t len = pax_record(records, "path", name);
+    if (linkname != NULL) len += pax_record(records + len, "linkpath", linkname);
+    writer_header(writer, &header, "././@PaxHeader", XHDTYPE, len, NULL, info);
+    int ret = writer_write(writer, &header, sizeof(tar_header_t));
+    if (ret == 0) ret = writer_write(writer, records, len);
+    if (ret == 0) ret = writer_pad(writer, len);
+    free(records);
+
+    //the ustar header keeps the beginning of the name and link target, for readers that ignore the PAX records
+    char short_name[sizeof(header.name) + 1];
+    char short_link[sizeof(header.linkname) + 1];
+    copy_field(short_name, name, strnlen(name, sizeof(header.name)));
+    if (linkname != NULL) copy_field(short_link, linkname, strnlen(linkname, sizeof(header.linkname)));
+    writer_header(writer, &header, short_name, typeflag, size, linkname != NULL ? short_link : NULL, info);
+    return ret == 0 ? writer_write(writer, &header, sizeof(tar_header_t)) : -1;
+}
+
+/**
+ * Opens a writer on an archive.
+ *
+ * @param tar_fd A file descriptor open for writing, and for reading in append mode. It is not in mmap or gzip mode,
+ *               has no block cache, and the writer does not close it.
+ * @param flags Zero to write a new archive from the start of the file,
+ *              or TAR_WRITER_APPEND to add members after the last member of the valid archive in the file.
+ *
+ * @return a pointer to the new writer, to be released with tar_writer_close(),
+ *         NULL if memory could not be allocated or, in append mode, the archive could not be read.
+ */
+tar_writer_t *tar_writer_open(int tar_fd, int flags) {
+
+    if (get_mapping(tar_fd) != NULL || get_gzip(tar_fd) != NULL || get_cache(tar_fd) != NULL) return NULL;
+
+    tar_writer_t *writer = calloc(1, sizeof(tar_writer_t));
+    if (writer == NULL) return NULL;
+    if (posix_memalign((void **) &writer->buffer, TAR_WRITER_ALIGN, TAR_WRITER_BUFSIZE) != 0){
+        free(writer);
+        return NULL;
+    }
+    writer->tar_fd = tar_fd;
+    writer->mtime = time(NULL);
+
+    if (flags & TAR_WRITER_APPEND){//the new members overwrite the end-of-archive marker
+        tar_iter_t *iter = tar_iter_open(tar_fd);
+        int ret = iter != NULL ? 1 : -1;
+        tar_entry_t entry;
+        while (ret > 0 && (ret = tar_iter_next(iter, &entry)) > 0){
+            writer->offset = entry.data_offset + (entry.size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+        }
+        tar_iter_close(iter);
+        if (ret < 0){
+            free(writer->buffer);
+            free(writer);
+            return NULL;
+        }
+    }
+    return writer;
+}
+
+/**
+ * Adds a file to the archive, with its content taken from a buffer.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive.
+ * @param data The content of the file.
+ * @param size The size of the file.
+ * @param info The metadata of the file, or NULL for a file of mode 0644 owned by root,
+ *             modified when the writer was opened.
+ *
+ * @return zero if the file was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const void *data, size_t size,
+                        const tar_member_info_t *info) {
+    if (writer_add_header(writer, name, REGTYPE, size, NULL, info) < 0) return -1;
+    if (writer_write(writer, data, size) < 0) return -1;
+    return writer_pad(writer, size);
+}
+
+/**
+ * Adds a file to the archive, with its content copied from a file descriptor, by the kernel for large files.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive.
+ * @param fd A file descriptor open for reading on a regular file, whose whole content is added.
+ * @param info The metadata of the file, or NULL to take them from fd.
+ *
+ * @return zero if the file was added,
+ *         -1 if fd could not be read or the archive could not be written.
+ */
+int tar_writer_add_file_fd(tar_writer_t *writer, const char *name, int fd, const tar_member_info_t *info) {
+
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        tar_log(TAR_LOG_ERROR, errno, "fstat error in tar_writer_add_file_fd");
+        return -1;
+    }
+    tar_member_info_t stat_info = {st.st_mode, st.st_uid, st.st_gid, st.st_mtime, NULL, NULL};
+    size_t size = st.st_size;
+    if (writer_add_header(writer, name, REGTYPE, size, NULL, info != NULL ? info : &stat_info) < 0) return -1;
+
+    //copy_file_range() writes at the end of the archive, after what the buffer holds
+    size_t copied = 0;
+    if (size >= TAR_WRITER_COPY_MIN && writer_flush(writer) == 0){
+        off_t in = 0;
+        while (copied < size){
+            ssize_t r = copy_file_range(fd, &in, writer->tar_fd, &writer->offset, size - copied, 0);
+            if (r <= 0) break;//not supported between these files, the rest goes through the buffer
+            copied += r;
+        }
+    }
+
+    while (!writer->error && copied < size){
+        size_t n = TAR_WRITER_BUFSIZE - writer->buffer_len;
+        if (n > size - copied) n = size - copied;
+        ssize_t r = pread(fd, writer->buffer + writer->buffer_len, n, copied);
+        if (r <= 0){//the file shrank or cannot be read, the archive would be inconsistent
+            if (r < 0) tar_log(TAR_LOG_ERROR, errno, "pread error in tar_writer_add_file_fd");
+            writer->error = 1;
+            break;
+        }
+        writer->buffer_len += r;
+        copied += r;
+        if (writer->buffer_len == TAR_WRITER_BUFSIZE) writer_flush(writer);
+    }
+    if (writer->error) return -1;
+    return writer_pad(writer, size);
+}
+
+/**
+ * Adds a directory to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, a "/" is added if it does not end with one.
+ * @param info The metadata of the directory, or NULL for a directory of mode 0755 owned by root.
+ *
+ * @return zero if the directory was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, const tar_member_info_t *info) {
+    size_t len = strlen(name);
+    char dir[len + 2];
+    memcpy(dir, name, len + 1);
+    if (!len || dir[len - 1] != '/') strcpy(dir + len, "/");//the name of a directory ends with a "/"
+    return writer_add_header(writer, dir, DIRTYPE, 0, NULL, info);
+}
+
+/**
+ * Adds a symlink to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the symlink in the archive.
+ * @param target The path the symlink points to, relative to the directory of the symlink.
+ * @param info The metadata of the symlink, or NULL for a symlink owned by root.
+ *
+ * @return zero if the symlink was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target, const tar_member_info_t *info) {
+    return writer_add_header(writer, name, SYMTYPE, 0, target, info);
+}
+
+/**
+ * Writes the end-of-archive marker and releases a writer.
+ *
+ * @param writer A writer returned by tar_writer_open(), may be NULL.
+ *
+ * @return zero if the whole archive was written,
+ *         -1 if a write failed since the writer was opened.
+ */
+int tar_writer_close(tar_writer_t *writer) {
+    if (writer == NULL) return 0;
+    writer_write(writer, NULL, 2 * BLOCKSIZE);//two null blocks mark the end of the archive
+    writer_flush(writer);
+    int ret = writer->error ? -1 : 0;
+    free(writer->buffer);
+    free(writer);
+    return ret;
+}
+
+/*
+ * Extraction
+ *
+ * tar_extract() builds the index of the archive with a single header pass, and takes its entries in id order, which
+ * puts the parents first, to create every directory and to collect the other members. The files are then written by
+ * a pool of threads that take them in archive order from a shared counter, so that the archive is read almost
+ * sequentially; their content is copied with copy_file_range(), which does not bring it to user space. Hard links,
+ * symlinks, and the permissions and times of the directories are applied last, so that no file is ever written
+ * through a symlink of the archive and creating the files does not change the times of their directories.
+ */
+
+#define TAR_EXTRACT_BUFSIZE (1 << 20)
+
+typedef struct extract_ctx {
+    int tar_fd;
+    int dir_fd;                 // the destination directory, every path is opened relative to it
+    int flags;
+    int copy;                   // 1 when copy_file_range() can be used, the archive being neither mapped nor compressed
+    const tar_index_t *index;
+    uint32_t *dirs;             // directories, parents first
+    size_t nb_dirs;
+    uint32_t *files;            // regular files, sorted by offset
+    size_t nb_files;
+    uint32_t *links;            // hard links and symlinks
+    size_t nb_links;
+    _Atomic size_t next_file;   // next file to write, shared by the threads
+    atomic_int failures;        // number of members that could not be extracted
+} extract_ctx_t;
+
+/* returns the path of an entry relative to the destination, NULL if it is absolute or leaves it with a ".." */
+static const char *extract_path(const char *name) {
+    if (name[0] == '/') return NULL;
+    for (const char *component = name; *component; ){
+        const char *end = strchrnul(component, '/');
+        if (end - component == 2 && component[0] == '.' && component[1] == '.') return NULL;
+        component = *end ? end + 1 : end;
+    }
+    while (!strncmp(name, "./", 2)) name += 2;
+    return name;
+}
+
+/* creates the missing parent directories of path */
+static void extract_parents(int dir_fd, const char *path) {
+    char parent[strlen(path) + 1];
+    strcpy(parent, path);
+    for (char *slash = strchr(parent, '/'); slash != NULL && slash[1]; slash = strchr(slash + 1, '/')){
+        *slash = '\0';
+        mkdirat(dir_fd, parent, 0755);//EEXIST is expected, another thread may be creating it too
+        *slash = '/';
+    }
+}
+
+/* adds the entries to the work lists, which hold at most index->nb_entries ids each */
+static void extract_collect(extract_ctx_t *ctx) {
+    for (uint32_t id = 0; id < ctx->index->nb_entries; id++){
+        char typeflag = ctx->index->typeflags[id];
+        if (typeflag == DIRTYPE) ctx->dirs[ctx->nb_dirs++] = id;
+        else if (is_file_type(typeflag)) ctx->files[ctx->nb_files++] = id;
+        else if (is_link_type(typeflag)) ctx->links[ctx->nb_links++] = id;
+        //devices and fifos are not extracted
+    }
+}
+
+static int compare_offsets(const void *a, const void *b, void *arg) {
+    const tar_index_t *index = arg;
+    off_t x = index->offsets[*(const uint32_t *) a], y = index->offsets[*(const uint32_t *) b];
+    return (x > y) - (x < y);
+}
+
+/* sets the permissions and the modification time of a member, fd being an open descriptor on it or -1 */
+static int extract_metadata(const extract_ctx_t *ctx, int fd, const char *path, uint32_t id) {
+    const tar_index_t *index = ctx->index;
+    int ret = 0;
+    if (!(ctx->flags & TAR_EXTRACT_NO_MODE) && index->typeflags[id] != SYMTYPE){
+        ret |= fd >= 0 ? fchmod(fd, index->modes[id] & 0777) : fchmodat(ctx->dir_fd, path, index->modes[id] & 0777, 0);
+    }
+    if (!(ctx->flags & TAR_EXTRACT_NO_MTIME) && !INDEX_IMPLICIT(index, id)){
+        struct timespec times[2] = {{0, UTIME_OMIT}, {index->mtimes[id], 0}};
+        ret |= fd >= 0 ? futimens(fd, times) : utimensat(ctx->dir_fd, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+    return ret;
+}
+
+/* writes the content of a file, with copy_file_range() when possible and through buffer otherwise */
+static int extract_content(const extract_ctx_t *ctx, int fd, uint32_t id, uint8_t **buffer) {
+    off_t in = ctx->index->offsets[id] + BLOCKSIZE;
+    size_t left = ctx->index->sizes[id];
+    while (ctx->copy && left){
+        ssize_t r = copy_file_range(ctx->tar_fd, &in, fd, NULL, left, 0);
+        if (r <= 0) break;//not supported between these files, the rest goes through the buffer
+        left -= r;
+    }
+    if (left && *buffer == NULL && (*buffer = malloc(TAR_EXTRACT_BUFSIZE)) == NULL) return -1;
+    while (left){
+        ssize_t r = tar_pread(ctx->tar_fd, *buffer, left < TAR_EXTRACT_BUFSIZE ? left : TAR_EXTRACT_BUFSIZE, in);
+        if (r <= 0) return -1;//truncated archive
+        for (ssize_t written = 0; written < r; ){
+            ssize_t w = write(fd, *buffer + written, r - written);
+            if (w < 0) return -1;
+            written += w;
+        }
+        in += r;
+        left -= r;
+    }
+    return 0;
+}
+
+static void *extract_worker_run(void *arg) {
+
+    extract_ctx_t *ctx = arg;
+    uint8_t *buffer = NULL;//only allocated when the content cannot be copied by the kernel
+
+    size_t i;
+    while ((i = atomic_fetch_add(&ctx->next_file, 1)) < ctx->nb_files){
+        char name[PATH_MAX];
+        index_name(ctx->index, ctx->files[i], name);
+        const char *path = extract_path(name);
+        int fd = path != NULL ? openat(ctx->dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600) : -1;
+        if (fd < 0 && path != NULL && errno == ENOENT){//the archive has no header for one of its directories
+            extract_parents(ctx->dir_fd, path);
+            fd = openat(ctx->dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+        }
+        int ret = fd < 0 ? -1 : extract_content(ctx, fd, ctx->files[i], &buffer);
+        if (ret == 0) ret = extract_metadata(ctx, fd, path, ctx->files[i]);
+        if (fd >= 0 && close(fd) < 0) ret = -1;
+        if (ret < 0) atomic_fetch_add(&ctx->failures, 1);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/* creates a hard link or a symlink, replacing whatever is at its path */
+static int extract_link(const extract_ctx_t *ctx, uint32_t id) {
+    char name[PATH_MAX];
+    index_name(ctx->index, id, name);
+    const char *path = extract_path(name);
+    const char *target = INDEX_LINKNAME(ctx->index, id);
+    char typeflag = ctx->index->typeflags[id];
+    if (path == NULL) return -1;
+    if (typeflag == LNKTYPE && (target = extract_path(target)) == NULL) return -1;
+
+    for (int attempt = 0; attempt < 2; attempt++){
+        int ret = typeflag == SYMTYPE ? symlinkat(target, ctx->dir_fd, path)
+                                      : linkat(ctx->dir_fd, target, ctx->dir_fd, path, 0);
+        if (ret == 0) return typeflag == SYMTYPE ? extract_metadata(ctx, -1, path, id) : 0;
+        if (errno == EEXIST) unlinkat(ctx->dir_fd, path, 0);
+        else if (errno == ENOENT) extract_parents(ctx->dir_fd, path);
+        else break;
+    }
+    return -1;
+}
+
+/* tar_extract() without the statistics */
+static int extract(int tar_fd, const char *dest_dir, const tar_extract_options_t *options) {
+
+    int nb_threads = options != NULL ? options->nb_threads : 0;
+    if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads <= 0) nb_threads = 1;
+
+    mkdir(dest_dir, 0755);
+    int dir_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0){
+        tar_log(TAR_LOG_ERROR, errno, "open error in tar_extract");
+        return -1;
+    }
+    tar_index_t *index = tar_index_build(tar_fd);//also keeps only the last occurrence of each path
+    uint32_t *lists = index != NULL ? malloc(3 * (index->nb_entries + 1) * sizeof(uint32_t)) : NULL;
+    if (lists == NULL){
+        tar_index_free(index);
+        close(dir_fd);
+        return -1;
+    }
+
+    extract_ctx_t ctx = {
+        .tar_fd = tar_fd,
+        .dir_fd = dir_fd,
+        .flags = options != NULL ? options->flags : 0,
+        .copy = get_mapping(tar_fd) == NULL && get_gzip(tar_fd) == NULL,
+        .index = index,
+        .dirs = lists,
+        .files = lists + index->nb_entries + 1,
+        .links = lists + 2 * (index->nb_entries + 1),
+    };
+    atomic_init(&ctx.next_file, 0);
+    atomic_init(&ctx.failures, 0);
+    extract_collect(&ctx);
+    qsort_r(ctx.files, ctx.nb_files, sizeof(uint32_t), compare_offsets, index);
+
+    //directories first, parents before their children, writable until their permissions are applied
+    char name[PATH_MAX];
+    for (size_t i = 0; i < ctx.nb_dirs; i++){
+        index_name(index, ctx.dirs[i], name);
+        const char *path = extract_path(name);
+        if (path != NULL && (!path[0] || mkdirat(dir_fd, path, 0700) == 0 || errno == EEXIST)) continue;
+        //the members below an implicit directory are counted instead
+        if (!INDEX_IMPLICIT(index, ctx.dirs[i])) atomic_fetch_add(&ctx.failures, 1);
+        ctx.dirs[i] = UINT32_MAX;
+    }
+
+    //then the files, by a pool of threads
+    pthread_t *threads = calloc(nb_threads, sizeof(pthread_t));//nb_threads is not bounded by the stack
+    int nb_started = 1;
+    while (threads != NULL && nb_started < nb_threads
+           && !pthread_create(&threads[nb_started], NULL, extract_worker_run, &ctx)) nb_started++;
+    extract_worker_run(&ctx);//this thread is the first one, and writes every file if no other could be started
+    for (int t = 1; t < nb_started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+
+    //then the hard links once their targets exist, the symlinks, and the directories, children before their parents
+    for (int pass = 0; pass < 2; pass++){
+        for (size_t i = 0; i < ctx.nb_links; i++){
+            if ((index->typeflags[ctx.links[i]] == SYMTYPE) != pass) continue;
+            if (extract_link(&ctx, ctx.links[i]) < 0) atomic_fetch_add(&ctx.failures, 1);
+        }
+    }
+    for (size_t i = ctx.nb_dirs; i > 0; i--){
+        if (ctx.dirs[i - 1] == UINT32_MAX) continue;
+        index_name(index, ctx.dirs[i - 1], name);
+        const char *path = extract_path(name);
+        if (path[0] && extract_metadata(&ctx, -1, path, ctx.dirs[i - 1]) < 0) atomic_fetch_add(&ctx.failures, 1);
+    }
+
+    free(lists);
+    tar_index_free(index);
+    close(dir_fd);
+    return atomic_load(&ctx.failures);
+}
+
+/**
+ * Extracts an archive to a directory.
+ *
+ * Only regular files, directories, hard links and symlinks are extracted. A member whose path is absolute or contains
+ * a ".." is not extracted, and a hard link pointing to such a path neither. When a path appears several times in the
+ * archive, its last occurrence is extracted.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dest_dir The directory to extract to, created if it does not exist.
+ * @param options The number of threads writing the files, zero or less to use one per online processor, and
+ *                TAR_EXTRACT_NO_MODE or TAR_EXTRACT_NO_MTIME to leave the permissions or the times as created,
+ *                may be NULL.
+ *
+ * @return zero if every member was extracted,
+ *         -1 if the archive could not be read or the destination could not be opened,
+ *         otherwise the number of members that could not be extracted.
+ */
+int tar_extract(int tar_fd, const char *dest_dir, const tar_extract_options_t *options) {
+    uint64_t start = stats_start();
+    int ret = extract(tar_fd, dest_dir, options);
+    stats_stop(TAR_STATS_EXTRACT, start);
+    return ret;
+}
+
+/*
+ * Queries
+ *
+ * tar_find() matches the pattern against the name of every member with fnmatch(), after a comparison with the literal
+ * prefix of the pattern, the part before its first wildcard, which rejects most names without running the matcher.
+ * tar_index_find() walks the directory tree of the index instead, and only descends into the directories whose name
+ * is compatible with that prefix, so a query under a directory never looks at the rest of the archive.
+ */
+
+/* returns the length of the part of pattern before its first wildcard */
+static size_t literal_prefix_len(const char *pattern) {
+    return strcspn(pattern, "*?[\\");
+}
+
+/* returns 1 if an entry of this type is selected by a combination of TAR_FIND_* flags */
+static int find_type_match(char typeflag, int types) {
+    if (!types) return 1;
+    return ((types & TAR_FIND_FILES) && is_file_type(typeflag)) || ((types & TAR_FIND_DIRS) && is_dir_type(typeflag))
+        || ((types & TAR_FIND_LINKS) && is_link_type(typeflag));
+}
+
+/**
+ * Finds the members of an archive whose path matches a glob pattern, with a single scan.
+ *
+ * The pattern is matched against the whole path of each member with fnmatch(), where '*' also matches '/': the
+ * pattern "lib/" followed by "*.so" selects every ".so" under "lib/" at any depth, and "assets/2024/" followed by "*"
+ * everything under "assets/2024/".
+ * The names of the directories end with a '/'. Links are not followed, and a path that appears several times in the
+ * archive is reported for each occurrence.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param pattern A glob pattern.
+ * @param types A combination of TAR_FIND_FILES, TAR_FIND_DIRS and TAR_FIND_LINKS, zero for members of any type.
+ * @param callback Called with each matching member, in archive order. The entry stays valid until it returns.
+ *                 A non-zero return value stops the search.
+ * @param arg Passed to callback.
+ *
+ * @return the number of members given to callback,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_find(int tar_fd, const char *pattern, int types, tar_find_cb_t callback, void *arg) {
+
+    uint64_t start = stats_start();
+    tar_iter_t *iter = tar_iter_open(tar_fd);
+    if (iter == NULL) return -1;
+
+    size_t prefix_len = literal_prefix_len(pattern);
+    ssize_t found = 0;
+    int ret;
+    tar_entry_t entry;
+    while ((ret = tar_iter_next(iter, &entry)) > 0){
+        if (strncmp(entry.name, pattern, prefix_len) || !find_type_match(entry.typeflag, types)) continue;
+        if (fnmatch(pattern, entry.name, 0)) continue;
+        found++;
+        if (callback(&entry, arg)) break;
+    }
+
+    tar_iter_close(iter);
+    stats_stop(TAR_STATS_FIND, start);
+    return ret < 0 ? -1 : found;
+}
+
+typedef struct index_find_ctx {
+    const tar_index_t *index;
+    const char *pattern;
+    size_t prefix_len;
+    int types;
+    tar_find_cb_t callback;
+    void *arg;
+    ssize_t found;
+    int stop;                   // 1 once the callback asked to stop
+    char name[PATH_MAX];        // path of the entry being matched, built one component per level
+} index_find_ctx_t;
+
+/* sets the fields of a tar_entry_t known to the index, the others are zero, name being the path of the entry */
+static void index_entry_view(const tar_index_t *index, uint32_t id, const char *name, tar_entry_t *view) {
+    *view = (tar_entry_t) {
+        .name = name,
+        .linkname = INDEX_LINKNAME(index, id),
+        .typeflag = index->typeflags[id],
+        .size = index->sizes[id],
+        .mode = index->modes[id],
+        .mtime = index->mtimes[id],
+        .offset = index->offsets[id],
+        .data_offset = index->offsets[id] + BLOCKSIZE,
+    };
+}
+
+/* matches the children of a directory, whose path of dir_len bytes is in ctx->name, and descends into the ones that
+ * can contain matches */
+static void index_find_children(index_find_ctx_t *ctx, uint32_t dir, size_t dir_len) {
+    const tar_index_t *index = ctx->index;
+    uint32_t first, nb_children;
+    index_children(index, dir, &first, &nb_children);
+    for (uint32_t id = first; id < first + nb_children && !ctx->stop; id++){
+        const char *basename = INDEX_BASENAME(index, id);
+        size_t len = dir_len + strlen(basename);
+        if (len >= PATH_MAX) continue;//only in a corrupted sidecar
+        strcpy(ctx->name + dir_len, basename);
+        //a name shorter than the prefix can only be one of its directories
+        if (strncmp(ctx->name, ctx->pattern, len < ctx->prefix_len ? len : ctx->prefix_len)) continue;
+
+        if (len >= ctx->prefix_len && !INDEX_IMPLICIT(index, id) && find_type_match(index->typeflags[id], ctx->types)
+            && !fnmatch(ctx->pattern, ctx->name, 0)){
+            tar_entry_t entry;
+            index_entry_view(index, id, ctx->name, &entry);
+            ctx->found++;
+            if (ctx->callback(&entry, ctx->arg)) ctx->stop = 1;
+        }
+        if (index->typeflags[id] == DIRTYPE) index_find_children(ctx, id, len);
+    }
+}
+
+/**
+ * Same as tar_find(), but answered from the index, without reading the archive.
+ *
+ * The members are given to callback sorted by name within each directory, parents before their children, and a path
+ * that appears several times in the archive is reported once, for its last occurrence. The uid, gid, chksum and
+ * header fields of the entries are not set, and directories without a header of their own are not reported.
+ */
+ssize_t tar_index_find(tar_index_t *index, const char *pattern, int types, tar_find_cb_t callback, void *arg) {
+    uint64_t start = stats_start();
+    index_find_ctx_t ctx = {
+        .index = index,
+        .pattern = pattern,
+        .prefix_len = literal_prefix_len(pattern),
+        .types = types,
+        .callback = callback,
+        .arg = arg,
+    };
+    index_find_children(&ctx, INDEX_NONE, 0);
+    stats_stop(TAR_STATS_FIND, start);
+    return ctx.found;
+}
+
+/*
+ * Asynchronous reads
+ *
+ * A context reads the members of an archive without blocking its caller. Once the index of the handle is built,
+ * a path is resolved in memory by the caller and the content of the member is read by an io_uring IORING_OP_READ,
+ * so that many reads are in flight from a single thread. The ring is set up with raw system calls and its
+ * completions signal an eventfd, which the caller can watch with epoll before calling tar_async_poll().
+ *
+ * The requests that need to block are handed to a pool of threads instead: the first ones, while the index is being
+ * built by a thread of the pool, every request when io_uring is unavailable or the archive is in mmap, gzip or
+ * cache mode, and the reads that do not fit in the ring. The threads signal the same eventfd.
+ *
+ * Callbacks are only run by tar_async_poll(), in the thread of the caller, in completion order.
+ */
+
+#define ASYNC_RING_ENTRIES 256
+#define ASYNC_MAX_READ (1 << 30)   // larger reads are split, the length of an entry has 32 bits
+
+#define ASYNC_READ 0
+#define ASYNC_LIST 1
+
+typedef struct async_request {
+    int kind;                   // ASYNC_READ or ASYNC_LIST
+    size_t offset;
+    void *dest;                 // buffer of a read, or array of entries of a list
+    size_t len;                 // capacity of dest, then bytes read or entries listed
+    size_t done;                // bytes read by the ring so far
+    size_t available;           // bytes of the file after offset, for a read in the ring
+    off_t data_offset;          // offset of the content of the file in the archive, for a read in the ring
+    ssize_t result;             // return value of the synchronous function
+    tar_async_cb_t callback;
+    void *arg;
+    struct async_request *next;
+    char path[];
+} async_request_t;
+
+/* the rings shared with the kernel, mapped from the file descriptor of the ring */
+typedef struct async_ring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;               // same as sq_ptr when the kernel maps both rings at once
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned pending;           // entries queued but not yet accepted by io_uring_enter()
+    unsigned in_flight;         // entries submitted whose completion was not reaped
+} async_ring_t;
+
+struct tar_async {
+    tar_handle_t *handle;
+    int event_fd;
+    async_ring_t *ring;         // NULL when io_uring is not used
+    size_t in_flight;           // requests whose callback was not run yet
+    pthread_mutex_t lock;       // protects the fields below
+    pthread_cond_t cond;        // signaled when a request is queued or the pool is stopping
+    async_request_t *queue;     // requests waiting for a thread of the pool, in submission order
+    async_request_t **queue_tail;
+    async_request_t *completed; // requests whose callback is ready to run, the last completed first
+    int stopping;
+    int nb_threads;
+    pthread_t *threads;
+};
+
+static void async_ring_free(async_ring_t *ring) {
+    if (ring == NULL) return;
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL) munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+}
+
+/* sets up a ring whose completions signal event_fd, returns NULL if io_uring is unavailable */
+static async_ring_t *async_ring_new(int event_fd) {
+
+    async_ring_t *ring = calloc(1, sizeof(async_ring_t));
+    if (ring == NULL) return NULL;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, ASYNC_RING_ENTRIES, &params);
+    if (ring->fd < 0){
+        tar_log(TAR_LOG_DEBUG, errno, "io_uring_setup, falling back to threads");
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) ring->sq_ptr = NULL;
+    if (ring->sq_ptr != NULL && (params.features & IORING_FEAT_SINGLE_MMAP)) ring->cq_ptr = ring->sq_ptr;
+    else if (ring->sq_ptr != NULL){
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) ring->cq_ptr = NULL;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (ring->cq_ptr != NULL){
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    }
+    if (ring->sqes == NULL || syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0){
+        tar_log(TAR_LOG_DEBUG, errno, "io_uring setup, falling back to threads");
+        async_ring_free(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = ring->sq_ptr;
+    uint8_t *cq = ring->cq_ptr;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return ring;
+}
+
+/* gives the queued entries to the kernel, the ones it does not accept now are given again by the next call */
+static void async_ring_flush(async_ring_t *ring) {
+    if (ring->pending == 0) return;
+    long r = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, NULL, 0);
+    if (r < 0){
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) tar_log(TAR_LOG_ERROR, errno, "io_uring_enter");
+        return;
+    }
+    ring->pending -= r;
+}
+
+/* queues the read of the part of a request not read yet, the ring must have a free entry */
+static void async_ring_read(async_ring_t *ring, int tar_fd, async_request_t *request) {
+    unsigned tail = *ring->sq_tail;//only this thread moves the tail
+    unsigned position = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[position];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = tar_fd;
+    sqe->addr = (uintptr_t) ((uint8_t *) request->dest + request->done);
+    sqe->len = request->len - request->done < ASYNC_MAX_READ ? request->len - request->done : ASYNC_MAX_READ;
+    sqe->off = request->data_offset + request->offset + request->done;
+    sqe->user_data = (uintptr_t) request;
+    ring->sq_array[position] = position;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    ring->in_flight++;
+    STATS_ADD(preads, 1);
+    async_ring_flush(ring);
+}
+
+/* makes a request ready for its callback, from any thread */
+static void async_complete(tar_async_t *ctx, async_request_t *request) {
+    pthread_mutex_lock(&ctx->lock);
+    request->next = ctx->completed;
+    ctx->completed = request;
+    pthread_mutex_unlock(&ctx->lock);
+    uint64_t one = 1;
+    if (write(ctx->event_fd, &one, sizeof(one)) < 0) tar_log(TAR_LOG_ERROR, errno, "write to eventfd");
+}
+
+/* runs a request with the synchronous functions of the handle, in a thread of the pool */
+static void async_run(tar_async_t *ctx, async_request_t *request) {
+    size_t len = request->len;
+    if (request->kind == ASYNC_READ) request->result = tar_handle_read_file(ctx->handle, request->path,
+                                                                          request->offset, request->dest, &len);
+    else request->result = tar_handle_list(ctx->handle, request->path, request->dest, &len);
+    request->len = request->result < 0 ? 0 : len;
+}
+
+static void *async_worker_run(void *arg) {
+    tar_async_t *ctx = arg;
+    pthread_mutex_lock(&ctx->lock);
+    while (1){
+        while (ctx->queue == NULL && !ctx->stopping) pthread_cond_wait(&ctx->cond, &ctx->lock);
+        if (ctx->queue == NULL) break;//stopping, and nothing left to run
+
+        async_request_t *request = ctx->queue;
+        ctx->queue = request->next;
+        if (ctx->queue == NULL) ctx->queue_tail = &ctx->queue;
+        pthread_mutex_unlock(&ctx->lock);
+        async_run(ctx, request);
+        async_complete(ctx, request);
+        pthread_mutex_lock(&ctx->lock);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static void async_enqueue(tar_async_t *ctx, async_request_t *request) {
+    request->next = NULL;
+    pthread_mutex_lock(&ctx->lock);
+    *ctx->queue_tail = request;
+    ctx->queue_tail = &request->next;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static async_request_t *async_request_new(int kind, const char *path, size_t offset, void *dest, size_t len,
+                                          tar_async_cb_t callback, void *arg) {
+    size_t path_len = strlen(path);
+    async_request_t *request = malloc(sizeof(async_request_t) + path_len + 1);
+    if (request == NULL) return NULL;
+    request->kind = kind;
+    request->offset = offset;
+    request->dest = dest;
+    request->len = len;
+    request->done = 0;
+    request->callback = callback;
+    request->arg = arg;
+    memcpy(request->path, path, path_len + 1);
+    return request;
+}
+
 /**
- * Checks whether the archive is valid.
+ * Starts reading the members of an archive asynchronously.
  *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
+ * A context must only be used by one thread at a time, typically an event loop.
  *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param handle A handle on the archive, which the context retains until it is closed.
+ * @param nb_threads The number of threads running the requests that cannot go through io_uring,
+ *                   zero or less to use one per online processor.
+ * @param flags TAR_ASYNC_NO_URING to run every request in the threads.
  *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
+ * @return a pointer to the new context, to be released with tar_async_close(),
+ *         NULL if it could not be created.
  */
-int check_archive(int tar_fd) {
-
-    int nb = 0;//track where we are in the archive, at which block
-    int nb_headers = 0;//header count to be returned
+tar_async_t *tar_async_open(tar_handle_t *handle, int nb_threads, int flags) {
 
-    while (1){
+    if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads <= 0) nb_threads = 1;
 
-        //read block in tar_header buffer
-        tar_header_t buf;
-        if (pread(tar_fd, &buf, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("read error in check_archive");
+    tar_async_t *ctx = calloc(1, sizeof(tar_async_t));
+    if (ctx == NULL) return NULL;
+    ctx->threads = calloc(nb_threads, sizeof(pthread_t));
+    ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->threads == NULL || ctx->event_fd < 0){
+        if (ctx->event_fd < 0) tar_log(TAR_LOG_ERROR, errno, "eventfd");
+        if (ctx->event_fd >= 0) close(ctx->event_fd);
+        free(ctx->threads);
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->queue_tail = &ctx->queue;
+    ctx->handle = tar_handle_retain(handle);
+    if (!(flags & TAR_ASYNC_NO_URING)) ctx->ring = async_ring_new(ctx->event_fd);
 
-        //if the block is filled with "\0" (so strlen == 0), check if the following one is also filled with "\0", and if so return 0
-        if (!strlen((char *) &buf)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in check_archive\n");
-            if (!strlen((char *) &header2)){
-                return nb_headers;
-            }
-        }
+    for (; ctx->nb_threads < nb_threads; ctx->nb_threads++){
+        if (pthread_create(&ctx->threads[ctx->nb_threads], NULL, async_worker_run, ctx)) break;
+    }
+    if (ctx->nb_threads == 0){
+        tar_log(TAR_LOG_ERROR, 0, "could not start the threads of an asynchronous context");
+        tar_async_close(ctx);
+        return NULL;
+    }
+    return ctx;
+}
 
-        //checking for version and magic
-        if (strcmp(buf.magic, TMAGIC)) return -1;
-        if (buf.version[0] != TVERSION[0] && buf.version[1] != TVERSION[1]) return -2;//this is needed because strcmp adding "/0" or not is ambiguous
+/**
+ * Returns the eventfd of a context, which becomes readable when callbacks are ready to run.
+ *
+ * @param ctx A context returned by tar_async_open().
+ *
+ * @return the file descriptor, to watch with poll() or epoll but not to read nor close.
+ */
+int tar_async_fd(tar_async_t *ctx) {
+    return ctx->event_fd;
+}
 
-        //checking for checksum
+/* returns 1 if the content of a file can be read by the ring, the archive being in none of the other modes */
+static int async_uses_ring(tar_async_t *ctx) {
+    int tar_fd = ctx->handle->tar_fd;
+    return ctx->ring != NULL && ctx->ring->in_flight < ctx->ring->entries && get_mapping(tar_fd) == NULL
+           && get_gzip(tar_fd) == NULL && get_cache(tar_fd) == NULL;
+}
 
-        //first store value from header
-        uint sum = TAR_INT(buf.chksum);
+/**
+ * Starts reading a file of an archive, like tar_handle_read_file().
+ *
+ * @param ctx A context returned by tar_async_open().
+ * @param path A path to the file, links are resolved.
+ * @param offset An offset in the file from which to start reading, zero indicating the start of the file.
+ * @param dest A destination buffer of len bytes, which must stay valid until the callback is run.
+ * @param len The size of dest.
+ * @param callback Run by tar_async_poll() with the return value of tar_handle_read_file() and the number of bytes read.
+ * @param arg Passed to callback.
+ *
+ * @return zero if the read was started,
+ *         -1 if memory could not be allocated, callback will not be run.
+ */
+int tar_async_read_file(tar_async_t *ctx, const char *path, size_t offset, uint8_t *dest, size_t len,
+                        tar_async_cb_t callback, void *arg) {
 
-        //then calculate checksum ourselves
-        if (memset(buf.chksum, ' ', 8) == NULL) perror("memset error in check_archive");//replace checksum bytes with spaces
-        uint8_t *mapping = (uint8_t *) &buf;
-        uint count = 0;
-        for (int i = 0; i < BLOCKSIZE; i++){
-            count += *(mapping++);
-        }
+    async_request_t *request = async_request_new(ASYNC_READ, path, offset, dest, len, callback, arg);
+    if (request == NULL) return -1;
+    ctx->in_flight++;
 
-        //we can finally check
-        if (sum != count) return -3;
+    //the first lookups wait for the index in the pool, which builds it
+    tar_index_t *index = atomic_load_explicit(&ctx->handle->index, memory_order_acquire);
+    if (index == NULL || !async_uses_ring(ctx)){
+        async_enqueue(ctx, request);
+        return 0;
+    }
 
-        //here we go to the next header
-        if (TAR_INT(buf.size)%BLOCKSIZE == 0){// if all file blocks are exactly full (no padding)
-            nb += (1 + TAR_INT(buf.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(buf.size)/BLOCKSIZE);
+    //the entry is located in memory, only its content is read from the archive
+    if (index_locate_file(index, path, &request->data_offset, &request->available) < 0){
+        request->result = -1;
+        request->len = 0;
+    } else if (offset > request->available){
+        request->result = -2;
+        request->len = 0;
+    } else {
+        request->available -= offset;
+        if (request->len > request->available) request->len = request->available;
+        if (request->len > 0){
+            async_ring_read(ctx->ring, ctx->handle->tar_fd, request);
+            return 0;
         }
-        nb_headers++;//increment number of headers
-
-        //the four next function follow the exact same technique !
+        request->result = request->available;
     }
+    async_complete(ctx, request);
+    return 0;
 }
 
 /**
- * Checks whether an entry exists in the archive.
+ * Starts listing a directory of an archive, like tar_handle_list().
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param ctx A context returned by tar_async_open().
+ * @param path A path to the directory, links are resolved.
+ * @param entries An array of no_entries buffers of at least PATH_MAX bytes, which must stay valid until the
+ *                callback is run.
+ * @param no_entries The number of buffers of entries.
+ * @param callback Run by tar_async_poll() with the return value of tar_handle_list() and the number of entries listed.
+ * @param arg Passed to callback.
  *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
+ * @return zero if the listing was started,
+ *         -1 if memory could not be allocated, callback will not be run.
  */
-int exists(int tar_fd, char *path) {
-
-    //devrait check archive avant de procéder
+int tar_async_list(tar_async_t *ctx, const char *path, char **entries, size_t no_entries,
+                   tar_async_cb_t callback, void *arg) {
 
-    int nb = 0;
+    async_request_t *request = async_request_new(ASYNC_LIST, path, 0, entries, no_entries, callback, arg);
+    if (request == NULL) return -1;
+    ctx->in_flight++;
 
-    while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in exists\n");
-
-        if (!strcmp(header.name, path)) return 1;
+    //a listing never reads the archive once the index is built
+    if (atomic_load_explicit(&ctx->handle->index, memory_order_acquire) == NULL){
+        async_enqueue(ctx, request);
+        return 0;
+    }
+    async_run(ctx, request);
+    async_complete(ctx, request);
+    return 0;
+}
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in exists\n");
-            if (!strlen((char *) &header2)){
-                return 0;
-            }
+/* moves the reads finished by the ring to the completed requests, and gives the rest of the short ones again */
+static void async_ring_reap(tar_async_t *ctx) {
+    async_ring_t *ring = ctx->ring;
+    unsigned head = *ring->cq_head;//only this thread moves the head
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    async_request_t *finished = NULL;
+    for (; head != tail; head++){
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        async_request_t *request = (async_request_t *) (uintptr_t) cqe->user_data;
+        ring->in_flight--;
+        if (cqe->res > 0){
+            STATS_ADD(bytes_read, cqe->res);
+            request->done += cqe->res;
+            if (request->done < request->len){
+                request->result = 1;//read again once the head is released
+            } else request->result = 0;
+        } else {
+            if (cqe->res < 0) tar_log(TAR_LOG_ERROR, -cqe->res, "io_uring read");
+            request->result = cqe->res < 0 ? -1 : 0;//a read of zero bytes ends the file
         }
+        request->next = finished;
+        finished = request;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
+    while (finished != NULL){
+        async_request_t *request = finished;
+        finished = request->next;
+        if (request->result == 1){
+            async_ring_read(ring, ctx->handle->tar_fd, request);
+            continue;
         }
+        request->len = request->result < 0 ? 0 : request->done;
+        if (request->result == 0) request->result = request->available - request->done;
+        pthread_mutex_lock(&ctx->lock);
+        request->next = ctx->completed;
+        ctx->completed = request;
+        pthread_mutex_unlock(&ctx->lock);
     }
 }
 
 /**
- * Checks whether an entry exists in the archive and is a directory.
+ * Runs the callbacks of the requests that completed.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param ctx A context returned by tar_async_open().
+ * @param wait Non-zero to wait for a request to complete when none did and some are in flight.
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
+ * @return the number of callbacks run.
  */
-int is_dir(int tar_fd, char *path) {
-
-    //devrait utiliser exist avant
-
-    int nb = 0;
+int tar_async_poll(tar_async_t *ctx, int wait) {
 
+    int nb_callbacks = 0;
     while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in is_dir\n");
+        uint64_t count;
+        if (read(ctx->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) tar_log(TAR_LOG_ERROR, errno, "eventfd");
+        if (ctx->ring != NULL){
+            async_ring_flush(ctx->ring);
+            async_ring_reap(ctx);
+        }
 
-        if (!strcmp(header.name, path) && header.typeflag == DIRTYPE) return 1;
+        pthread_mutex_lock(&ctx->lock);
+        async_request_t *completed = ctx->completed;
+        ctx->completed = NULL;
+        pthread_mutex_unlock(&ctx->lock);
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in is_dir\n");
-            if (!strlen((char *) &header2)){
-                return 0;
-            }
+        //the list is in reverse completion order
+        async_request_t *ordered = NULL;
+        while (completed != NULL){
+            async_request_t *request = completed;
+            completed = request->next;
+            request->next = ordered;
+            ordered = request;
+        }
+        while (ordered != NULL){
+            async_request_t *request = ordered;
+            ordered = request->next;
+            ctx->in_flight--;
+            nb_callbacks++;
+            request->callback(request->result, request->len, request->arg);
+            free(request);
         }
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
+        if (nb_callbacks || !wait || ctx->in_flight == 0) return nb_callbacks;
+        struct pollfd event = {.fd = ctx->event_fd, .events = POLLIN};
+        if (poll(&event, 1, -1) < 0 && errno != EINTR){
+            tar_log(TAR_LOG_ERROR, errno, "poll");
+            return nb_callbacks;
         }
     }
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
+ * Waits for the requests in flight, runs their callbacks, then releases a context.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param ctx A context returned by tar_async_open(), may be NULL.
+ */
+void tar_async_close(tar_async_t *ctx) {
+    if (ctx == NULL) return;
+    while (ctx->in_flight > 0 && tar_async_poll(ctx, 1) > 0);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int i = 0; i < ctx->nb_threads; i++) pthread_join(ctx->threads[i], NULL);
+
+    async_ring_free(ctx->ring);
+    close(ctx->event_fd);
+    tar_handle_release(ctx->handle);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx->threads);
+    free(ctx);
+}
+
+/*
+ * Manifests
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * tar_manifest() builds the index of the archive, so that the headers are read once and a path appearing several
+ * times is only described by its last occurrence, then hashes the contents of the regular files with a pool of
+ * threads. The files are taken in archive order from a shared counter, each thread hashing a whole file, straight
+ * from the mapping in mmap mode and through reads of TAR_MANIFEST_BUFSIZE bytes otherwise. The manifest is written
+ * once every digest is known, in the order of the index: parents before their children, sorted by name.
  */
-int is_file(int tar_fd, char *path) {
 
-    //devrait utiliser exist avant
+#define TAR_MANIFEST_BUFSIZE (1 << 20)
+#define MANIFEST_MAX_DIGEST 32
 
-    int nb = 0;
+static uint32_t rotr32(uint32_t x, int n) {
+    return x >> n | x << (32 - n);
+}
 
-    while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in is_file\n");
+static uint64_t rotl64(uint64_t x, int n) {
+    return x << n | x >> (64 - n);
+}
 
-        if (!strcmp(header.name, path) && (header.typeflag == REGTYPE || header.typeflag == AREGTYPE)) return 1;
+static uint64_t load_le64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = value << 8 | bytes[i];
+    return value;
+}
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in is_file\n");
-            if (!strlen((char *) &header2)){
-                return 0;
-            }
-        }
+static uint32_t load_le32(const uint8_t *bytes) {
+    return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
-        }
+/* SHA-256, FIPS 180-4 */
+typedef struct sha256 {
+    uint32_t state[8];
+    uint64_t len;               // bytes hashed so far
+    uint8_t block[64];          // bytes of the current block, len % 64 of them
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_init(sha256_t *sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->len = 0;
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++){
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8
+               | block[4 * i + 3];
     }
+    for (int i = 16; i < 64; i++){
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ w[i - 15] >> 3;
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ w[i - 2] >> 10;
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++){
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
 }
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
- */
-int is_symlink(int tar_fd, char *path) {
+static void sha256_update(sha256_t *sha, const uint8_t *data, size_t len) {
+    size_t used = sha->len % 64;
+    sha->len += len;
+    if (used){
+        size_t n = 64 - used < len ? 64 - used : len;
+        memcpy(sha->block + used, data, n);
+        data += n;
+        len -= n;
+        if (used + n < 64) return;
+        sha256_block(sha->state, sha->block);
+    }
+    for (; len >= 64; data += 64, len -= 64) sha256_block(sha->state, data);
+    memcpy(sha->block, data, len);
+}
+
+static void sha256_final(sha256_t *sha, uint8_t *digest) {
+    uint64_t bits = sha->len * 8;
+    uint8_t padding[72] = {0x80};
+    size_t padding_len = (sha->len % 64 < 56 ? 56 : 120) - sha->len % 64;
+    for (int i = 0; i < 8; i++) padding[padding_len + i] = bits >> (56 - 8 * i);
+    sha256_update(sha, padding, padding_len + 8);
+    for (int i = 0; i < 32; i++) digest[i] = sha->state[i / 4] >> (24 - 8 * (i % 4));
+}
 
-    //devrait utiliser exist
+/* XXH64 with a seed of zero, digests written big-endian like xxhsum prints them */
+#define XXH_PRIME1 0x9e3779b185ebca87ULL
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3 0x165667b19e3779f9ULL
+#define XXH_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5 0x27d4eb2f165667c5ULL
 
-    int nb = 0;
+typedef struct xxh64 {
+    uint64_t acc[4];
+    uint64_t len;               // bytes hashed so far
+    uint8_t stripe[32];         // bytes of the current stripe, len % 32 of them
+} xxh64_t;
 
-    while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in is_symlink\n");
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
 
-        if (!strcmp(header.name, path) && (header.typeflag == LNKTYPE || header.typeflag == SYMTYPE)) return 1;
+static void xxh64_init(xxh64_t *xxh) {
+    xxh->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    xxh->acc[1] = XXH_PRIME2;
+    xxh->acc[2] = 0;
+    xxh->acc[3] = -XXH_PRIME1;
+    xxh->len = 0;
+}
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in is_symlink\n");
-            if (!strlen((char *) &header2)){
-                return 0;
-            }
+static void xxh64_stripe(uint64_t *acc, const uint8_t *stripe) {
+    for (int i = 0; i < 4; i++) acc[i] = xxh64_round(acc[i], load_le64(stripe + 8 * i));
+}
+
+static void xxh64_update(xxh64_t *xxh, const uint8_t *data, size_t len) {
+    size_t used = xxh->len % 32;
+    xxh->len += len;
+    if (used){
+        size_t n = 32 - used < len ? 32 - used : len;
+        memcpy(xxh->stripe + used, data, n);
+        data += n;
+        len -= n;
+        if (used + n < 32) return;
+        xxh64_stripe(xxh->acc, xxh->stripe);
+    }
+    for (; len >= 32; data += 32, len -= 32) xxh64_stripe(xxh->acc, data);
+    memcpy(xxh->stripe, data, len);
+}
+
+static void xxh64_final(xxh64_t *xxh, uint8_t *digest) {
+    uint64_t h;
+    if (xxh->len >= 32){
+        h = rotl64(xxh->acc[0], 1) + rotl64(xxh->acc[1], 7) + rotl64(xxh->acc[2], 12) + rotl64(xxh->acc[3], 18);
+        for (int i = 0; i < 4; i++) h = (h ^ xxh64_round(0, xxh->acc[i])) * XXH_PRIME1 + XXH_PRIME4;
+    } else h = XXH_PRIME5;
+    h += xxh->len;
+
+    const uint8_t *p = xxh->stripe;
+    size_t left = xxh->len % 32;
+    for (; left >= 8; p += 8, left -= 8) h = rotl64(h ^ xxh64_round(0, load_le64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (left >= 4){
+        h = rotl64(h ^ load_le32(p) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left; p++, left--) h = rotl64(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    for (int i = 0; i < 8; i++) digest[i] = h >> (56 - 8 * i);
+}
+
+typedef struct manifest_ctx {
+    int tar_fd;
+    int algorithm;
+    const tar_mapping_t *mapping;   // NULL when the archive is not in mmap mode
+    const tar_index_t *index;
+    uint32_t *members;          // every member with a header of its own, in the order of the manifest
+    size_t nb_members;
+    uint32_t *files;            // positions in members of the regular files, sorted by offset
+    size_t nb_files;
+    uint8_t (*digests)[MANIFEST_MAX_DIGEST];    // digest of each member, by position in members
+    uint8_t *failed;            // 1 for the files that could not be read, by position in members
+    _Atomic size_t next_file;   // next file to hash, shared by the threads
+    atomic_int failures;        // number of files that could not be read
+} manifest_ctx_t;
+
+static size_t digest_len(int algorithm) {
+    return algorithm == TAR_DIGEST_SHA256 ? 32 : 8;
+}
+
+static void manifest_collect(manifest_ctx_t *ctx, uint32_t dir) {
+    const tar_index_t *index = ctx->index;
+    uint32_t first, nb_children;
+    index_children(index, dir, &first, &nb_children);
+    for (uint32_t id = first; id < first + nb_children; id++){
+        if (!INDEX_IMPLICIT(index, id)){
+            if (is_file_type(index->typeflags[id])) ctx->files[ctx->nb_files++] = ctx->nb_members;
+            ctx->members[ctx->nb_members++] = id;
         }
+        if (index->typeflags[id] == DIRTYPE) manifest_collect(ctx, id);
+    }
+}
+
+static int compare_member_offsets(const void *a, const void *b, void *arg) {
+    const manifest_ctx_t *ctx = arg;
+    off_t x = ctx->index->offsets[ctx->members[*(const uint32_t *) a]];
+    off_t y = ctx->index->offsets[ctx->members[*(const uint32_t *) b]];
+    return (x > y) - (x < y);
+}
+
+/* hashes the content of a file, buffer being allocated on first use, returns -1 if it could not be read */
+static int manifest_hash(const manifest_ctx_t *ctx, uint32_t id, uint8_t **buffer, uint8_t *digest) {
+    sha256_t sha;
+    xxh64_t xxh;
+    if (ctx->algorithm == TAR_DIGEST_SHA256) sha256_init(&sha);
+    else xxh64_init(&xxh);
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
+    off_t in = ctx->index->offsets[id] + BLOCKSIZE;
+    size_t left = ctx->index->sizes[id];
+    while (left){
+        const uint8_t *data;
+        size_t len;
+        if (ctx->mapping != NULL){
+            if (in + left > ctx->mapping->size) return -1;//truncated archive
+            data = ctx->mapping->base + in;
+            len = left;
         } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
+            if (*buffer == NULL && (*buffer = malloc(TAR_MANIFEST_BUFSIZE)) == NULL) return -1;
+            ssize_t r = tar_pread(ctx->tar_fd, *buffer, left < TAR_MANIFEST_BUFSIZE ? left : TAR_MANIFEST_BUFSIZE, in);
+            if (r <= 0) return -1;
+            data = *buffer;
+            len = r;
         }
+        if (ctx->algorithm == TAR_DIGEST_SHA256) sha256_update(&sha, data, len);
+        else xxh64_update(&xxh, data, len);
+        in += len;
+        left -= len;
+    }
+    if (ctx->algorithm == TAR_DIGEST_SHA256) sha256_final(&sha, digest);
+    else xxh64_final(&xxh, digest);
+    return 0;
+}
+
+static void *manifest_worker_run(void *arg) {
+
+    manifest_ctx_t *ctx = arg;
+    uint8_t *buffer = NULL;//not needed in mmap mode
 
+    size_t i;
+    while ((i = atomic_fetch_add(&ctx->next_file, 1)) < ctx->nb_files){
+        uint32_t position = ctx->files[i];
+        uint32_t id = ctx->members[position];
+        if (manifest_hash(ctx, id, &buffer, ctx->digests[position]) < 0){
+            char name[PATH_MAX];
+            index_name(ctx->index, id, name);
+            tar_log(TAR_LOG_WARNING, 0, "could not read the content of %s", name);
+            atomic_fetch_add(&ctx->failures, 1);
+            ctx->failed[position] = 1;
+        }
     }
 
+    free(buffer);
+    return NULL;
+}
+
+/* writes a line of the manifest, returns -1 if it could not be written */
+static int manifest_write(const manifest_ctx_t *ctx, size_t position, FILE *out) {
+    const tar_index_t *index = ctx->index;
+    uint32_t id = ctx->members[position];
+    char digest[2 * MANIFEST_MAX_DIGEST + 1] = "-";
+    if (is_file_type(index->typeflags[id]) && !ctx->failed[position]){
+        for (size_t i = 0; i < digest_len(ctx->algorithm); i++){
+            sprintf(digest + 2 * i, "%02x", ctx->digests[position][i]);
+        }
+    }
+    char typeflag = index->typeflags[id] == AREGTYPE ? REGTYPE : index->typeflags[id];
+    size_t size = index->sizes[id];
+    char name[PATH_MAX];
+    index_name(index, id, name);
+    int ret = is_link_type(typeflag)
+              ? fprintf(out, "%s %c %zu %04o %s -> %s\n", digest, typeflag, size, index->modes[id], name,
+                        INDEX_LINKNAME(index, id))
+              : fprintf(out, "%s %c %zu %04o %s\n", digest, typeflag, size, index->modes[id], name);
+    return ret < 0 ? -1 : 0;
 }
 
+static int manifest(int tar_fd, int algorithm, int nb_threads, FILE *out) {
+
+    if (algorithm != TAR_DIGEST_SHA256 && algorithm != TAR_DIGEST_XXH64) return -1;
+    if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads <= 0) nb_threads = 1;
+
+    tar_index_t *index = tar_index_build(tar_fd);
+    if (index == NULL) return -1;
+    size_t capacity = index->nb_entries + 1;
+    manifest_ctx_t ctx = {
+        .tar_fd = tar_fd,
+        .algorithm = algorithm,
+        .mapping = get_mapping(tar_fd),
+        .index = index,
+        .members = malloc(capacity * sizeof(uint32_t)),
+        .files = malloc(capacity * sizeof(uint32_t)),
+        .digests = malloc(capacity * MANIFEST_MAX_DIGEST),
+        .failed = calloc(capacity, 1),
+    };
+    if (ctx.members == NULL || ctx.files == NULL || ctx.digests == NULL || ctx.failed == NULL){
+        free(ctx.members);
+        free(ctx.files);
+        free(ctx.digests);
+        free(ctx.failed);
+        tar_index_free(index);
+        return -1;
+    }
+    atomic_init(&ctx.next_file, 0);
+    atomic_init(&ctx.failures, 0);
+    manifest_collect(&ctx, INDEX_NONE);
+    qsort_r(ctx.files, ctx.nb_files, sizeof(uint32_t), compare_member_offsets, &ctx);
+
+    pthread_t *threads = calloc(nb_threads, sizeof(pthread_t));//nb_threads is not bounded by the stack
+    int nb_started = 1;
+    while (threads != NULL && nb_started < nb_threads
+           && !pthread_create(&threads[nb_started], NULL, manifest_worker_run, &ctx)) nb_started++;
+    manifest_worker_run(&ctx);//this thread is the first one, and hashes every file if no other could be started
+    for (int t = 1; t < nb_started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+
+    int ret = atomic_load(&ctx.failures);
+    for (size_t i = 0; i < ctx.nb_members && ret >= 0; i++){
+        if (manifest_write(&ctx, i, out) < 0){
+            tar_log(TAR_LOG_ERROR, errno, "write error in tar_manifest");
+            ret = -2;
+        }
+    }
+
+    free(ctx.members);
+    free(ctx.files);
+    free(ctx.digests);
+    free(ctx.failed);
+    tar_index_free(index);
+    return ret;
+}
 
 /**
- * Lists the entries at a given path in the archive.
- * list() does not recurse into the directories listed at the given path.
+ * Writes a manifest of an archive, one line per member: its digest, its type, its size, its permissions in octal and
+ * its path, followed by " -> " and the target for links.
  *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
+ * The headers are read once, and the contents of the regular files are hashed by several threads. The members are
+ * listed parents before their children, sorted by name, and a path appearing several times in the archive is listed
+ * once, for its last occurrence. The digest of a member which is not a regular file, or whose content could not be
+ * read, is "-".
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
+ * @param algorithm TAR_DIGEST_SHA256 or TAR_DIGEST_XXH64.
+ * @param nb_threads The number of threads hashing the files, zero or less to use one per online processor.
+ * @param out The stream the manifest is written to.
  *
- * @return zero if no directory at the given path exists in the archive,
- *         any other value otherwise.
+ * @return zero if every file was hashed,
+ *         -1 if the archive could not be read or the algorithm is unknown, nothing was written,
+ *         -2 if the manifest could not be written,
+ *         otherwise the number of files whose content could not be read.
  */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+int tar_manifest(int tar_fd, int algorithm, int nb_threads, FILE *out) {
+    uint64_t start = stats_start();
+    int ret = manifest(tar_fd, algorithm, nb_threads, out);
+    stats_stop(TAR_STATS_MANIFEST, start);
+    return ret;
+}
 
-    //devrait utiliser is_dir/is_symlink et eventuellement is_file
+/*
+ * Incremental refresh
+ *
+ * An archive that is appended to keeps its members in place: the new headers start where the null blocks ending
+ * the archive were. tar_refresh() verifies the headers from the end remembered by the last check of the file
+ * descriptor, and adds the members from the end of the index, so that it only reads the appended region. The
+ * entries are then renumbered and the memoized links forgotten, since a new member may be placed in any directory or
+ * shadow the target of a link. A sidecar-loaded index is first copied to the heap. When the archive was rewritten
+ * since its last check, the appended region is unknown: the whole archive is verified and the index is rebuilt.
+ */
 
-    int nb = 0;
-    int index = 0;//inedxes entries
+/* copies the remembered check of an archive, returns -1 if there is none, -2 if the archive was rewritten since */
+static int check_recall(int tar_fd, check_state_t *state) {
 
-    while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in list\n");
-
-        if (!strcmp(header.name, path)){//we need to check if it is either a directory or a symlink
-            if (header.typeflag == DIRTYPE){//if directory, we can list its entries
-                int nb2 = nb + 1;//start with next header
-                char *record = malloc(100);//this record will help us avoid listing sub-entries
-                strcpy(record, "/");//we are certain "/" cannot be the name of an entry
-                while(1){
-                    tar_header_t entry;
-                    if (pread(tar_fd, &entry, sizeof(tar_header_t), (nb2)*sizeof(tar_header_t)) < 0) perror("pread error in list\n");
-
-                    if (!strncmp(entry.name, path, strlen(path))){//compare beginning to check if it is an entry
-                        if (strncmp(entry.name, record, strlen(record))){//compare with previous record to make sure it is not a sub-entry
-                            memcpy(entries[index], entry.name, strlen(entry.name));//if it is an entry but not a sub-entry, we copy it to entries
-                            index++;
-                            strcpy(record, entry.name);//update record to the entry that was listed last
-                        }
-                    } else if (!(header.typeflag == LNKTYPE || header.typeflag == SYMTYPE)){
-                        *no_entries = index;
-                        return 1;
-                    }
-                    if (TAR_INT(entry.size)%BLOCKSIZE == 0){
-                        nb2 += (1 + TAR_INT(entry.size)/BLOCKSIZE);
-                    } else {
-                        nb2 += (2 + TAR_INT(entry.size)/BLOCKSIZE);
-                    }
-                }
-                free(record);
-            } else if (header.typeflag == LNKTYPE || header.typeflag == SYMTYPE){//if symlink, we run list with the linked-to directory
-                if (is_file(tar_fd, header.linkname + 2)){
-                    printf("%s\n", header.linkname + 2);
-                    return list(tar_fd, header.linkname + 2, entries, no_entries);
-                }
-                return list(tar_fd, strcat(header.linkname, "/") + 2, entries, no_entries);
-            }
-        }
+    pthread_mutex_lock(&fd_tables_lock);
+    check_state_t *remembered = fd_table_get(&checks, tar_fd);
+    if (remembered != NULL) *state = *remembered;
+    pthread_mutex_unlock(&fd_tables_lock);
+    if (remembered == NULL) return -1;
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in list\n");
-            if (!strlen((char *) &header2)){
-                *no_entries = 0;
-                return 0;
-            }
-        }
+    struct stat st;
+    if (fstat(tar_fd, &st) < 0 || st.st_dev != state->dev || st.st_ino != state->ino || st.st_size < state->end){
+        return -2;
+    }
+    uint8_t block[BLOCKSIZE] = {0};
+    if (state->last_header >= 0 && tar_pread(tar_fd, block, BLOCKSIZE, state->last_header) < 0) return -2;
+    return memcmp(block, state->last_block, BLOCKSIZE) ? -2 : 0;
+}
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
+/* copies the arrays of a sidecar-loaded index to the heap, so that they can grow */
+static int index_unmap(tar_index_t *index) {
+    char *strings = malloc(index->strings_len);
+    uint32_t *slots = malloc(index->nb_slots * sizeof(uint32_t));
+    if (strings == NULL || slots == NULL || index_move_columns(index, index->nb_entries ? index->nb_entries : 1) < 0){
+        free(strings);
+        free(slots);
+        return -1;
+    }
+    memcpy(strings, index->strings, index->strings_len);
+    memcpy(slots, index->slots, index->nb_slots * sizeof(uint32_t));
+    munmap(index->file, index->file_size);
+    index->file = NULL;
+    index->strings = strings;
+    index->slots = slots;
+    return 0;
+}
+
+/* adds the members appended after the end of the index, returns -1 if the index could not be updated */
+static int index_refresh(tar_index_t *index) {
+
+    if (index->end < 0){//the end of the last member of the index
+        index->end = 0;
+        for (size_t id = 0; id < index->nb_entries; id++){
+            off_t end = index->offsets[id] + BLOCKSIZE + (index->sizes[id] + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+            if (!INDEX_IMPLICIT(index, id) && end > index->end) index->end = end;
         }
     }
 
+    tar_iter_t *iter = iter_open_at(index->tar_fd, 0, index->end);
+    if (iter == NULL) return -1;
+    size_t nb_added = 0;
+    int ret;
+    tar_entry_t entry;
+    while ((ret = tar_iter_next(iter, &entry)) > 0){
+        if (index->file != NULL && index_unmap(index) < 0) break;
+        if (index_add(index, &entry) < 0) break;
+        nb_added++;
+    }
+    off_t end = iter_offset(iter);
+    tar_iter_close(iter);
+    free(index->interned);//rebuilt from the string table by the next refresh
+    index->interned = NULL;
+    index->nb_interned_slots = 0;
+    if (ret != 0) return -1;
+    if (!nb_added){
+        index->end = end;
+        return 0;
+    }
+
+    if (index_build_tree(index) < 0 || index_alloc_resolved(index) < 0) return -1;
+    index->end = end;
+    return 0;
+}
+
+/* replaces the entries of an index by the members of its archive read from the start, returns -1 if it failed */
+static int index_rebuild(tar_index_t *index) {
+    tar_index_t *rebuilt = index_build(index->tar_fd);
+    if (rebuilt == NULL) return -1;
+    tar_index_t previous = *index;
+    *index = *rebuilt;
+    *rebuilt = previous;
+    tar_index_free(rebuilt);//releases the previous entries
+    return 0;
+}
+
+static int refresh(int tar_fd, tar_index_t *index) {
+
+    check_state_t state;
+    int ret;
+    int recalled = check_recall(tar_fd, &state);
+    if (recalled < 0){
+        ret = check_archive(tar_fd);
+    } else {
+        ret = check_from(tar_fd, &state);
+        if (!ret){
+            check_remember(tar_fd, &state);
+            ret = state.nb_headers;
+        }
+    }
+    if (ret >= 0 && index != NULL){
+        //the members of a rewritten archive are not where the index expects them
+        int failed = recalled == -2 ? index_rebuild(index) < 0 : index_refresh(index) < 0;
+        if (failed) ret = -4;
+    }
+    return ret;
 }
 
 /**
- * Reads a file at a given path in the archive.
+ * Validates and indexes the members appended to an archive since it was last checked and indexed.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive to read from.  If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
- * @param dest A destination buffer to read the given file into.
- * @param len An in-out argument.
- *            The caller set it to the size of dest.
- *            The callee set it to the number of bytes written to dest.
+ * The headers are verified from the end of the archive found by the last successful check_archive(),
+ * check_archive_parallel() or tar_refresh() on tar_fd, or from the start of the archive when it was not checked yet
+ * or was rewritten since. The members are added to the index from the end of its last member, or the index is
+ * rebuilt from the start of the archive when the archive was rewritten since it was last checked. An archive in mmap
+ * mode or with a block cache must be reopened in that mode first, to see the appended bytes.
  *
- * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
- *         -2 if the offset is outside the file total length,
- *         zero if the file was read in its entirety into the destination buffer,
- *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
- *         the end of the file.
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param index The index of the archive, built by tar_index_build() or loaded by tar_index_load(), may be NULL.
+ *              No other thread may be using it.
  *
+ * @return the same values as check_archive() for the whole archive,
+ *         -4 if the index could not be updated, it must then be freed.
  */
-ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+int tar_refresh(int tar_fd, tar_index_t *index) {
+    uint64_t start = stats_start();
+    int ret = refresh(tar_fd, index);
+    stats_stop(TAR_STATS_REFRESH, start);
+    return ret;
+}
 
-    int link = 0;
+/*
+ * Archive diff
+ *
+ * tar_diff() builds the index of each archive, with one pass over its headers, and walks both directory trees at
+ * once: the children of two directories at the same path are sorted by name and merge-joined, a directory "d/" being
+ * at the same path as a file "d", and the walk descends into the directories found on either side. Two members at the
+ * same path are compared by type, then by permissions and link target, then by size. Files of the same size and
+ * modification time are considered unchanged without being read, unless TAR_DIFF_CONTENT is given; the other files of
+ * the same size are compared by a pool of threads, which read both contents by chunks of TAR_DIFF_BUFSIZE bytes and
+ * stop at the first difference. The differences are then reported in the order of the walk.
+ */
 
-    printf("%s\n", path);
+#define TAR_DIFF_BUFSIZE (1 << 20)
+#define DIFF_COMPARE (-1)           // kind of a pair whose contents must be compared
 
-    if(is_file(tar_fd, path)==0){
-        if(is_symlink(tar_fd, path)==0){
-            perror("path given to read_file is invalid.\n");
-            return -1;
-        }else{ link=1; }
-    }
+typedef struct diff_pair {
+    uint32_t a;                 // id of the member in the first index, INDEX_NONE if it was added
+    uint32_t b;                 // id of the member in the second index, INDEX_NONE if it was removed
+    int kind;                   // TAR_DIFF_* kind, DIFF_COMPARE until the contents are compared, then zero if equal
+} diff_pair_t;
 
-    int nb = 0;
-    int bytes_to_read;
+typedef struct diff_ctx {
+    const tar_index_t *a;
+    const tar_index_t *b;
+    int flags;
+    diff_pair_t *pairs;         // the members that differ or must be compared, in the order of the walk
+    size_t nb_pairs;
+    size_t *compares;           // positions in pairs of the files whose contents must be compared
+    size_t nb_compares;
+    _Atomic size_t next_compare;    // next pair to compare, shared by the threads
+} diff_ctx_t;
 
-    while (1){
-        tar_header_t header;
-        if (pread(tar_fd, &header, sizeof(tar_header_t), nb*sizeof(tar_header_t)) < 0) perror("pread error in read_file\n");
-
-        if (!strcmp(header.name, path)){//if we find the file
-            if (link){//if link, we run read_file on the link
-                return read_file(tar_fd, header.linkname, offset, dest, len);
-            }else{
-                bytes_to_read = TAR_INT(header.size) - offset; //number of bytes we should read to get to the end of the file
-                if(bytes_to_read < 0){
-                    perror("read_file error: the offset is outside of the file size.\n");
-                    return -2;
-                }else{
-                    if(bytes_to_read <= *len){ //dest buffer size is long enough to read until the end of the file
-                        *len = (size_t) bytes_to_read; //len is set to the number of bytes written to dest
-                        pread(tar_fd, dest, *len, (nb+1)*sizeof(tar_header_t) + offset);
-                        return 0;
-                    }else{  //dest buffer is too short to reach the end of the file
-                        pread(tar_fd, dest, *len, (nb+1)*sizeof(tar_header_t) + offset);
-                        return bytes_to_read - *len;
-                    }
-                }
-            }
+/* strcmp() of two names, without the "/" ending the names of directories */
+static int diff_compare_names(const char *a, const char *b) {
+    size_t i = 0;
+    while (a[i] == b[i] && a[i] != '\0') i++;
+    unsigned char c_a = a[i] == '/' && a[i + 1] == '\0' ? '\0' : a[i];
+    unsigned char c_b = b[i] == '/' && b[i + 1] == '\0' ? '\0' : b[i];
+    return c_a - c_b;
+}
+
+/* diff_compare_names() for qsort_r(), on the ids of entries of the same directory */
+static int diff_compare_ids(const void *a, const void *b, void *arg) {
+    const tar_index_t *index = arg;
+    const uint32_t *id_a = a, *id_b = b;
+    return diff_compare_names(INDEX_BASENAME(index, *id_a), INDEX_BASENAME(index, *id_b));
+}
+
+/* kind of the difference between two members at the same path, DIFF_COMPARE if their contents must be compared */
+static int diff_kind(const diff_ctx_t *ctx, uint32_t a, uint32_t b) {
+    const tar_index_t *index_a = ctx->a, *index_b = ctx->b;
+    char type_a = index_a->typeflags[a] == AREGTYPE ? REGTYPE : index_a->typeflags[a];
+    char type_b = index_b->typeflags[b] == AREGTYPE ? REGTYPE : index_b->typeflags[b];
+    if (type_a != type_b) return TAR_DIFF_TYPE;
+    if (index_a->modes[a] != index_b->modes[b]) return TAR_DIFF_MODIFIED;
+    if (strcmp(INDEX_LINKNAME(index_a, a), INDEX_LINKNAME(index_b, b))) return TAR_DIFF_MODIFIED;
+    if (!is_file_type(type_a)) return 0;
+    if (index_a->sizes[a] != index_b->sizes[b]) return TAR_DIFF_MODIFIED;
+    if (!index_a->sizes[a] || (index_a->mtimes[a] == index_b->mtimes[b] && !(ctx->flags & TAR_DIFF_CONTENT))) return 0;
+    return DIFF_COMPARE;
+}
+
+/* compares the contents of two files of the same size, returns 1 if they differ or could not be read */
+static int diff_contents(const diff_ctx_t *ctx, uint32_t a, uint32_t b, uint8_t *buffers) {
+    size_t size = ctx->a->sizes[a];
+    for (size_t done = 0; done < size; ){
+        size_t len = size - done < TAR_DIFF_BUFSIZE ? size - done : TAR_DIFF_BUFSIZE;
+        ssize_t r_a = tar_pread(ctx->a->tar_fd, buffers, len, ctx->a->offsets[a] + BLOCKSIZE + done);
+        ssize_t r_b = tar_pread(ctx->b->tar_fd, buffers + TAR_DIFF_BUFSIZE, len, ctx->b->offsets[b] + BLOCKSIZE + done);
+        if (r_a != (ssize_t) len || r_b != (ssize_t) len){
+            char name[PATH_MAX];
+            index_name(ctx->a, a, name);
+            tar_log(TAR_LOG_WARNING, 0, "could not read the content of %s", name);
+            return 1;
         }
+        if (memcmp(buffers, buffers + TAR_DIFF_BUFSIZE, len)) return 1;
+        done += len;
+    }
+    return 0;
+}
 
-        if (!strlen((char *) &header)){
-            tar_header_t header2;
-            if (pread(tar_fd, &header2, sizeof(tar_header_t), (nb+1)*sizeof(tar_header_t)) < 0) perror("pread error in read_file\n");
-            if (!strlen((char *) &header2)){
-                return 0;
-            }
+static void *diff_worker_run(void *arg) {
+
+    diff_ctx_t *ctx = arg;
+    uint8_t *buffers = malloc(2 * TAR_DIFF_BUFSIZE);
+
+    size_t i;
+    while ((i = atomic_fetch_add(&ctx->next_compare, 1)) < ctx->nb_compares){
+        diff_pair_t *pair = &ctx->pairs[ctx->compares[i]];
+        int differ = buffers == NULL || diff_contents(ctx, pair->a, pair->b, buffers);//without memory, they differ
+        pair->kind = differ ? TAR_DIFF_MODIFIED : 0;
+    }
+
+    free(buffers);
+    return NULL;
+}
+
+/* merge-joins the children of a directory of each archive, INDEX_NONE for the root, -1 if it is missing */
+static int diff_join(diff_ctx_t *ctx, int64_t dir_a, int64_t dir_b) {
+
+    uint32_t first_a = 0, nb_a = 0, first_b = 0, nb_b = 0;
+    if (dir_a >= 0) index_children(ctx->a, dir_a, &first_a, &nb_a);
+    if (dir_b >= 0) index_children(ctx->b, dir_b, &first_b, &nb_b);
+    uint32_t *ids_a = malloc(((size_t) nb_a + nb_b + 1) * sizeof(uint32_t));
+    if (ids_a == NULL) return -1;
+    uint32_t *ids_b = ids_a + nb_a;
+    //the children are sorted by name, where a directory "d/" does not always come next to a file "d"
+    for (uint32_t i = 0; i < nb_a; i++) ids_a[i] = first_a + i;
+    for (uint32_t i = 0; i < nb_b; i++) ids_b[i] = first_b + i;
+    qsort_r(ids_a, nb_a, sizeof(uint32_t), diff_compare_ids, (void *) ctx->a);
+    qsort_r(ids_b, nb_b, sizeof(uint32_t), diff_compare_ids, (void *) ctx->b);
+
+    int ret = 0;
+    uint32_t i = 0, j = 0;
+    while (ret == 0 && (i < nb_a || j < nb_b)){
+        int cmp = i == nb_a ? 1 : j == nb_b ? -1 : diff_compare_names(INDEX_BASENAME(ctx->a, ids_a[i]),
+                                                                      INDEX_BASENAME(ctx->b, ids_b[j]));
+        uint32_t a = cmp <= 0 ? ids_a[i++] : INDEX_NONE;
+        uint32_t b = cmp >= 0 ? ids_b[j++] : INDEX_NONE;
+
+        //an implicit directory is only walked for its children
+        diff_pair_t *pair = &ctx->pairs[ctx->nb_pairs];
+        pair->a = a != INDEX_NONE && !INDEX_IMPLICIT(ctx->a, a) ? a : INDEX_NONE;
+        pair->b = b != INDEX_NONE && !INDEX_IMPLICIT(ctx->b, b) ? b : INDEX_NONE;
+        if (pair->a == INDEX_NONE) pair->kind = pair->b == INDEX_NONE ? 0 : TAR_DIFF_ADDED;
+        else if (pair->b == INDEX_NONE) pair->kind = TAR_DIFF_REMOVED;
+        else pair->kind = diff_kind(ctx, a, b);
+        if (pair->kind == DIFF_COMPARE) ctx->compares[ctx->nb_compares++] = ctx->nb_pairs;
+        if (pair->kind) ctx->nb_pairs++;//the same members are not kept
+
+        int is_dir_a = a != INDEX_NONE && ctx->a->typeflags[a] == DIRTYPE;
+        int is_dir_b = b != INDEX_NONE && ctx->b->typeflags[b] == DIRTYPE;
+        if (is_dir_a || is_dir_b) ret = diff_join(ctx, is_dir_a ? (int64_t) a : -1, is_dir_b ? (int64_t) b : -1);
+    }
+
+    free(ids_a);
+    return ret;
+}
+
+static ssize_t diff(int fd_a, int fd_b, int flags, tar_diff_cb_t callback, void *arg) {
+
+    diff_ctx_t ctx = {
+        .a = tar_index_build(fd_a),
+        .b = tar_index_build(fd_b),
+        .flags = flags,
+    };
+    atomic_init(&ctx.next_compare, 0);
+    ssize_t ret = -1;
+    if (ctx.a != NULL && ctx.b != NULL){
+        //each member of either archive makes at most one pair
+        ctx.pairs = malloc((ctx.a->nb_entries + ctx.b->nb_entries + 1) * sizeof(diff_pair_t));
+        ctx.compares = malloc((ctx.a->nb_entries + 1) * sizeof(size_t));
+        if (ctx.pairs != NULL && ctx.compares != NULL) ret = diff_join(&ctx, INDEX_NONE, INDEX_NONE);
+    }
+
+    if (ret == 0 && ctx.nb_compares){
+        int nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nb_threads <= 0) nb_threads = 1;
+        if ((size_t) nb_threads > ctx.nb_compares) nb_threads = ctx.nb_compares;
+        pthread_t threads[nb_threads];
+        int started[nb_threads];
+        for (int t = 1; t < nb_threads; t++){
+            started[t] = !pthread_create(&threads[t], NULL, diff_worker_run, &ctx);
         }
+        diff_worker_run(&ctx);//this thread is the first one, and compares every file if no other could be started
+        for (int t = 1; t < nb_threads; t++){
+            if (started[t]) pthread_join(threads[t], NULL);
+        }
+    }
 
-        if (TAR_INT(header.size)%BLOCKSIZE == 0){
-            nb += (1 + TAR_INT(header.size)/BLOCKSIZE);
-        } else {
-            nb += (2 + TAR_INT(header.size)/BLOCKSIZE);
+    for (size_t i = 0; ret >= 0 && i < ctx.nb_pairs; i++){
+        const diff_pair_t *pair = &ctx.pairs[i];
+        if (!pair->kind) continue;
+        tar_entry_t a, b;
+        char name_a[PATH_MAX], name_b[PATH_MAX];
+        if (pair->a != INDEX_NONE){
+            index_name(ctx.a, pair->a, name_a);
+            index_entry_view(ctx.a, pair->a, name_a, &a);
+        }
+        if (pair->b != INDEX_NONE){
+            index_name(ctx.b, pair->b, name_b);
+            index_entry_view(ctx.b, pair->b, name_b, &b);
         }
+        ret++;
+        if (callback(pair->kind, pair->a != INDEX_NONE ? &a : NULL, pair->b != INDEX_NONE ? &b : NULL, arg)) break;
     }
+
+    free(ctx.pairs);
+    free(ctx.compares);
+    tar_index_free((tar_index_t *) ctx.a);
+    tar_index_free((tar_index_t *) ctx.b);
+    return ret;
+}
+
+/**
+ * Compares two archives, and reports the members that were added, removed or changed from the first to the second.
+ *
+ * Each archive is indexed with a single pass over its headers, so a path appearing several times in an archive is
+ * compared for its last occurrence, and directories without a header of their own are not compared. The contents
+ * of two files of the same size are only read when their modification times differ, or with TAR_DIFF_CONTENT.
+ *
+ * @param fd_a A file descriptor pointing to the start of the first archive.
+ * @param fd_b A file descriptor pointing to the start of the second archive.
+ * @param flags TAR_DIFF_CONTENT to compare the contents of the files of the same size and modification time too.
+ * @param callback Called with each difference, in path order, with the member in each archive, NULL on the side it
+ *                 is missing from. Its uid, gid, chksum and header fields are not set.
+ * @param arg Passed to callback.
+ *
+ * @return the number of differences given to callback,
+ *         -1 if one of the archives could not be read or memory could not be allocated.
+ */
+ssize_t tar_diff(int fd_a, int fd_b, int flags, tar_diff_cb_t callback, void *arg) {
+    uint64_t start = stats_start();
+    ssize_t ret = diff(fd_a, fd_b, flags, callback, arg);
+    stats_stop(TAR_STATS_DIFF, start);
+    return ret;
 }
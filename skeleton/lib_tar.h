@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 typedef struct posix_header
 {                              /* byte offset */
@@ -43,9 +44,92 @@ typedef struct posix_header
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
 #define DIRTYPE  '5'            /* directory */
+#define XHDTYPE  'x'            /* PAX extended header of the next member */
+#define XGLTYPE  'g'            /* PAX extended header of every following member */
+#define GNUTYPE_LONGNAME 'L'    /* GNU long name of the next member */
+#define GNUTYPE_LONGLINK 'K'    /* GNU long link target of the next member */
 
-/* Converts an ASCII-encoded octal-based number into a regular integer */
-#define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
+/* Converts a numeric field of a header, an array of tar_header_t, into a regular integer */
+#define TAR_INT(field) tar_parse_number(field, sizeof(field))
+
+/* Functions timed by the statistics, indexes of tar_stats_t.calls and tar_stats_t.nanoseconds */
+#define TAR_STATS_CHECK 0           // check_archive() and check_archive_parallel()
+#define TAR_STATS_LOOKUP 1          // exists(), is_dir(), is_file() and is_symlink()
+#define TAR_STATS_LIST 2            // list()
+#define TAR_STATS_READ 3            // read_file()
+#define TAR_STATS_INDEX_BUILD 4     // tar_index_build()
+#define TAR_STATS_INDEX_LOAD 5      // tar_index_load()
+#define TAR_STATS_FIND 6            // tar_find() and tar_index_find()
+#define TAR_STATS_EXTRACT 7         // tar_extract()
+#define TAR_STATS_MANIFEST 8        // tar_manifest()
+#define TAR_STATS_REFRESH 9         // tar_refresh()
+#define TAR_STATS_DIFF 10           // tar_diff()
+#define TAR_STATS_FUNCTIONS 11
+
+/**
+ * Counters of the work done by the library, summed over every thread since the last tar_stats_reset().
+ */
+typedef struct tar_stats {
+    uint64_t headers;           // headers parsed
+    uint64_t preads;            // pread() and preadv() calls on the archives
+    uint64_t bytes_read;        // bytes returned by these calls
+    uint64_t index_hits;        // index lookups that found an entry
+    uint64_t index_misses;      // index lookups that did not
+    uint64_t link_hops;         // links followed to resolve a path
+    uint64_t cache_hits;        // blocks read from a block cache
+    uint64_t cache_misses;      // blocks read from the archive into a block cache
+    uint64_t calls[TAR_STATS_FUNCTIONS];        // calls of each timed function
+    uint64_t nanoseconds[TAR_STATS_FUNCTIONS];  // time spent in each timed function
+} tar_stats_t;
+
+/**
+ * Starts or stops counting.
+ *
+ * Counting is off by default, unless the library is compiled with TAR_STATS defined,
+ * and compiled out entirely when it is compiled with TAR_NO_STATS defined.
+ *
+ * @param enabled Non-zero to start counting, zero to stop.
+ */
+void tar_stats_enable(int enabled);
+
+/**
+ * Reads the counters.
+ *
+ * @param stats An out argument, set to the current value of the counters.
+ */
+void tar_stats_get(tar_stats_t *stats);
+
+/**
+ * Sets every counter to zero.
+ */
+void tar_stats_reset(void);
+
+/* Levels of the diagnostics given to the logger */
+#define TAR_LOG_ERROR 0             // a system call failed
+#define TAR_LOG_WARNING 1           // the archive is malformed
+#define TAR_LOG_DEBUG 2             // a call of the caller failed, or traces of the hot paths
+
+/**
+ * Receives the diagnostics of the library, one null-terminated message without newline at a time.
+ */
+typedef void (*tar_logger_t)(int level, const char *message, void *arg);
+
+/**
+ * Replaces the logger of the library.
+ *
+ * The library does not write to stdout or stderr by itself. By default its errors and warnings are given to
+ * tar_log_stderr(). This function must not be called while other threads are using the library.
+ *
+ * @param logger The new logger, NULL to discard every diagnostic.
+ * @param max_level The most verbose level given to the logger, the messages of the levels above are not even formatted.
+ * @param arg Passed to logger.
+ */
+void tar_set_logger(tar_logger_t logger, int max_level, void *arg);
+
+/**
+ * The default logger, writes each message on a line of stderr.
+ */
+void tar_log_stderr(int level, const char *message, void *arg);
 
 /**
  * Checks whether the archive is valid.
@@ -58,7 +142,7 @@ typedef struct posix_header
  * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
  *
  * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
+ *         -1 if the archive contains a header with an invalid magic value or a malformed size field,
  *         -2 if the archive contains a header with an invalid version value,
  *         -3 if the archive contains a header with an invalid checksum value
  */
@@ -153,4 +237,841 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/**
+ * Switches an archive to mmap mode.
+ *
+ * The archive is mapped once, and every function called with this file descriptor then reads the headers and
+ * the content of the files from the mapping instead of issuing pread() calls.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return zero if the archive was mapped or was already in mmap mode,
+ *         -1 if it could not be mapped.
+ */
+int tar_open_mmap(int tar_fd);
+
+/**
+ * Leaves mmap mode and unmaps the archive.
+ *
+ * Pointers returned by tar_file_view() for this archive are no longer valid afterwards,
+ * and no other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_mmap().
+ *
+ * @return zero if the archive was unmapped,
+ *         -1 if it was not in mmap mode.
+ */
+int tar_close_mmap(int tar_fd);
+
+/**
+ * Gives direct access to the content of a file of an archive in mmap mode, without copying it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file, in mmap mode.
+ * @param path A path to an entry in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param ptr An out argument, set to the first byte of the content of the file inside the mapping.
+ *            It stays valid until tar_close_mmap() is called.
+ * @param len An out argument, set to the size of the file.
+ *
+ * @return zero if ptr and len were set,
+ *         -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the archive is not in mmap mode.
+ */
+int tar_file_view(int tar_fd, char *path, const uint8_t **ptr, size_t *len);
+
+/**
+ * Switches a compressed archive to gzip mode.
+ *
+ * The archive is decompressed once to record checkpoints, and every function called with this file descriptor then
+ * reads the uncompressed archive, each read decompressing from the last checkpoint before it.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive compressed with gzip or zlib.
+ * @param span The distance between two checkpoints in the uncompressed archive, zero for the default of 1 MiB.
+ *             Each checkpoint takes 32 KiB of memory, and a read decompresses at most span bytes it does not return.
+ *
+ * @return zero if the checkpoints were recorded or the archive was already in gzip mode,
+ *         -1 if it is not compressed, is in mmap mode, or could not be read.
+ */
+int tar_open_gzip(int tar_fd, size_t span);
+
+/**
+ * Leaves gzip mode and frees the checkpoints of the archive.
+ *
+ * No other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_gzip().
+ *
+ * @return zero if the archive left gzip mode,
+ *         -1 if it was not in gzip mode.
+ */
+int tar_close_gzip(int tar_fd);
+
+/**
+ * Statistics of a block cache.
+ */
+typedef struct tar_cache_stats {
+    uint64_t hits;              // blocks read from the cache
+    uint64_t misses;            // blocks read from the archive into the cache
+    uint64_t evictions;         // blocks evicted to make room for others
+    size_t capacity;            // size of the cache in bytes
+} tar_cache_stats_t;
+
+/**
+ * Adds a block cache to an archive.
+ *
+ * The archive is then read by blocks kept in memory, the least recently used ones being evicted when the cache is
+ * full, so repeated reads of the same headers and files are served without system calls. In gzip mode the cache
+ * holds decompressed blocks, and must be removed before the archive leaves gzip mode. The archive must not be
+ * modified while it has a cache.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, not in mmap mode.
+ * @param capacity The size of the cache in bytes, zero for 64 MiB.
+ *
+ * @return zero if the archive has a cache or already had one,
+ *         -1 if it is in mmap mode or memory could not be allocated.
+ */
+int tar_open_cache(int tar_fd, size_t capacity);
+
+/**
+ * Removes the block cache of an archive and releases its memory.
+ *
+ * No other thread may be reading the archive through this file descriptor.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_cache().
+ *
+ * @return zero if the cache was removed,
+ *         -1 if the archive had no cache.
+ */
+int tar_close_cache(int tar_fd);
+
+/**
+ * Reads the statistics of the block cache of an archive.
+ *
+ * @param tar_fd A file descriptor previously given to tar_open_cache().
+ * @param stats An out argument, set to the statistics of the cache.
+ *
+ * @return zero if stats was set,
+ *         -1 if the archive has no cache.
+ */
+int tar_cache_stats(int tar_fd, tar_cache_stats_t *stats);
+
+/**
+ * A header decoded by tar_iter_next() or tar_decode_header().
+ */
+typedef struct tar_entry {
+    const char *name;           // null-terminated path of the entry
+    const char *linkname;       // null-terminated target of a link
+    char typeflag;
+    size_t size;                // size of the content of the entry
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime;
+    uint32_t chksum;            // checksum stored in the header
+    off_t offset;               // offset of the header in the archive
+    off_t data_offset;          // offset of the content of the entry in the archive
+    const tar_header_t *header; // raw header, read-only
+} tar_entry_t;
+
+/* Flags returned by tar_decode_header() for the malformed fields */
+#define TAR_FIELD_MODE 1
+#define TAR_FIELD_UID 2
+#define TAR_FIELD_GID 4
+#define TAR_FIELD_SIZE 8            // also set for a negative size
+#define TAR_FIELD_MTIME 16
+#define TAR_FIELD_CHKSUM 32
+
+/**
+ * Parses a numeric field of a header, without reading past its end even when it is not terminated.
+ *
+ * @param field The field, in octal or in base-256.
+ * @param len The size of the field.
+ *
+ * @return the value of the field, or of its digits preceding the first invalid byte if it is malformed.
+ */
+int64_t tar_parse_number(const char *field, size_t len);
+
+/**
+ * Decodes the type and the numeric fields of a header.
+ *
+ * The name, the link target and the offsets of entry are left unchanged,
+ * since they depend on the extended headers preceding the header and on its position in the archive.
+ *
+ * @param header The header to decode.
+ * @param entry An out argument, its typeflag, size, mode, uid, gid, mtime, chksum and header are set.
+ *
+ * @return zero if every field is well-formed,
+ *         otherwise the TAR_FIELD_* flags of the malformed fields, which are set to the value of their valid digits.
+ */
+int tar_decode_header(const tar_header_t *header, tar_entry_t *entry);
+
+/**
+ * A streaming scan of the headers of an archive.
+ */
+typedef struct tar_iter tar_iter_t;
+
+/**
+ * Starts a scan of the headers of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file.
+ *
+ * @return a pointer to the new iterator, to be released with tar_iter_close(),
+ *         NULL if memory could not be allocated.
+ */
+tar_iter_t *tar_iter_open(int tar_fd);
+
+/**
+ * Reads the next header of the archive.
+ *
+ * Every numeric field is parsed once, and the content of the entry is skipped without being read,
+ * unless it fits in the read-ahead buffer of the iterator. The PAX extended headers and GNU long names preceding
+ * a member are applied to it and are not returned as entries.
+ *
+ * @param iter An iterator returned by tar_iter_open().
+ * @param entry An out argument, set to the decoded header. Its pointers stay valid until the next call.
+ *
+ * @return 1 if entry was set,
+ *         zero if the end of the archive was reached,
+ *         -1 if the archive could not be read.
+ */
+int tar_iter_next(tar_iter_t *iter, tar_entry_t *entry);
+
+/**
+ * Releases an iterator returned by tar_iter_open().
+ *
+ * @param iter The iterator to release, may be NULL.
+ */
+void tar_iter_close(tar_iter_t *iter);
+
+/**
+ * Statistics of one of the threads of check_archive_parallel().
+ */
+typedef struct tar_check_stats {
+    size_t headers;             // number of headers verified by the thread
+    size_t bytes;               // number of bytes of headers verified by the thread
+    double seconds;             // time spent by the thread
+} tar_check_stats_t;
+
+/**
+ * Same as check_archive(), but the headers are verified by several threads.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param nb_threads The number of threads verifying the headers, zero or less to use one per online processor.
+ * @param stats An array of nb_threads statistics, one per thread, may be NULL.
+ *              When nb_threads is zero or less, it must hold one statistics per online processor.
+ *
+ * @return the same values as check_archive().
+ */
+int check_archive_parallel(int tar_fd, int nb_threads, tar_check_stats_t *stats);
+
+/**
+ * An in-memory index of a tar archive, built once by a single scan of its headers.
+ *
+ * The index maps the full path of every entry to the offset of its header, its type, its size and its linkname,
+ * so that the tar_index_* functions below can answer without reading any header from the archive again.
+ * The index keeps a copy of the file descriptor it was built from, the caller must keep it open until the index is freed.
+ * If a path appears several times in the archive, the last occurrence wins, as when the archive is extracted.
+ */
+typedef struct tar_index tar_index_t;
+
+/**
+ * Builds the index of an archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *
+ * @return a pointer to the new index, to be released with tar_index_free(),
+ *         NULL if the archive could not be read or memory could not be allocated.
+ */
+tar_index_t *tar_index_build(int tar_fd);
+
+/**
+ * Releases an index built by tar_index_build() or loaded by tar_index_load().
+ *
+ * @param index The index to release, may be NULL.
+ */
+void tar_index_free(tar_index_t *index);
+
+/**
+ * Returns the memory used by an index.
+ *
+ * @param index The index.
+ *
+ * @return the number of bytes allocated for the index, or mapped from its sidecar.
+ */
+size_t tar_index_memory(const tar_index_t *index);
+
+/**
+ * Same as exists(), but answered from the index.
+ */
+int tar_index_exists(tar_index_t *index, char *path);
+
+/**
+ * Same as is_dir(), but answered from the index.
+ */
+int tar_index_is_dir(tar_index_t *index, char *path);
+
+/**
+ * Same as is_file(), but answered from the index.
+ */
+int tar_index_is_file(tar_index_t *index, char *path);
+
+/**
+ * Same as is_symlink(), but answered from the index.
+ */
+int tar_index_is_symlink(tar_index_t *index, char *path);
+
+/**
+ * Same as list(), but answered from the index, in time proportional to the number of entries listed.
+ * The entries are listed sorted by name, whatever their order in the archive.
+ * The links given as path or among its directories are resolved, whatever the length of the chain.
+ */
+int tar_index_list(tar_index_t *index, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Lists the entries at a given path in the archive, by pages.
+ *
+ * The entries are listed sorted by name, starting at the position given by cursor, so that a large directory
+ * can be listed by successive calls without listing its first entries again.
+ * Directories that have no header of their own but contain entries of the archive are listed too, and can be listed.
+ *
+ * @param index The index of the archive.
+ * @param path A path to a directory in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param cursor An in-out argument.
+ *               The caller set it to the position of the first entry to list, zero to start from the beginning.
+ *               The callee set it to the position of the first entry that was not listed.
+ * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         1 if the last entry of the directory was listed,
+ *         2 if entries remain to be listed from the new cursor.
+ */
+int tar_index_list_from(tar_index_t *index, char *path, size_t *cursor, char **entries, size_t *no_entries);
+
+/**
+ * Same as read_file(), but the entry is located from the index, so only its content is read from the archive.
+ * The links given as path or among its directories are resolved, whatever the length of the chain.
+ */
+ssize_t tar_index_read_file(tar_index_t *index, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Saves an index to a sidecar file, that tar_index_load() maps back without reading the archive.
+ *
+ * The file is written under a temporary name then renamed, so that a process loading it concurrently
+ * sees either the previous sidecar or the new one.
+ *
+ * @param index The index of the archive.
+ * @param path The path of the sidecar file to write.
+ *
+ * @return zero if the sidecar was written,
+ *         -1 if the archive or the file could not be accessed.
+ */
+int tar_index_save(tar_index_t *index, const char *path);
+
+/**
+ * Loads an index saved by tar_index_save(), by mapping the sidecar file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of the archive the index was built from.
+ * @param path The path of the sidecar file.
+ *
+ * @return a pointer to the index, to be released with tar_index_free(),
+ *         NULL if the sidecar does not exist, is malformed, or was saved for another version of the archive.
+ */
+tar_index_t *tar_index_load(int tar_fd, const char *path);
+
+/**
+ * A reference-counted handle on an archive, that many threads can use at the same time.
+ *
+ * The index of the archive is built on first use and then shared, read-only, by every thread using the handle,
+ * so the tar_handle_* functions take no lock once it is built.
+ */
+typedef struct tar_handle tar_handle_t;
+
+/**
+ * Opens a shared handle on an archive, with a reference count of one.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ *               It must stay open until the last reference to the handle is released, the handle does not close it.
+ *
+ * @return a pointer to the new handle,
+ *         NULL if memory could not be allocated.
+ */
+tar_handle_t *tar_handle_open(int tar_fd);
+
+/**
+ * Adds a reference to a handle, for instance before giving it to another thread.
+ *
+ * @param handle The handle.
+ *
+ * @return the handle.
+ */
+tar_handle_t *tar_handle_retain(tar_handle_t *handle);
+
+/**
+ * Releases a reference to a handle, and frees it with its index when it was the last one.
+ *
+ * @param handle The handle, may be NULL.
+ */
+void tar_handle_release(tar_handle_t *handle);
+
+/**
+ * Same as exists(), thread-safe.
+ */
+int tar_handle_exists(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_dir(), thread-safe.
+ */
+int tar_handle_is_dir(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_file(), thread-safe.
+ */
+int tar_handle_is_file(tar_handle_t *handle, char *path);
+
+/**
+ * Same as is_symlink(), thread-safe.
+ */
+int tar_handle_is_symlink(tar_handle_t *handle, char *path);
+
+/**
+ * Same as tar_index_list(), thread-safe.
+ */
+int tar_handle_list(tar_handle_t *handle, char *path, char **entries, size_t *no_entries);
+
+/**
+ * Same as tar_index_read_file(), thread-safe.
+ */
+ssize_t tar_handle_read_file(tar_handle_t *handle, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Reads several files of an archive, located with an index, with as few system calls as possible.
+ *
+ * The reads are sorted by offset in the archive, and the contents of members that are close to each other
+ * are read by a single preadv() call.
+ *
+ * @param index The index of the archive.
+ * @param paths The paths of the files to read. Links are resolved.
+ * @param n The number of paths.
+ * @param iovecs An array of n in-out arguments.
+ *               The caller set iov_base to a destination buffer and iov_len to its size.
+ *               The callee set iov_len to the number of bytes written to the buffer, from the start of the file.
+ * @param results An array of n values set to what read_file() would return for each path with a zero offset,
+ *                may be NULL.
+ *
+ * @return the number of paths that are files of the archive.
+ */
+size_t tar_index_read_many(tar_index_t *index, char **paths, size_t n, struct iovec *iovecs, ssize_t *results);
+
+/**
+ * Same as tar_index_read_many(), but the paths are resolved by a single scan of the archive.
+ */
+size_t tar_read_many(int tar_fd, char **paths, size_t n, struct iovec *iovecs, ssize_t *results);
+
+/**
+ * A cursor on a file of an archive, that reads its content without scanning the archive again.
+ */
+typedef struct tar_file tar_file_t;
+
+#define TAR_FILE_SEQUENTIAL 1   // the file will be read sequentially, see posix_fadvise()
+#define TAR_FILE_READAHEAD  2   // prefetch the content ahead of the reads, see readahead()
+
+/**
+ * Opens a file of an archive for reading, locating it with a single scan.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to a file in the archive. If the entry is a link, it is resolved to its linked-to entry.
+ * @param flags Zero, or a combination of TAR_FILE_SEQUENTIAL and TAR_FILE_READAHEAD.
+ *
+ * @return a pointer to the new cursor, at the start of the file, to be released with tar_file_close(),
+ *         NULL if no entry at the given path exists in the archive, the entry is not a file,
+ *         or memory could not be allocated.
+ */
+tar_file_t *tar_file_open(int tar_fd, char *path, int flags);
+
+/**
+ * Same as tar_file_open(), but the file is located with an index.
+ */
+tar_file_t *tar_index_file_open(tar_index_t *index, char *path, int flags);
+
+/**
+ * Returns the size of a file opened with tar_file_open().
+ */
+size_t tar_file_size(tar_file_t *file);
+
+/**
+ * Reads from a given offset of a file, without moving the cursor.
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ * @param offset An offset in the file.
+ *
+ * @return the number of bytes written to dest, zero at the end of the file,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_file_pread(tar_file_t *file, uint8_t *dest, size_t len, size_t offset);
+
+/**
+ * Reads from the position of the cursor, and moves it past the bytes read.
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param dest A destination buffer.
+ * @param len The size of dest.
+ *
+ * @return the number of bytes written to dest, zero at the end of the file,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_file_read(tar_file_t *file, uint8_t *dest, size_t len);
+
+/**
+ * Moves the cursor, like lseek().
+ *
+ * @param file A cursor returned by tar_file_open().
+ * @param offset The new position, relative to whence.
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @return the new position from the start of the file,
+ *         -1 if whence is invalid or the new position would be negative.
+ */
+off_t tar_file_seek(tar_file_t *file, off_t offset, int whence);
+
+/**
+ * Releases a cursor returned by tar_file_open().
+ *
+ * @param file The cursor, may be NULL.
+ */
+void tar_file_close(tar_file_t *file);
+
+/**
+ * A writer, that adds members to an archive. A writer must not be used by several threads at the same time.
+ */
+typedef struct tar_writer tar_writer_t;
+
+/**
+ * The metadata of a member added by a writer.
+ */
+typedef struct tar_member_info {
+    uint32_t mode;              // permissions, the type bits are ignored
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime;              // in seconds since the epoch
+    const char *uname;          // may be NULL
+    const char *gname;          // may be NULL
+} tar_member_info_t;
+
+#define TAR_WRITER_APPEND 1
+
+/**
+ * Opens a writer on an archive.
+ *
+ * @param tar_fd A file descriptor open for writing, and for reading in append mode. It is not in mmap or gzip mode,
+ *               has no block cache, and the writer does not close it.
+ * @param flags Zero to write a new archive from the start of the file,
+ *              or TAR_WRITER_APPEND to add members after the last member of the valid archive in the file.
+ *
+ * @return a pointer to the new writer, to be released with tar_writer_close(),
+ *         NULL if memory could not be allocated or, in append mode, the archive could not be read.
+ */
+tar_writer_t *tar_writer_open(int tar_fd, int flags);
+
+/**
+ * Adds a file to the archive, with its content taken from a buffer.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive.
+ * @param data The content of the file.
+ * @param size The size of the file.
+ * @param info The metadata of the file, or NULL for a file of mode 0644 owned by root,
+ *             modified when the writer was opened.
+ *
+ * @return zero if the file was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_file(tar_writer_t *writer, const char *name, const void *data, size_t size,
+                        const tar_member_info_t *info);
+
+/**
+ * Adds a file to the archive, with its content copied from a file descriptor, by the kernel for large files.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the file in the archive.
+ * @param fd A file descriptor open for reading on a regular file, whose whole content is added.
+ * @param info The metadata of the file, or NULL to take them from fd.
+ *
+ * @return zero if the file was added,
+ *         -1 if fd could not be read or the archive could not be written.
+ */
+int tar_writer_add_file_fd(tar_writer_t *writer, const char *name, int fd, const tar_member_info_t *info);
+
+/**
+ * Adds a directory to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the directory in the archive, a "/" is added if it does not end with one.
+ * @param info The metadata of the directory, or NULL for a directory of mode 0755 owned by root.
+ *
+ * @return zero if the directory was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_dir(tar_writer_t *writer, const char *name, const tar_member_info_t *info);
+
+/**
+ * Adds a symlink to the archive.
+ *
+ * @param writer A writer returned by tar_writer_open().
+ * @param name The path of the symlink in the archive.
+ * @param target The path the symlink points to, relative to the directory of the symlink.
+ * @param info The metadata of the symlink, or NULL for a symlink owned by root.
+ *
+ * @return zero if the symlink was added,
+ *         -1 if the archive could not be written.
+ */
+int tar_writer_add_symlink(tar_writer_t *writer, const char *name, const char *target, const tar_member_info_t *info);
+
+/**
+ * Writes the end-of-archive marker and releases a writer.
+ *
+ * @param writer A writer returned by tar_writer_open(), may be NULL.
+ *
+ * @return zero if the whole archive was written,
+ *         -1 if a write failed since the writer was opened.
+ */
+int tar_writer_close(tar_writer_t *writer);
+
+typedef struct tar_extract_options {
+    int nb_threads;     // number of threads writing the files, zero or less for one per online processor
+    int flags;
+} tar_extract_options_t;
+
+#define TAR_EXTRACT_NO_MODE 1   // leaves the permissions of the extracted members as created
+#define TAR_EXTRACT_NO_MTIME 2  // leaves the modification times of the extracted members as created
+
+/**
+ * Extracts an archive to a directory.
+ *
+ * Only regular files, directories, hard links and symlinks are extracted. A member whose path is absolute or contains
+ * a ".." is not extracted, and a hard link pointing to such a path neither. When a path appears several times in the
+ * archive, its last occurrence is extracted.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param dest_dir The directory to extract to, created if it does not exist.
+ * @param options The number of threads writing the files, zero or less to use one per online processor, and
+ *                TAR_EXTRACT_NO_MODE or TAR_EXTRACT_NO_MTIME to leave the permissions or the times as created,
+ *                may be NULL.
+ *
+ * @return zero if every member was extracted,
+ *         -1 if the archive could not be read or the destination could not be opened,
+ *         otherwise the number of members that could not be extracted.
+ */
+int tar_extract(int tar_fd, const char *dest_dir, const tar_extract_options_t *options);
+
+/**
+ * Called by tar_find() with each matching member, returns non-zero to stop the search.
+ */
+typedef int (*tar_find_cb_t)(const tar_entry_t *entry, void *arg);
+
+#define TAR_FIND_FILES 1    // regular files
+#define TAR_FIND_DIRS 2     // directories
+#define TAR_FIND_LINKS 4    // hard links and symlinks
+
+/**
+ * Finds the members of an archive whose path matches a glob pattern, with a single scan.
+ *
+ * The pattern is matched against the whole path of each member with fnmatch(), where '*' also matches '/': the
+ * pattern "lib/" followed by "*.so" selects every ".so" under "lib/" at any depth, and "assets/2024/" followed by "*"
+ * everything under "assets/2024/".
+ * The names of the directories end with a '/'. Links are not followed, and a path that appears several times in the
+ * archive is reported for each occurrence.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param pattern A glob pattern.
+ * @param types A combination of TAR_FIND_FILES, TAR_FIND_DIRS and TAR_FIND_LINKS, zero for members of any type.
+ * @param callback Called with each matching member, in archive order. The entry stays valid until it returns.
+ *                 A non-zero return value stops the search.
+ * @param arg Passed to callback.
+ *
+ * @return the number of members given to callback,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_find(int tar_fd, const char *pattern, int types, tar_find_cb_t callback, void *arg);
+
+/**
+ * Same as tar_find(), but answered from the index, without reading the archive.
+ *
+ * The members are given to callback sorted by name within each directory, parents before their children, and a path
+ * that appears several times in the archive is reported once, for its last occurrence. The uid, gid, chksum and
+ * header fields of the entries are not set, and directories without a header of their own are not reported.
+ */
+ssize_t tar_index_find(tar_index_t *index, const char *pattern, int types, tar_find_cb_t callback, void *arg);
+
+/* Algorithms of tar_manifest() */
+#define TAR_DIGEST_SHA256 0     // SHA-256, as printed by sha256sum
+#define TAR_DIGEST_XXH64 1      // XXH64 with a seed of zero, as printed by xxhsum, not cryptographic
+
+/**
+ * Writes a manifest of an archive, one line per member: its digest, its type, its size, its permissions in octal and
+ * its path, followed by " -> " and the target for links.
+ *
+ * The headers are read once, and the contents of the regular files are hashed by several threads. The members are
+ * listed parents before their children, sorted by name, and a path appearing several times in the archive is listed
+ * once, for its last occurrence. The digest of a member which is not a regular file, or whose content could not be
+ * read, is "-".
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param algorithm TAR_DIGEST_SHA256 or TAR_DIGEST_XXH64.
+ * @param nb_threads The number of threads hashing the files, zero or less to use one per online processor.
+ * @param out The stream the manifest is written to.
+ *
+ * @return zero if every file was hashed,
+ *         -1 if the archive could not be read or the algorithm is unknown, nothing was written,
+ *         -2 if the manifest could not be written,
+ *         otherwise the number of files whose content could not be read.
+ */
+int tar_manifest(int tar_fd, int algorithm, int nb_threads, FILE *out);
+
+/**
+ * A context reading the members of an archive without blocking its caller.
+ */
+typedef struct tar_async tar_async_t;
+
+/**
+ * Receives the result of an asynchronous request.
+ *
+ * @param ret The return value of the synchronous function.
+ * @param len The number of bytes read, or of entries listed.
+ * @param arg The argument given with the request.
+ */
+typedef void (*tar_async_cb_t)(ssize_t ret, size_t len, void *arg);
+
+/* Flags of tar_async_open() */
+#define TAR_ASYNC_NO_URING 1        // run every request in the threads, even when io_uring is available
+
+/**
+ * Starts reading the members of an archive asynchronously.
+ *
+ * A context must only be used by one thread at a time, typically an event loop.
+ *
+ * @param handle A handle on the archive, which the context retains until it is closed.
+ * @param nb_threads The number of threads running the requests that cannot go through io_uring,
+ *                   zero or less to use one per online processor.
+ * @param flags TAR_ASYNC_NO_URING to run every request in the threads.
+ *
+ * @return a pointer to the new context, to be released with tar_async_close(),
+ *         NULL if it could not be created.
+ */
+tar_async_t *tar_async_open(tar_handle_t *handle, int nb_threads, int flags);
+
+/**
+ * Returns the eventfd of a context, which becomes readable when callbacks are ready to run.
+ *
+ * @param ctx A context returned by tar_async_open().
+ *
+ * @return the file descriptor, to watch with poll() or epoll but not to read nor close.
+ */
+int tar_async_fd(tar_async_t *ctx);
+
+/**
+ * Starts reading a file of an archive, like tar_handle_read_file().
+ *
+ * @param ctx A context returned by tar_async_open().
+ * @param path A path to the file, links are resolved.
+ * @param offset An offset in the file from which to start reading, zero indicating the start of the file.
+ * @param dest A destination buffer of len bytes, which must stay valid until the callback is run.
+ * @param len The size of dest.
+ * @param callback Run by tar_async_poll() with the return value of tar_handle_read_file() and the number of bytes read.
+ * @param arg Passed to callback.
+ *
+ * @return zero if the read was started,
+ *         -1 if memory could not be allocated, callback will not be run.
+ */
+int tar_async_read_file(tar_async_t *ctx, const char *path, size_t offset, uint8_t *dest, size_t len,
+                        tar_async_cb_t callback, void *arg);
+
+/**
+ * Starts listing a directory of an archive, like tar_handle_list().
+ *
+ * @param ctx A context returned by tar_async_open().
+ * @param path A path to the directory, links are resolved.
+ * @param entries An array of no_entries buffers of at least PATH_MAX bytes, which must stay valid until the
+ *                callback is run.
+ * @param no_entries The number of buffers of entries.
+ * @param callback Run by tar_async_poll() with the return value of tar_handle_list() and the number of entries listed.
+ * @param arg Passed to callback.
+ *
+ * @return zero if the listing was started,
+ *         -1 if memory could not be allocated, callback will not be run.
+ */
+int tar_async_list(tar_async_t *ctx, const char *path, char **entries, size_t no_entries,
+                   tar_async_cb_t callback, void *arg);
+
+/**
+ * Runs the callbacks of the requests that completed.
+ *
+ * @param ctx A context returned by tar_async_open().
+ * @param wait Non-zero to wait for a request to complete when none did and some are in flight.
+ *
+ * @return the number of callbacks run.
+ */
+int tar_async_poll(tar_async_t *ctx, int wait);
+
+/**
+ * Waits for the requests in flight, runs their callbacks, then releases a context.
+ *
+ * @param ctx A context returned by tar_async_open(), may be NULL.
+ */
+void tar_async_close(tar_async_t *ctx);
+
+/**
+ * Validates and indexes the members appended to an archive since it was last checked and indexed.
+ *
+ * The headers are verified from the end of the archive found by the last successful check_archive(),
+ * check_archive_parallel() or tar_refresh() on tar_fd, or from the start of the archive when it was not checked yet
+ * or was rewritten since. The members are added to the index from the end of its last member, or the index is
+ * rebuilt from the start of the archive when the archive was rewritten since it was last checked. An archive in mmap
+ * mode or with a block cache must be reopened in that mode first, to see the appended bytes.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ * @param index The index of the archive, built by tar_index_build() or loaded by tar_index_load(), may be NULL.
+ *              No other thread may be using it.
+ *
+ * @return the same values as check_archive() for the whole archive,
+ *         -4 if the index could not be updated, it must then be freed.
+ */
+int tar_refresh(int tar_fd, tar_index_t *index);
+
+/* Kinds of differences reported by tar_diff() */
+#define TAR_DIFF_ADDED 1        // only in the second archive
+#define TAR_DIFF_REMOVED 2      // only in the first archive
+#define TAR_DIFF_MODIFIED 3     // different content, permissions or link target
+#define TAR_DIFF_TYPE 4         // different type, a file replaced by a directory for instance
+
+/* Flags of tar_diff() */
+#define TAR_DIFF_CONTENT 1      // compare the contents of the files whose size and modification time are the same
+
+/**
+ * Called by tar_diff() with each difference, returns non-zero to stop the comparison.
+ */
+typedef int (*tar_diff_cb_t)(int kind, const tar_entry_t *a, const tar_entry_t *b, void *arg);
+
+/**
+ * Compares two archives, and reports the members that were added, removed or changed from the first to the second.
+ *
+ * Each archive is indexed with a single pass over its headers, so a path appearing several times in an archive is
+ * compared for its last occurrence, and directories without a header of their own are not compared. The contents
+ * of two files of the same size are only read when their modification times differ, or with TAR_DIFF_CONTENT.
+ *
+ * @param fd_a A file descriptor pointing to the start of the first archive.
+ * @param fd_b A file descriptor pointing to the start of the second archive.
+ * @param flags TAR_DIFF_CONTENT to compare the contents of the files of the same size and modification time too.
+ * @param callback Called with each difference, in path order, with the member in each archive, NULL on the side it
+ *                 is missing from. Its uid, gid, chksum and header fields are not set.
+ * @param arg Passed to callback.
+ *
+ * @return the number of differences given to callback,
+ *         -1 if one of the archives could not be read or memory could not be allocated.
+ */
+ssize_t tar_diff(int fd_a, int fd_b, int flags, tar_diff_cb_t callback, void *arg);
+
 #endif
@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <zlib.h>
 
 #include "lib_tar.h"
 
@@ -24,6 +25,27 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+/* counts the messages of the library */
+void count_message(int level, const char *message, void *arg) {
+    (*(int *) arg)++;
+}
+
+/* counts the entries found by tar_find() */
+int count_entry(const tar_entry_t *entry, void *arg) {
+    (*(int *) arg)++;
+    return 0;
+}
+
+/* prints the result of an asynchronous request */
+void print_async(ssize_t ret, size_t len, void *arg) {
+    printf("%s completed with %ld, %ld bytes or entries\n", (char *) arg, ret, len);
+}
+
+int print_diff(int kind, const tar_entry_t *a, const tar_entry_t *b, void *arg) {
+    printf("difference %d at %s\n", kind, a != NULL ? a->name : b->name);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printf("Usage: %s tar_file\n", argv[0]);
@@ -40,6 +62,14 @@ int main(int argc, char **argv) {
     printf("check_archive returned %d\n", ret);
     printf("should have returned : 0\n\n");
 
+    tar_check_stats_t stats[4];
+    ret = check_archive_parallel(fd, 4, stats);
+    printf("check_archive_parallel returned %d\n", ret);
+    for (int i = 0; i < 4; i++){
+        printf("thread %d verified %ld headers in %f s\n", i, stats[i].headers, stats[i].seconds);
+    }
+    printf("should have returned the same as check_archive\n\n");
+
     /*
 
     ret = exists(fd, "dir1/folder1/file1.txt");
@@ -84,6 +114,426 @@ int main(int argc, char **argv) {
         free(entries[i]);
     }
 
+    tar_stats_t counters;
+    tar_stats_enable(1);
+    tar_stats_reset();
+    ret = exists(fd, "dir1/c/d");
+    tar_stats_get(&counters);
+    tar_stats_enable(0);
+    printf("exists returned %d, parsed %ld headers with %ld pread calls, %ld call timed\n", ret,
+           counters.headers, counters.preads, counters.calls[TAR_STATS_LOOKUP]);
+    printf("should have returned : 1, parsed 4 headers with 1 pread calls, 1 call timed\n\n");
+
+    int nb_messages = 0;
+    tar_set_logger(count_message, TAR_LOG_DEBUG, &nb_messages);
+    size_t missing_len = 0;
+    read_file(fd, "nothing", 0, NULL, &missing_len);
+    tar_set_logger(tar_log_stderr, TAR_LOG_WARNING, NULL);
+    printf("read_file on a missing file logged %d messages\n", nb_messages);
+    printf("should have returned : 2\n\n");
+
+    tar_iter_t *iter = tar_iter_open(fd);
+    tar_entry_t entry;
+    int nb_entries = 0;
+    size_t total_size = 0;
+    while (tar_iter_next(iter, &entry) > 0){
+        nb_entries++;
+        total_size += entry.size;
+    }
+    tar_iter_close(iter);
+    printf("tar_iter_next returned %d entries, %ld bytes\n", nb_entries, total_size);
+    printf("should have returned : 13 entries, 5612 bytes\n\n");
+
+    tar_index_t *index = tar_index_build(fd);
+    printf("tar_index_build returned %s\n", index ? "an index" : "NULL");
+    ret = tar_index_exists(index, "dir1/c/d");
+    printf("tar_index_exists returned %d\n", ret);
+    ret = tar_index_is_dir(index, "dir1/");
+    printf("tar_index_is_dir returned %d\n", ret);
+    ret = tar_index_is_file(index, "dir1/");
+    printf("tar_index_is_file returned %d\n", ret);
+    ret = tar_index_is_symlink(index, "testlinktofile");
+    printf("tar_index_is_symlink returned %d\n", ret);
+    printf("should have returned : an index, 1, 1, 0, 1\n\n");
+
+    len = 100;
+    for (int i = 0; i < 100; i++){
+        entries[i] = malloc(100);
+    }
+    ret = tar_index_list(index, "dir2", entries, &len);
+    printf("tar_index_list returned %d\n", ret);
+    printf("should have returned : 1\n");
+    for (int i = 0; i < len; i++){
+        printf("%s\n", entries[i]);
+    }
+    printf("should have listed : dir1/a, dir1/b, dir1/c/\n\n");
+
+    size_t cursor = 1;
+    len = 1;
+    ret = tar_index_list_from(index, "dir1/", &cursor, entries, &len);
+    printf("tar_index_list_from returned %d, listed %s, cursor %ld\n", ret, entries[0], cursor);
+    len = 5;
+    ret = tar_index_list_from(index, "dir1/", &cursor, entries, &len);
+    printf("tar_index_list_from returned %d, listed %ld entries, cursor %ld\n", ret, len, cursor);
+    printf("should have returned : 2 with dir1/b and cursor 2, then 1 with 1 entry and cursor 3\n\n");
+    for (int i = 0; i < 100; i++){
+        free(entries[i]);
+    }
+
+    uint8_t content[100];
+    size_t content_len = 4;
+    ssize_t remaining = tar_index_read_file(index, "fichier1", 2, content, &content_len);
+    printf("tar_index_read_file returned %ld, read %ld bytes\n", remaining, content_len);
+    printf("should have returned : 14, read 4 bytes\n\n");
+
+    content_len = 100;
+    remaining = tar_index_read_file(index, "./dir2/c/../c/d", 0, content, &content_len);
+    printf("tar_index_read_file through a symlinked directory returned %ld, read %ld bytes\n", remaining, content_len);
+    printf("should have returned : 0, read 18 bytes\n\n");
+
+    int nb_found = 0;
+    ssize_t found = tar_find(fd, "dir1/*", TAR_FIND_FILES, count_entry, &nb_found);
+    printf("tar_find returned %ld, %d entries\n", found, nb_found);
+    nb_found = 0;
+    found = tar_index_find(index, "dir1/*/", TAR_FIND_DIRS, count_entry, &nb_found);
+    printf("tar_index_find returned %ld, %d entries\n", found, nb_found);
+    found = tar_index_find(index, "*fichier?", 0, count_entry, &nb_found);
+    printf("tar_index_find returned %ld\n", found);
+    printf("should have returned : 3, 3 entries, then 1, 1 entries, then 4\n\n");
+
+    ret = tar_index_save(index, "tests.idx");
+    printf("tar_index_save returned %d\n", ret);
+    tar_index_free(index);
+    index = tar_index_load(fd, "tests.idx");
+    printf("tar_index_load returned %s\n", index ? "an index" : "NULL");
+    ret = tar_index_is_dir(index, "dir1/c/");
+    printf("tar_index_is_dir on the loaded index returned %d\n", ret);
+    tar_index_free(index);
+    int idx_fd = open("tests.idx", O_WRONLY);
+    uint32_t bad_slot = UINT32_MAX;
+    pwrite(idx_fd, &bad_slot, sizeof(bad_slot), lseek(idx_fd, 0, SEEK_END) - sizeof(bad_slot));//the last slot
+    close(idx_fd);
+    index = tar_index_load(fd, "tests.idx");
+    printf("tar_index_load of a corrupted sidecar returned %s\n", index ? "an index" : "NULL");
+    unlink("tests.idx");
+    printf("should have returned : 0, an index, 1, NULL\n\n");
+    tar_index_free(index);
+
+    char *paths[] = {"fichier5", "nothing", "testlinktofile", "dir1/c/d", "fichier1"};
+    uint8_t buffers[5][30];
+    struct iovec iovecs[5];
+    ssize_t results[5];
+    for (int i = 0; i < 5; i++){
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = sizeof(buffers[i]);
+    }
+    size_t nb_read = tar_read_many(fd, paths, 5, iovecs, results);
+    printf("tar_read_many returned %ld\n", nb_read);
+    for (int i = 0; i < 5; i++){
+        printf("%s: %ld, read %ld bytes\n", paths[i], results[i], iovecs[i].iov_len);
+    }
+    printf("should have returned : 4, with 2755 and 30 bytes, -1 and 0, 0 and 0, 0 and 18, 0 and 20\n\n");
+
+    tar_file_t *file = tar_file_open(fd, "fichier5", TAR_FILE_SEQUENTIAL | TAR_FILE_READAHEAD);
+    size_t total = 0;
+    ssize_t chunk = -1;
+    while (file != NULL && (chunk = tar_file_read(file, content, sizeof(content))) > 0){
+        total += chunk;
+    }
+    if (file != NULL){
+        tar_file_seek(file, -5, SEEK_END);
+        chunk = tar_file_read(file, content, sizeof(content));
+    }
+    printf("tar_file_read read %ld bytes in total, then %ld bytes from the end\n", total, chunk);
+    tar_file_close(file);
+    printf("should have returned : 2785 bytes, then 5 bytes\n\n");
+
+    tar_handle_t *handle = tar_handle_open(fd);
+    tar_handle_t *shared = tar_handle_retain(handle);
+    tar_handle_release(handle);
+    ret = tar_handle_is_file(shared, "notempty/fichier5");
+    printf("tar_handle_is_file returned %d\n", ret);
+    content_len = 100;
+    remaining = tar_handle_read_file(shared, "testlinktofile", 0, content, &content_len);
+    printf("tar_handle_read_file returned %ld, read %ld bytes\n", remaining, content_len);
+    tar_handle_release(shared);
+    printf("should have returned : 1, 0 and 0 bytes\n\n");
+
+    ret = tar_open_mmap(fd);
+    printf("tar_open_mmap returned %d\n", ret);
+    ret = check_archive(fd);
+    printf("check_archive in mmap mode returned %d\n", ret);
+    const uint8_t *view;
+    size_t view_len;
+    ret = tar_file_view(fd, "fichier1", &view, &view_len);
+    printf("tar_file_view returned %d, viewed %ld bytes\n", ret, view_len);
+    ret = tar_close_mmap(fd);
+    printf("tar_close_mmap returned %d\n", ret);
+    ret = tar_file_view(fd, "fichier1", &view, &view_len);
+    printf("tar_file_view returned %d\n", ret);
+    printf("should have returned : 0, 13, 0 and 20 bytes, 0, -2\n\n");
+
+    ret = tar_open_cache(fd, 1 << 20);
+    printf("tar_open_cache returned %d\n", ret);
+    content_len = 100;
+    remaining = read_file(fd, "dir1/c/d", 0, content, &content_len);
+    content_len = 100;
+    remaining = read_file(fd, "dir1/c/d", 0, content, &content_len);
+    printf("read_file through the cache returned %ld, read %ld bytes\n", remaining, content_len);
+    tar_cache_stats_t cache_stats;
+    ret = tar_cache_stats(fd, &cache_stats);
+    printf("tar_cache_stats returned %d, %ld misses, %ld hits\n", ret, cache_stats.misses, cache_stats.hits);
+    ret = tar_close_cache(fd);
+    printf("tar_close_cache returned %d\n", ret);
+    printf("should have returned : 0, 0 and 18 bytes, 0 with 2 misses and 4 hits, 0\n\n");
+
+    uint8_t copy[4096];
+    gzFile gz_file = gzopen("tests.tar.gz", "wb");
+    ssize_t copied;
+    for (off_t offset = 0; (copied = pread(fd, copy, sizeof(copy), offset)) > 0; offset += copied){
+        gzwrite(gz_file, copy, copied);
+    }
+    gzclose(gz_file);
+    int gz_fd = open("tests.tar.gz", O_RDONLY);
+    ret = tar_open_gzip(gz_fd, 0);
+    printf("tar_open_gzip returned %d\n", ret);
+    ret = check_archive(gz_fd);
+    printf("check_archive in gzip mode returned %d\n", ret);
+    content_len = 100;
+    remaining = read_file(gz_fd, "testlinktofile", 0, content, &content_len);
+    printf("read_file in gzip mode returned %ld, read %ld bytes\n", remaining, content_len);
+    ret = tar_close_gzip(gz_fd);
+    printf("tar_close_gzip returned %d\n", ret);
+    close(gz_fd);
+    unlink("tests.tar.gz");
+    printf("should have returned : 0, 13, 0 and 0 bytes, 0\n\n");
+
+    unlink("tests.tar.gz");//one gzip member per KiB of the archive
+    for (off_t offset = 0; (copied = pread(fd, copy, 1024, offset)) > 0; offset += copied){
+        gz_file = gzopen("tests.tar.gz", "ab");
+        gzwrite(gz_file, copy, copied);
+        gzclose(gz_file);
+    }
+    gz_fd = open("tests.tar.gz", O_RDONLY);
+    ret = tar_open_gzip(gz_fd, 0);
+    printf("tar_open_gzip on a stream of several members returned %d\n", ret);
+    ret = check_archive(gz_fd);
+    printf("check_archive in gzip mode returned %d\n", ret);
+    content_len = 100;
+    remaining = read_file(gz_fd, "fichier1", 0, content, &content_len);
+    printf("read_file in gzip mode returned %ld, read %ld bytes\n", remaining, content_len);
+    tar_close_gzip(gz_fd);
+    close(gz_fd);
+    unlink("tests.tar.gz");
+    printf("should have returned : 0, 13, 0 and 20 bytes\n\n");
+
+    int out_fd = open("tests_writer.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_dir(writer, "out", NULL);
+    tar_writer_add_file(writer, "out/hello", "hello\n", 6, NULL);
+    tar_writer_add_symlink(writer, "out/link", "hello", NULL);
+    ret = tar_writer_close(writer);
+    printf("tar_writer_close returned %d\n", ret);
+    writer = tar_writer_open(out_fd, TAR_WRITER_APPEND);
+    ret = tar_writer_add_file_fd(writer, "out/archive.tar", fd, NULL);
+    printf("tar_writer_add_file_fd returned %d\n", ret);
+    tar_writer_close(writer);
+    ret = check_archive(out_fd);
+    printf("check_archive on the written archive returned %d\n", ret);
+    content_len = 100;
+    remaining = read_file(out_fd, "out/link", 0, content, &content_len);
+    printf("read_file on the written archive returned %ld, read %ld bytes\n", remaining, content_len);
+    close(out_fd);
+    unlink("tests_writer.tar");
+    printf("should have returned : 0, 0, 4, 0 and 6 bytes\n\n");
+
+    out_fd = open("tests_twice.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, "twice", "one\n", 4, NULL);
+    tar_writer_close(writer);
+    writer = tar_writer_open(out_fd, TAR_WRITER_APPEND);
+    tar_writer_add_file(writer, "twice", "second\n", 7, NULL);
+    tar_writer_close(writer);
+    content_len = 100;
+    read_file(out_fd, "twice", 0, content, &content_len);
+    printf("read_file of a path written twice read %.*s", (int) content_len, content);
+    index = tar_index_build(out_fd);
+    content_len = 100;
+    tar_index_read_file(index, "twice", 0, content, &content_len);
+    printf("tar_index_read_file of a path written twice read %.*s", (int) content_len, content);
+    tar_index_free(index);
+    close(out_fd);
+    unlink("tests_twice.tar");
+    printf("should have returned : second, second\n\n");
+
+    char long_name[300];
+    memset(long_name, 'n', sizeof(long_name));
+    strcpy(long_name + 250, "/long_directory_name/file");
+    out_fd = open("tests_long.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, long_name, "long\n", 5, NULL);
+    tar_writer_add_file(writer, long_name + 150, "prefix\n", 7, NULL);
+    tar_writer_close(writer);
+    ret = check_archive(out_fd);
+    printf("check_archive on the archive with long names returned %d\n", ret);
+    content_len = 100;
+    remaining = read_file(out_fd, long_name, 0, content, &content_len);
+    printf("read_file of a %ld bytes name returned %ld, read %ld bytes\n", strlen(long_name), remaining, content_len);
+    ret = is_file(out_fd, long_name + 150);
+    printf("is_file of a name split in the prefix field returned %d\n", ret);
+    close(out_fd);
+    unlink("tests_long.tar");
+    printf("should have returned : 3, 0 and 5 bytes, 1\n\n");
+
+    char *padding = calloc(1, 2 * 64512);//the extended header of the second member ends the first 64 KiB read
+    out_fd = open("tests_long.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, "padding", padding, 64512, NULL);
+    tar_writer_add_file(writer, long_name, "long\n", 5, NULL);
+    tar_writer_add_file(writer, "after", padding, 2 * 64512, NULL);//overwrites the buffer where the header was
+    tar_writer_close(writer);
+    free(padding);
+    content_len = 100;
+    remaining = read_file(out_fd, long_name, 0, content, &content_len);
+    printf("read_file of a long name whose extended header crosses a read returned %ld, read %ld bytes\n", remaining,
+           content_len);
+    close(out_fd);
+    unlink("tests_long.tar");
+    printf("should have returned : 0 and 5 bytes\n\n");
+
+    size_t large_len = 2 << 20;
+    char *large = calloc(1, large_len);
+    out_fd = open("tests_large.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    for (int i = 0; i < 4; i++) tar_writer_add_file(writer, i % 2 ? "large1" : "large0", large, large_len, NULL);
+    tar_writer_close(writer);
+    free(large);
+    tar_stats_enable(1);
+    tar_stats_reset();
+    ret = check_archive(out_fd);
+    tar_stats_get(&counters);
+    tar_stats_enable(0);
+    printf("check_archive on members of 2 MiB returned %d, read %ld bytes\n", ret, counters.bytes_read);
+    close(out_fd);
+    unlink("tests_large.tar");
+    printf("should have returned : 4, less than 100000 bytes\n\n");
+
+    tar_extract_options_t options = {.nb_threads = 2, .flags = 0};
+    ret = tar_extract(fd, "tests_extract", &options);
+    printf("tar_extract returned %d\n", ret);
+    struct stat extracted;
+    ret = stat("tests_extract/dir1/c/d", &extracted);
+    printf("stat on an extracted file returned %d, %ld bytes\n", ret, extracted.st_size);
+    ret = stat("tests_extract/dir2/c/d", &extracted);
+    printf("stat through an extracted symlink returned %d, %ld bytes\n", ret, extracted.st_size);
+    system("rm -rf tests_extract");
+    printf("should have returned : 0, 0 and 18 bytes, 0 and 18 bytes\n\n");
+
+    tar_header_t fields;
+    tar_entry_t decoded;
+    memset(&fields, 0, sizeof(fields));
+    memcpy(fields.size, "000000001750", sizeof(fields.size));//not terminated
+    memcpy(fields.mode, "0000644", 8);
+    memcpy(fields.uid, "00017x5", 8);
+    ret = tar_decode_header(&fields, &decoded);
+    printf("tar_decode_header returned %d, size %ld, mode %o, uid %o\n", ret, decoded.size, decoded.mode, decoded.uid);
+    printf("TAR_INT of the size field returned %ld\n", (long) TAR_INT(fields.size));
+    printf("should have returned : 2, size 1000, mode 644, uid 17, 1000\n\n");
+
+    out_fd = open("tests_text.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    memset(content, 'x', sizeof(content));
+    for (int i = 0; i < 8; i++) write(out_fd, content, sizeof(content));
+    ret = check_archive(out_fd);
+    int parallel_ret = check_archive_parallel(out_fd, 2, NULL);
+    printf("check_archive on a file that is not an archive returned %d, in parallel %d\n", ret, parallel_ret);
+    close(out_fd);
+    unlink("tests_text.tar");
+    out_fd = open("tests_size.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, "first", "first\n", 6, NULL);
+    tar_writer_add_file(writer, "second", "second\n", 7, NULL);
+    tar_writer_close(writer);
+    tar_header_t corrupted;
+    pread(out_fd, &corrupted, sizeof(corrupted), 2 * 512);
+    memcpy(corrupted.size, "zz", 2);
+    pwrite(out_fd, &corrupted, sizeof(corrupted), 2 * 512);
+    ret = check_archive(out_fd);
+    parallel_ret = check_archive_parallel(out_fd, 2, NULL);
+    printf("check_archive with a corrupted size field returned %d, in parallel %d\n", ret, parallel_ret);
+    unsigned int sum = 0;//the same header with a matching checksum
+    memset(corrupted.chksum, ' ', sizeof(corrupted.chksum));
+    for (size_t i = 0; i < sizeof(corrupted); i++) sum += ((uint8_t *) &corrupted)[i];
+    snprintf(corrupted.chksum, sizeof(corrupted.chksum), "%06o", sum);
+    pwrite(out_fd, &corrupted, sizeof(corrupted), 2 * 512);
+    ret = check_archive(out_fd);
+    parallel_ret = check_archive_parallel(out_fd, 2, NULL);
+    printf("check_archive with a malformed size field returned %d, in parallel %d\n", ret, parallel_ret);
+    close(out_fd);
+    unlink("tests_size.tar");
+    printf("should have returned : -1 and -1, -3 and -3, -1 and -1\n\n");
+
+    handle = tar_handle_open(fd);
+    tar_async_t *async = tar_async_open(handle, 2, 0);
+    tar_handle_release(handle);
+    tar_async_read_file(async, "fichier1", 0, content, 100, print_async, "tar_async_read_file before the index");
+    while (tar_async_poll(async, 1) == 0);
+    tar_async_read_file(async, "notempty/fichier5", 0, content, 100, print_async, "tar_async_read_file");
+    tar_async_read_file(async, "missing", 0, content, 100, print_async, "tar_async_read_file of a missing file");
+    while (tar_async_poll(async, 1) < 2);
+    tar_async_close(async);
+    printf("should have returned : 0 and 20 bytes, -1 and 0 bytes, 2685 and 100 bytes\n\n");
+
+    char *manifest;
+    size_t manifest_len;
+    FILE *manifest_out = open_memstream(&manifest, &manifest_len);
+    ret = tar_manifest(fd, TAR_DIGEST_XXH64, 2, manifest_out);
+    fclose(manifest_out);
+    int nb_lines = 0;
+    for (size_t i = 0; i < manifest_len; i++) nb_lines += manifest[i] == '\n';
+    printf("tar_manifest returned %d, wrote %d lines, starting with\n%.*s", ret, nb_lines,
+           (int) (strchr(manifest, '\n') + 1 - manifest), manifest);
+    free(manifest);
+    printf("should have returned : 0, 13 lines\n\n");
+
+    index = tar_index_build(fd);
+    ret = check_archive(fd);
+    tar_stats_enable(1);
+    tar_stats_reset();
+    int refreshed = tar_refresh(fd, index);
+    tar_stats_get(&counters);
+    tar_stats_enable(0);
+    printf("tar_refresh after check_archive returned %d (check_archive returned %d), parsed %ld headers\n", refreshed,
+           ret, counters.headers);
+    ret = tar_index_is_file(index, "fichier1");
+    printf("tar_index_is_file on the refreshed index returned %d\n", ret);
+    tar_index_free(index);
+    printf("should have returned : the same as check_archive, parsed 0 headers, 1\n\n");
+
+    out_fd = open("tests_refresh.tar", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, "first", "first\n", 6, NULL);
+    tar_writer_close(writer);
+    index = tar_index_build(out_fd);
+    refreshed = tar_refresh(out_fd, index);
+    ftruncate(out_fd, 0);
+    writer = tar_writer_open(out_fd, 0);
+    tar_writer_add_file(writer, "second", "second\n", 7, NULL);
+    tar_writer_close(writer);
+    ret = tar_refresh(out_fd, index);
+    printf("tar_refresh before and after rewriting the archive returned %d and %d\n", refreshed, ret);
+    printf("tar_index_exists on the refreshed index returned %d for the old member, %d for the new one\n",
+           tar_index_exists(index, "first"), tar_index_exists(index, "second"));
+    tar_index_free(index);
+    close(out_fd);
+    unlink("tests_refresh.tar");
+    printf("should have returned : 1 and 1, 0 for the old member, 1 for the new one\n\n");
+
+    int other_fd = open(argv[1], O_RDONLY);
+    ssize_t differences = tar_diff(fd, other_fd, TAR_DIFF_CONTENT, print_diff, NULL);
+    close(other_fd);
+    printf("tar_diff of the archive with itself returned %ld\n", differences);
+    printf("should have returned : 0\n\n");
+
     /*
     len = 1000;
     uint8_t buffer[len];